@@ -0,0 +1,448 @@
+/*
+    DefinitionImporter implementation
+    =================================
+
+    Purpose
+    - Implements the JSON / SCXML loaders and callback binding declared in
+      statemachine/definitionimporter.h.
+
+    Intent
+    - JSON: { "initial": id, "states": [...], "transitions": [...] } in any key
+      order. A state is an id string or { "id", "onEnter", "onExit" }; a
+      transition is { "event", "from", "to", "guard", "before", "after" }.
+      Unknown keys are skipped.
+    - SCXML: flat <state> / <final> children of <scxml>. <transition> gives
+      event (space-separated list), target and cond (a guard name); a <script>
+      inside <onentry>, <onexit> or <transition> names the callback. Other
+      executable content is skipped; nested states and <parallel> are
+      rejected because the machine has no hierarchy.
+    - Parse errors arrive as CParser / XmlParser exceptions and are turned
+      into InvalidDefinition at the public boundary.
+*/
+#include "definitionimporter.h"
+
+namespace Upp {
+
+void CallbackRegistry::AddStateCallback(const String& name, StateCallback fn) {
+    state_callbacks.GetAdd(name) = pick(fn);
+}
+
+void CallbackRegistry::AddGuard(const String& name, GuardCallback fn) {
+    guards.GetAdd(name) = pick(fn);
+}
+
+void CallbackRegistry::AddAction(const String& name, ActionCallback fn) {
+    actions.GetAdd(name) = pick(fn);
+}
+
+void CallbackRegistry::Clear() {
+    state_callbacks.Clear();
+    guards.Clear();
+    actions.Clear();
+}
+
+bool DefinitionImporter::Begin(StateMachine& sm) {
+    ClearError();
+    machine = nullptr;
+    declared.Clear();
+    events.Clear();
+    pair_keys.Clear();
+    pairs.Clear();
+    names.Clear();
+    last_from.Clear();
+    last_from_index = -1;
+    last_name.Clear();
+    last_name_index = -1;
+    state_bindings.Clear();
+    transition_bindings.Clear();
+    initial.Clear();
+    line = 0;
+    if (sm.IsStarted())
+        return Fail(StateMachineError::AlreadyStarted, "machine already started");
+    if (sm.GetStateCount() || sm.GetTransitionCount() || sm.GetSubMachineCount())
+        return Fail(StateMachineError::InvalidDefinition, "machine is not empty");
+    machine = &sm;
+    return true;
+}
+
+bool DefinitionImporter::Fail(StateMachineError e, const String& text) {
+    last_error = e;
+    error_text = line > 0 ? Format("line %d: %s", line, text) : text;
+    if (machine)
+        machine->Clear();
+    machine = nullptr;
+    state_bindings.Clear();
+    transition_bindings.Clear();
+    return false;
+}
+
+bool DefinitionImporter::Finish() {
+    line = 0;
+    for (int i = 0; i < declared.GetCount(); ++i)
+        if (!declared[i])
+            return Fail(StateMachineError::MissingState, "state '" + machine->states[i]->id + "' is not declared");
+    if (initial.IsEmpty() || machine->state_ids.Find(initial) < 0)
+        return Fail(StateMachineError::MissingState, "initial state '" + initial + "' is not declared");
+    machine->initial = initial;
+    machine->dispatch_dirty = true;
+    return true;
+}
+
+int DefinitionImporter::ReferState(const String& id) {
+    int i = machine->state_ids.Find(id);
+    if (i >= 0)
+        return i;
+    i = machine->states.GetCount();
+    machine->state_ids.Add(id);
+    machine->states.Add(MakeOne<State>())->id = id;
+    machine->dispatch_cache.Add();
+    declared.Add(0);
+    return i;
+}
+
+int DefinitionImporter::Name(const String& name) {
+    if (name.IsEmpty())
+        return -1;
+    if (last_name_index < 0 || name != last_name) {
+        last_name = name;
+        last_name_index = names.FindAdd(name);
+    }
+    return last_name_index;
+}
+
+bool DefinitionImporter::DeclareState(const String& id, const String& enter, const String& exit) {
+    if (id.IsEmpty())
+        return Fail(StateMachineError::EmptyStateId, "state without an id");
+    const int i = ReferState(id);
+    if (declared[i])
+        return Fail(StateMachineError::DuplicateStateId, "state '" + id + "' is declared twice");
+    declared[i] = 1;
+    if (initial.IsEmpty())
+        initial = id;
+    if (!enter.IsEmpty() || !exit.IsEmpty()) {
+        StateBinding& b = state_bindings.Add();
+        b.state = machine->states[i].Get();
+        b.enter = Name(enter);
+        b.exit = Name(exit);
+    }
+    return true;
+}
+
+bool DefinitionImporter::AddTransition(const String& event, const String& from, const String& to,
+                                       const String& guard, const String& before, const String& after)
+{
+    if (event.IsEmpty())
+        return Fail(StateMachineError::EmptyEvent, "transition without an event");
+    if (from.IsEmpty())
+        return Fail(StateMachineError::EmptyFromState, "transition '" + event + "' without a source");
+    if (to.IsEmpty())
+        return Fail(StateMachineError::EmptyToState, "transition '" + event + "' without a target");
+
+    if (last_from_index < 0 || from != last_from) {
+        last_from = from;
+        last_from_index = ReferState(from);
+    }
+    const int from_index = last_from_index;
+    ReferState(to);
+    const int64 key = (int64(from_index) << 32) | events.FindAdd(event);
+    const int k = pair_keys.Find(key);
+    Transition* t;
+    if (k < 0) {
+        pair_keys.Add(key);
+        Pair& pair = pairs.Add();
+        t = machine->transitions.Add(MakeOne<Transition>()).Get();
+        pair.first = t;
+        pair.open = !guard.IsEmpty();
+    }
+    else {
+        // Repeated pairs are choice candidates, closed by an unguarded default
+        Pair& pair = pairs[k];
+        if (!pair.open)
+            return Fail(StateMachineError::DuplicateTransition,
+                        "transition '" + event + "' from '" + from + "' follows an unguarded one");
+        pair.open = !guard.IsEmpty();
+        t = &machine->choices.GetAdd(pair.first).Add();
+    }
+    t->event = event;
+    t->from = from;
+    t->to = to;
+    if (!guard.IsEmpty() || !before.IsEmpty() || !after.IsEmpty()) {
+        TransitionBinding& b = transition_bindings.Add();
+        b.transition = t;
+        b.guard = Name(guard);
+        b.before = Name(before);
+        b.after = Name(after);
+    }
+    return true;
+}
+
+static void SkipJsonValue(CParser& p) {
+    if (p.IsString())
+        p.ReadString();
+    else if (p.Char('{')) {
+        while (!p.Char('}')) {
+            p.ReadString();
+            p.PassChar(':');
+            SkipJsonValue(p);
+            p.Char(',');
+        }
+    }
+    else if (p.Char('[')) {
+        while (!p.Char(']')) {
+            SkipJsonValue(p);
+            p.Char(',');
+        }
+    }
+    else if (p.Char('-') || p.IsDouble())
+        p.ReadDouble();
+    else
+        p.ReadId();    // true, false, null
+}
+
+bool DefinitionImporter::ParseJsonState(CParser& p) {
+    line = p.GetLine();
+    if (p.IsString())
+        return DeclareState(p.ReadString(), String(), String());
+    String id, enter, exit;
+    p.PassChar('{');
+    while (!p.Char('}')) {
+        const String key = p.ReadString();
+        p.PassChar(':');
+        if (key == "id")
+            id = p.ReadString();
+        else if (key == "onEnter")
+            enter = p.ReadString();
+        else if (key == "onExit")
+            exit = p.ReadString();
+        else
+            SkipJsonValue(p);
+        p.Char(',');
+    }
+    return DeclareState(id, enter, exit);
+}
+
+bool DefinitionImporter::ParseJsonTransition(CParser& p) {
+    line = p.GetLine();
+    String event, from, to, guard, before, after;
+    p.PassChar('{');
+    while (!p.Char('}')) {
+        const String key = p.ReadString();
+        p.PassChar(':');
+        if (key == "event")
+            event = p.ReadString();
+        else if (key == "from")
+            from = p.ReadString();
+        else if (key == "to")
+            to = p.ReadString();
+        else if (key == "guard")
+            guard = p.ReadString();
+        else if (key == "before")
+            before = p.ReadString();
+        else if (key == "after")
+            after = p.ReadString();
+        else
+            SkipJsonValue(p);
+        p.Char(',');
+    }
+    return AddTransition(event, from, to, guard, before, after);
+}
+
+bool DefinitionImporter::LoadJson(StateMachine& sm, const char* text) {
+    if (!Begin(sm))
+        return false;
+    try {
+        CParser p(text);
+        p.UnicodeEscape();
+        p.PassChar('{');
+        while (!p.Char('}')) {
+            line = p.GetLine();
+            const String key = p.ReadString();
+            p.PassChar(':');
+            if (key == "initial")
+                initial = p.ReadString();
+            else if (key == "states") {
+                p.PassChar('[');
+                while (!p.Char(']')) {
+                    if (!ParseJsonState(p))
+                        return false;
+                    p.Char(',');
+                }
+            }
+            else if (key == "transitions") {
+                p.PassChar('[');
+                while (!p.Char(']')) {
+                    if (!ParseJsonTransition(p))
+                        return false;
+                    p.Char(',');
+                }
+            }
+            else
+                SkipJsonValue(p);
+            p.Char(',');
+        }
+    }
+    catch (CParser::Error& e) {
+        line = 0;
+        return Fail(StateMachineError::InvalidDefinition, e);
+    }
+    return Finish();
+}
+
+String DefinitionImporter::ReadScxmlScript(XmlParser& p) {
+    String name;
+    while (!p.End()) {
+        if (p.Tag("script")) {
+            name = TrimBoth(p.ReadText());
+            while (!p.End())
+                p.Skip();
+        }
+        else
+            p.Skip();
+    }
+    return name;
+}
+
+bool DefinitionImporter::ParseScxmlState(XmlParser& p) {
+    line = p.GetLine();
+    const String id = p["id"];
+    if (id.IsEmpty())
+        return Fail(StateMachineError::EmptyStateId, "state without an id");
+    if (initial.IsEmpty())
+        initial = id;
+    String enter, exit;
+    while (!p.End()) {
+        if (p.Tag("transition")) {
+            line = p.GetLine();
+            const String events = p["event"];
+            const String target = p["target"];
+            const String cond = p["cond"];
+            const String action = ReadScxmlScript(p);
+            if (events.IsEmpty())
+                return Fail(StateMachineError::EmptyEvent, "eventless transitions are not supported");
+            const char* s = events;
+            while (*s) {
+                while (*s && (byte)*s <= ' ')
+                    ++s;
+                const char* e = s;
+                while (*e && (byte)*e > ' ')
+                    ++e;
+                if (e > s && !AddTransition(String(s, int(e - s)), id, target, cond, action, String()))
+                    return false;
+                s = e;
+            }
+        }
+        else if (p.Tag("onentry"))
+            enter = ReadScxmlScript(p);
+        else if (p.Tag("onexit"))
+            exit = ReadScxmlScript(p);
+        else if (p.Tag("state") || p.Tag("parallel") || p.Tag("final"))
+            return Fail(StateMachineError::InvalidDefinition, "state '" + id + "' is nested; hierarchy is not supported");
+        else
+            p.Skip();
+    }
+    return DeclareState(id, enter, exit);
+}
+
+bool DefinitionImporter::LoadScxml(StateMachine& sm, const char* text) {
+    if (!Begin(sm))
+        return false;
+    try {
+        XmlParser p(text);
+        while (!p.IsTag())
+            p.Skip();
+        line = p.GetLine();
+        if (!p.Tag("scxml"))
+            return Fail(StateMachineError::InvalidDefinition, "root element is not <scxml>");
+        initial = p["initial"];
+        while (!p.End()) {
+            if (p.Tag("state") || p.Tag("final")) {
+                if (!ParseScxmlState(p))
+                    return false;
+            }
+            else if (p.Tag("parallel"))
+                return Fail(StateMachineError::InvalidDefinition, "<parallel> is not supported");
+            else
+                p.Skip();
+        }
+    }
+    catch (XmlError& e) {
+        line = 0;
+        return Fail(StateMachineError::InvalidDefinition, e);
+    }
+    return Finish();
+}
+
+bool DefinitionImporter::LoadFile(StateMachine& sm, const char* path) {
+    const String text = Upp::LoadFile(path);
+    if (text.IsEmpty()) {
+        Begin(sm);
+        return Fail(StateMachineError::InvalidDefinition, String("cannot read ") + path);
+    }
+    const char* s = text;
+    while (*s && (byte)*s <= ' ')
+        ++s;
+    return *s == '<' ? LoadScxml(sm, text) : LoadJson(sm, text);
+}
+
+bool DefinitionImporter::Bind(StateMachine& sm, const CallbackRegistry& registry) {
+    if (&sm != machine) {
+        last_error = StateMachineError::InvalidDefinition;
+        error_text = "machine was not loaded by this importer";
+        return false;
+    }
+    if (sm.IsStarted()) {
+        last_error = StateMachineError::AlreadyStarted;
+        error_text = "machine already started";
+        return false;
+    }
+
+    // Resolve each distinct name once, and everything before attaching, so
+    // a missing name leaves the machine untouched
+    Vector<const CallbackRegistry::StateCallback*> state_fns;
+    Vector<const CallbackRegistry::GuardCallback*> guard_fns;
+    Vector<const CallbackRegistry::ActionCallback*> action_fns;
+    for (int i = 0; i < names.GetCount(); ++i) {
+        state_fns.Add(registry.FindStateCallback(names[i]));
+        guard_fns.Add(registry.FindGuard(names[i]));
+        action_fns.Add(registry.FindAction(names[i]));
+    }
+    auto missing = [&](const char* kind, int name) {
+        last_error = StateMachineError::UnboundCallback;
+        error_text = Format("%s '%s'", kind, names[name]);
+        return false;
+    };
+    for (const StateBinding& b : state_bindings) {
+        if (b.enter >= 0 && !state_fns[b.enter])
+            return missing("state callback", b.enter);
+        if (b.exit >= 0 && !state_fns[b.exit])
+            return missing("state callback", b.exit);
+    }
+    for (const TransitionBinding& b : transition_bindings) {
+        if (b.guard >= 0 && !guard_fns[b.guard])
+            return missing("guard", b.guard);
+        if (b.before >= 0 && !action_fns[b.before])
+            return missing("action", b.before);
+        if (b.after >= 0 && !action_fns[b.after])
+            return missing("action", b.after);
+    }
+
+    for (const StateBinding& b : state_bindings) {
+        if (b.enter >= 0)
+            b.state->OnEnter = *state_fns[b.enter];
+        if (b.exit >= 0)
+            b.state->OnExit = *state_fns[b.exit];
+    }
+    for (const TransitionBinding& b : transition_bindings) {
+        if (b.guard >= 0)
+            b.transition->Guard = *guard_fns[b.guard];
+        if (b.before >= 0)
+            b.transition->OnBefore = *action_fns[b.before];
+        if (b.after >= 0)
+            b.transition->OnAfter = *action_fns[b.after];
+    }
+    sm.dispatch_dirty = true;
+    ClearError();
+    return true;
+}
+
+} // namespace Upp
@@ -0,0 +1,131 @@
+/*
+    DefinitionImporter
+    ==================
+
+    Purpose
+    - Builds a StateMachine definition from JSON or SCXML text generated by
+      modelling tools, then binds its callbacks by name from a
+      CallbackRegistry.
+
+    Intent
+    - One streaming pass: CParser / XmlParser tokens go straight into the
+      machine's own state and transition storage, with no intermediate
+      document tree and no per-element State / Transition temporaries.
+    - States may be referenced before they are declared; ids resolve through
+      a hash index, so loading is linear in the file size.
+    - Repeated (from, event) pairs become ordered choice candidates, as with
+      AddChoice(); SCXML's document-order transition selection maps onto it.
+    - Callbacks are stored as names during the load and attached by Bind(),
+      so the file never needs to know about C++ code.
+
+    Thread context
+    - Same as StateMachine: configure on one thread before Start().
+*/
+
+#pragma once
+
+#include "statemachine.h"
+
+namespace Upp {
+
+	/// Named callbacks for DefinitionImporter::Bind()
+	class CallbackRegistry {
+	public:
+	    typedef Function<void(StateMachine&, Function<void(bool)> done)> StateCallback;
+	    typedef Function<bool(const TransitionContext&)>                 GuardCallback;
+	    typedef Function<void(const TransitionContext&)>                 ActionCallback;
+
+	    /// Later registrations under the same name replace earlier ones
+	    void AddStateCallback(const String& name, StateCallback fn);
+	    void AddGuard(const String& name, GuardCallback fn);
+	    void AddAction(const String& name, ActionCallback fn);
+
+	    const StateCallback*  FindStateCallback(const String& name) const { return state_callbacks.FindPtr(name); }
+	    const GuardCallback*  FindGuard(const String& name) const         { return guards.FindPtr(name); }
+	    const ActionCallback* FindAction(const String& name) const        { return actions.FindPtr(name); }
+
+	    void Clear();
+
+	private:
+	    VectorMap<String, StateCallback>  state_callbacks;
+	    VectorMap<String, GuardCallback>  guards;
+	    VectorMap<String, ActionCallback> actions;
+	};
+
+	class DefinitionImporter {
+	public:
+	    /// Load into an empty, unstarted machine. On failure the machine is
+	    /// cleared and GetLastError() / GetErrorText() say why.
+	    bool LoadJson(StateMachine& sm, const char* text);
+	    bool LoadScxml(StateMachine& sm, const char* text);
+
+	    /// Read a file and pick the format from its first non-blank character
+	    bool LoadFile(StateMachine& sm, const char* path);
+
+	    /// Attach every named callback from the last load. Fails with
+	    /// UnboundCallback, naming the first missing entry, and binds nothing.
+	    bool Bind(StateMachine& sm, const CallbackRegistry& registry);
+
+	    /// Callback references recorded by the last load
+	    int GetBindingCount() const              { return state_bindings.GetCount() + transition_bindings.GetCount(); }
+
+	    StateMachineError GetLastError() const   { return last_error; }
+	    /// Detail for the last error, e.g. "line 12: missing ':'" or "guard 'canRetry'"
+	    String GetErrorText() const              { return error_text; }
+	    void ClearError()                        { last_error = StateMachineError::None; error_text.Clear(); }
+
+	private:
+	    struct StateBinding : Moveable<StateBinding> {
+	        State* state = nullptr;
+	        int    enter = -1;       // index into names, -1 for none
+	        int    exit = -1;
+	    };
+
+	    struct TransitionBinding : Moveable<TransitionBinding> {
+	        Transition* transition = nullptr;
+	        int         guard = -1;
+	        int         before = -1;
+	        int         after = -1;
+	    };
+
+	    /// First candidate of a (from, event) pair, and whether more may follow
+	    struct Pair : Moveable<Pair> {
+	        Transition* first = nullptr;
+	        bool        open = false;    // last candidate so far has a guard
+	    };
+
+	    bool Begin(StateMachine& sm);
+	    bool Finish();
+	    bool Fail(StateMachineError e, const String& text);
+	    int  ReferState(const String& id);
+	    bool DeclareState(const String& id, const String& enter, const String& exit);
+	    bool AddTransition(const String& event, const String& from, const String& to,
+	                       const String& guard, const String& before, const String& after);
+	    int  Name(const String& name);
+
+	    bool ParseJsonState(CParser& p);
+	    bool ParseJsonTransition(CParser& p);
+	    bool ParseScxmlState(XmlParser& p);
+	    static String ReadScxmlScript(XmlParser& p);
+
+	    StateMachine*             machine = nullptr;
+	    Vector<byte>              declared;      // per machine state, 1 once declared
+	    Index<String>             events;
+	    Index<int64>              pair_keys;     // (from index, event index)
+	    Vector<Pair>              pairs;
+	    Index<String>             names;
+	    // Definitions list a source's transitions together and reuse a few
+	    // callback names, so the last lookup of each usually hits again
+	    String                    last_from;
+	    int                       last_from_index = -1;
+	    String                    last_name;
+	    int                       last_name_index = -1;
+	    Vector<StateBinding>      state_bindings;
+	    Vector<TransitionBinding> transition_bindings;
+	    String                    initial;
+	    int                       line = 0;      // where the current element starts
+	    StateMachineError         last_error = StateMachineError::None;
+	    String                    error_text;
+	};
+
+}
@@ -0,0 +1,474 @@
+/*
+    EventRouter implementation
+    ==========================
+
+    Purpose
+    - Implements the keyed instance pool declared in
+      statemachine/eventrouter.h.
+
+    Intent
+    - Lookups compare the stored hash before the key string, so a probe
+      usually touches one slot and no string data.
+    - A new instance is kept only if it starts; a failed Start() leaves no
+      slot and no pool entry behind.
+    - Membership is updated from the machine's commit hook: the instance is
+      unlinked from its old state list and appended to the tail of the new
+      one, so each list stays in commit order.
+    - Batched entries are flushed by count when they arrive and by age from
+      RunEnterBatches(); each flushed batch owns its completions, so results
+      can arrive in any order and after the batch has been refilled.
+    - The shared view sees the same moves. State ids are published before
+      the first commit that uses them, so readers never see an unnamed state.
+*/
+#include "eventrouter.h"
+
+namespace Upp {
+
+int EventRouter::FindIndex(const String& key, dword hash) const {
+    if (slots.IsEmpty())
+        return -1;
+    const int mask = slots.GetCount() - 1;
+    for (int i = hash & mask;; i = (i + 1) & mask) {
+        const Slot& s = slots[i];
+        if (s.index < 0)
+            return -1;
+        if (s.hash == hash && keys[s.index] == key)
+            return s.index;
+    }
+}
+
+void EventRouter::Grow() {
+    const int size = slots.IsEmpty() ? 16 : 2 * slots.GetCount();
+    const int mask = size - 1;
+    slots.Clear();
+    slots.SetCount(size);
+    for (int index = 0; index < hashes.GetCount(); ++index) {
+        int i = hashes[index] & mask;
+        while (slots[i].index >= 0)
+            i = (i + 1) & mask;
+        slots[i].hash = hashes[index];
+        slots[i].index = index;
+    }
+}
+
+int EventRouter::FindAdd(const String& key) {
+    if (key.IsEmpty()) {
+        Fail(StateMachineError::EmptyRouteKey);
+        return -1;
+    }
+    const dword hash = GetHashValue(key);
+    int index = FindIndex(key, hash);
+    if (index >= 0)
+        return index;
+
+    index = machines.GetCount();
+    StateMachine& sm = machines.Add();
+    members.Add();
+    if (WhenCreate)
+        WhenCreate(sm, key);
+    Hook(index, sm);
+    if (!sm.Start()) {
+        Fail(sm.GetLastError());
+        if (shared_view)
+            shared_view->Commit(index, members[index].state, -1, 0, false);
+        Unlink(index);
+        members.Drop();
+        machines.Drop();
+        return -1;
+    }
+
+    Insert(key, hash);
+    if (shared_view) {
+        shared_view->SetKey(index, key);
+        shared_view->SetInstanceCount(machines.GetCount());
+    }
+    return index;
+}
+
+void EventRouter::Insert(const String& key, dword hash) {
+    const int index = keys.GetCount();
+    keys.Add(key);
+    hashes.Add(hash);
+    if (2 * keys.GetCount() > slots.GetCount()) {
+        Grow();
+        return;
+    }
+    const int mask = slots.GetCount() - 1;
+    int i = hash & mask;
+    while (slots[i].index >= 0)
+        i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].index = index;
+}
+
+void EventRouter::Unlink(int index) {
+    Member& m = members[index];
+    if (m.state < 0)
+        return;
+    StateList& list = state_lists[m.state];
+    if (m.prev >= 0)
+        members[m.prev].next = m.next;
+    else
+        list.head = m.next;
+    if (m.next >= 0)
+        members[m.next].prev = m.prev;
+    else
+        list.tail = m.prev;
+    --list.count;
+    m.prev = m.next = m.state = -1;
+}
+
+void EventRouter::Hook(int index, StateMachine& sm) {
+    sm.commit_hook = [this, index](StateMachine& m) { Commit(index, m); };
+    if (enter_batches.IsEmpty())
+        sm.enter_hook.Clear();
+    else
+        sm.enter_hook = [this, index](StateMachine&, const String& state, Function<void(bool)>& done) {
+            return Enter(index, state, done);
+        };
+}
+
+void EventRouter::Commit(int index, const StateMachine& sm) {
+    const int from = members[index].state;
+    Unlink(index);
+    if (sm.IsStarted() && !sm.GetCurrent().IsEmpty()) {
+        Link(index, sm.GetCurrent(), GetNow());
+        ++state_lists[members[index].state].entered;
+    }
+    if (shared_view) {
+        PublishStateIds();
+        shared_view->Commit(index, from, members[index].state, sm.GetCommitCount());
+    }
+}
+
+void EventRouter::PublishStateIds() {
+    for (; published_states < state_ids.GetCount(); ++published_states)
+        shared_view->SetStateId(published_states, state_ids[published_states]);
+}
+
+void EventRouter::SetSharedView(SharedStateView* view) {
+    shared_view = view;
+    published_states = 0;
+    if (!view)
+        return;
+    view->Reset();
+    PublishStateIds();
+    for (int i = 0; i < state_lists.GetCount(); ++i)
+        view->SetStateCounts(i, state_lists[i].count, state_lists[i].entered);
+    for (int i = 0; i < machines.GetCount(); ++i) {
+        view->SetKey(i, keys[i]);
+        view->SetInstance(i, members[i].state, machines[i].GetCommitCount());
+    }
+    view->SetInstanceCount(machines.GetCount());
+}
+
+void EventRouter::Link(int index, const String& id, int64 entered_at) {
+    const int state = state_ids.FindAdd(id);
+    if (state >= state_lists.GetCount())
+        state_lists.SetCount(state + 1);
+    StateList& list = state_lists[state];
+    Member& m = members[index];
+    m.state = state;
+    m.entered_at = entered_at;
+    m.prev = list.tail;
+    if (list.tail >= 0)
+        members[list.tail].next = index;
+    else
+        list.head = index;
+    list.tail = index;
+    ++list.count;
+}
+
+int EventRouter::GetMemberCount(const String& state) const {
+    const int i = state_ids.Find(state);
+    return i >= 0 ? state_lists[i].count : 0;
+}
+
+int EventRouter::GetFirstMember(const String& state) const {
+    const int i = state_ids.Find(state);
+    return i >= 0 ? state_lists[i].head : -1;
+}
+
+Vector<int> EventRouter::GetMembers(const String& state) const {
+    Vector<int> result;
+    result.Reserve(GetMemberCount(state));
+    for (int i = GetFirstMember(state); i >= 0; i = members[i].next)
+        result.Add(i);
+    return result;
+}
+
+int EventRouter::Dispatch(const Vector<int>& targets, const String& event) {
+    int accepted = 0;
+    for (int i : targets) {
+        if (machines[i].TriggerEvent(event))
+            ++accepted;
+        else
+            Fail(machines[i].GetLastError());
+    }
+    return accepted;
+}
+
+int EventRouter::Broadcast(const String& event, const String& in_state) {
+    ClearError();
+    return Dispatch(GetMembers(in_state), event);
+}
+
+Vector<int> EventRouter::GetStale(const String& state, int64 older_than) const {
+    Vector<int> result;
+    const int64 cutoff = GetNow() - older_than;
+    for (int i = GetFirstMember(state); i >= 0 && members[i].entered_at < cutoff; i = members[i].next)
+        result.Add(i);
+    return result;
+}
+
+int EventRouter::Sweep(const String& state, int64 older_than, const String& event) {
+    ClearError();
+    return Dispatch(GetStale(state, older_than), event);
+}
+
+void EventRouter::AddSweep(const String& state, int64 older_than, const String& event) {
+    SweepRule& r = sweeps.Add();
+    r.state = state;
+    r.older_than = older_than;
+    r.event = event;
+}
+
+int EventRouter::RunSweeps() {
+    ClearError();
+    int accepted = 0;
+    for (const SweepRule& r : sweeps)
+        accepted += Dispatch(GetStale(r.state, r.older_than), r.event);
+    return accepted;
+}
+
+void EventRouter::SetEnterBatch(const String& state, EnterBatchHandler handler, int max_count, int64 max_wait) {
+    const bool first = enter_batches.IsEmpty();
+    EnterBatch& batch = enter_batches.GetAdd(state);
+    batch.handler = pick(handler);
+    batch.max_count = max(max_count, 1);
+    batch.max_wait = max(max_wait, (int64)0);
+    if (first)
+        for (int i = 0; i < machines.GetCount(); ++i)
+            Hook(i, machines[i]);
+}
+
+void EventRouter::RemoveEnterBatch(const String& state) {
+    const int i = enter_batches.Find(state);
+    if (i < 0)
+        return;
+    FlushEnterBatch(i);
+    const int j = enter_batches.Find(state);    // the handler may have changed the map
+    if (j >= 0)
+        enter_batches.Remove(j);
+    if (enter_batches.IsEmpty())
+        for (int j = 0; j < machines.GetCount(); ++j)
+            Hook(j, machines[j]);
+}
+
+bool EventRouter::Enter(int index, const String& state, Function<void(bool)>& done) {
+    const int i = enter_batches.Find(state);
+    if (i < 0)
+        return false;
+    EnterBatch& batch = enter_batches[i];
+    const int64 now = GetNow();
+    if (batch.instances.IsEmpty())
+        batch.first_at = now;
+    batch.instances.Add(index);
+    batch.done.Add(pick(done));
+    if (batch.instances.GetCount() >= batch.max_count || now - batch.first_at >= batch.max_wait)
+        FlushEnterBatch(i);
+    return true;
+}
+
+void EventRouter::FlushEnterBatch(int i) {
+    EnterBatch& batch = enter_batches[i];
+    if (batch.instances.IsEmpty())
+        return;
+    // Detach the batch first: results may be given synchronously, and the
+    // instances they finish can enter this state again
+    const Vector<int> instances = pick(batch.instances);
+    auto done = std::make_shared<Vector<Function<void(bool)>>>(pick(batch.done));
+    batch.instances.Clear();
+    batch.done.Clear();
+    ++enter_batches_sent;
+    const String state = enter_batches.GetKey(i);
+    const EnterBatchHandler handler = batch.handler;
+    handler(state, instances, [done](int item, bool ok) {
+        if (item < 0 || item >= done->GetCount() || !(*done)[item])
+            return;
+        Function<void(bool)> finish = pick((*done)[item]);
+        (*done)[item].Clear();
+        finish(ok);
+    });
+}
+
+int EventRouter::RunEnterBatches() {
+    const int64 now = GetNow();
+    int flushed = 0;
+    for (int i = 0; i < enter_batches.GetCount(); ++i) {
+        const EnterBatch& batch = enter_batches[i];
+        if (!batch.instances.IsEmpty() && now - batch.first_at >= batch.max_wait) {
+            FlushEnterBatch(i);
+            ++flushed;
+        }
+    }
+    return flushed;
+}
+
+int EventRouter::FlushEnterBatches() {
+    int flushed = 0;
+    for (int i = 0; i < enter_batches.GetCount(); ++i)
+        if (!enter_batches[i].instances.IsEmpty()) {
+            FlushEnterBatch(i);
+            ++flushed;
+        }
+    return flushed;
+}
+
+int EventRouter::GetPendingEntryCount(const String& state) const {
+    const int i = enter_batches.Find(state);
+    return i >= 0 ? enter_batches[i].instances.GetCount() : 0;
+}
+
+StateMachine* EventRouter::Find(const String& key) {
+    const int index = FindIndex(key, GetHashValue(key));
+    return index >= 0 ? &machines[index] : nullptr;
+}
+
+const StateMachine* EventRouter::Find(const String& key) const {
+    const int index = FindIndex(key, GetHashValue(key));
+    return index >= 0 ? &machines[index] : nullptr;
+}
+
+bool EventRouter::Route(const String& key, const String& event) {
+    const int index = FindAdd(key);
+    if (index < 0)
+        return false;
+    if (!machines[index].TriggerEvent(event)) {
+        Fail(machines[index].GetLastError());
+        return false;
+    }
+    ClearError();
+    return true;
+}
+
+int EventRouter::RouteBatch(const Vector<RoutedEvent>& batch) {
+    ClearError();
+    const int n = batch.GetCount();
+    batch_index.SetCount(n);
+    for (int i = 0; i < n; ++i)
+        batch_index[i] = FindAdd(batch[i].key);
+
+    // Counting sort by instance keeps each key's events in arrival order
+    batch_start.Clear();
+    batch_start.SetCount(machines.GetCount() + 1, 0);
+    for (int index : batch_index)
+        if (index >= 0)
+            ++batch_start[index + 1];
+    for (int i = 1; i < batch_start.GetCount(); ++i)
+        batch_start[i] += batch_start[i - 1];
+    batch_order.SetCount(batch_start.Top());
+    for (int i = 0; i < n; ++i)
+        if (batch_index[i] >= 0)
+            batch_order[batch_start[batch_index[i]]++] = i;
+
+    int accepted = 0;
+    for (int i : batch_order) {
+        StateMachine& sm = machines[batch_index[i]];
+        if (sm.TriggerEvent(batch[i].event))
+            ++accepted;
+        else
+            Fail(sm.GetLastError());
+    }
+    return accepted;
+}
+
+void EventRouter::Release(Vector<Migrant>& out) {
+    // Collected entries are handed out while their indices still hold
+    FlushEnterBatches();
+    const int base = out.GetCount();
+    for (int i = 0; i < machines.GetCount(); ++i) {
+        Migrant& m = out.Add();
+        m.key = keys[i];
+        m.linked = members[i].state >= 0;
+        m.entered_at = members[i].entered_at;
+    }
+    // Detach from the back so the Array never shifts
+    for (int i = machines.GetCount() - 1; i >= 0; --i) {
+        StateMachine* sm = machines.Detach(i);
+        sm->commit_hook.Clear();
+        sm->enter_hook.Clear();
+        out[base + i].machine.Attach(sm);
+    }
+    Clear();
+}
+
+bool EventRouter::Adopt(Migrant&& m) {
+    if (m.key.IsEmpty()) {
+        Fail(StateMachineError::EmptyRouteKey);
+        return false;
+    }
+    const dword hash = GetHashValue(m.key);
+    if (!m.machine || FindIndex(m.key, hash) >= 0) {
+        Fail(StateMachineError::DuplicateStateId);
+        return false;
+    }
+    const int index = machines.GetCount();
+    StateMachine& sm = machines.Add(m.machine.Detach());
+    members.Add();
+    Hook(index, sm);
+    if (m.linked)
+        Link(index, sm.GetCurrent(), m.entered_at);
+    Insert(m.key, hash);
+    if (shared_view) {
+        PublishStateIds();
+        shared_view->SetKey(index, m.key);
+        shared_view->Commit(index, -1, members[index].state, sm.GetCommitCount(), false);
+        shared_view->SetInstanceCount(machines.GetCount());
+    }
+    ClearError();
+    return true;
+}
+
+template <class T>
+static void Reallocate(Vector<T>& v) {
+    Vector<T> fresh;
+    fresh.Reserve(v.GetCount());
+    for (T& x : v)
+        fresh.Add(pick(x));
+    v = pick(fresh);
+}
+
+void EventRouter::Rehome() {
+    Reallocate(slots);
+    Reallocate(keys);
+    Reallocate(hashes);
+    Reallocate(members);
+    Reallocate(state_lists);
+    for (StateMachine& m : machines)
+        m.Rehome();
+    batch_index.Clear();
+    batch_order.Clear();
+    batch_start.Clear();
+}
+
+void EventRouter::Clear() {
+    slots.Clear();
+    keys.Clear();
+    hashes.Clear();
+    machines.Clear();
+    members.Clear();
+    state_ids.Clear();
+    state_lists.Clear();
+    for (int i = 0; i < enter_batches.GetCount(); ++i) {
+        enter_batches[i].instances.Clear();
+        enter_batches[i].done.Clear();
+    }
+    if (shared_view) {
+        shared_view->Reset();
+        published_states = 0;
+    }
+    ClearError();
+}
+
+} // namespace Upp
@@ -0,0 +1,230 @@
+/*
+    EventRouter
+    ===========
+
+    Purpose
+    - Routes (key, event) pairs to one StateMachine instance per entity key.
+    - Instances are created on first sight of a key: WhenCreate configures a
+      fresh machine (typically AddState()/AddTransition(), or AddSubMachine()
+      to share one heavy definition), and the router then calls Start().
+
+    Intent
+    - Keep key lookup cheap: an open-addressing table of (hash, instance)
+      slots with linear probing. Hashes are computed once per key and kept,
+      so growing the table never rehashes strings.
+    - Instances live in one Array and keep stable addresses.
+    - RouteBatch() groups a batch by instance before dispatching, so each
+      machine handles its events back to back, in their original order.
+    - Each instance sits on an intrusive list for its committed state. The
+      machine reports every commit, so membership counts are O(1) and member
+      iteration is O(members).
+    - Commits append at the list tail with a clock stamp, so every list is
+      ordered by entry time and stale queries stop at the first fresh member.
+    - An optional SharedStateView mirrors states and counters for readers in
+      other processes; it is updated from the same commit path.
+    - Batched entry: instances entering a batched state hand their OnEnter
+      completion to the router, which passes the collected entries to one
+      handler call and fans each result back to its instance.
+
+    Thread context
+    - Same as StateMachine: no internal locking.
+*/
+
+#pragma once
+
+#include "statemachine.h"
+#include "sharedstateview.h"
+
+namespace Upp {
+
+	/// One ingress tuple for EventRouter::RouteBatch()
+	struct RoutedEvent : Moveable<RoutedEvent> {
+	    String key;
+	    String event;
+	};
+
+	class EventRouter {
+	public:
+	    /// Configure a newly created instance before the router starts it
+	    Function<void(StateMachine&, const String& key)> WhenCreate;
+
+	    /// Deliver one event, creating and starting the key's instance if needed
+	    bool Route(const String& key, const String& event);
+
+	    /// Deliver a batch grouped by instance; returns the number accepted.
+	    /// Failures do not stop the batch; GetLastError() keeps the last one.
+	    int RouteBatch(const Vector<RoutedEvent>& batch);
+
+	    /// Instance lookup without creation; nullptr when the key is unknown
+	    StateMachine* Find(const String& key);
+	    const StateMachine* Find(const String& key) const;
+
+	    /// Instances in creation order
+	    int GetCount() const                     { return machines.GetCount(); }
+	    const String& GetKey(int i) const        { return keys[i]; }
+	    StateMachine& operator[](int i)          { return machines[i]; }
+	    const StateMachine& operator[](int i) const { return machines[i]; }
+
+	    /// Committed-state membership; instances still starting are in no state
+	    int GetMemberCount(const String& state) const;
+	    int GetFirstMember(const String& state) const;
+	    int GetNextMember(int i) const           { return members[i].next; }
+	    Vector<int> GetMembers(const String& state) const;
+
+	    /// States seen so far, by dense index, with member and entry counts
+	    int GetStateIdCount() const              { return state_ids.GetCount(); }
+	    const String& GetStateId(int i) const    { return state_ids[i]; }
+	    int GetMemberCountAt(int i) const        { return state_lists[i].count; }
+	    int64 GetEntryCountAt(int i) const       { return state_lists[i].entered; }
+
+	    /// Failures reported by Route(), RouteBatch(), Broadcast(), sweeps and Adopt()
+	    int64 GetErrorCount(StateMachineError e) const { return error_counts[int(e)]; }
+
+	    /// Trigger event on every instance committed to in_state; returns the
+	    /// number accepted. Members are snapshotted first, so instances that
+	    /// move during the broadcast are visited once.
+	    int Broadcast(const String& event, const String& in_state);
+
+	    /// Clock used to stamp commits, in microseconds; defaults to usecs().
+	    /// It must not go backwards. Tests can install a virtual clock.
+	    void SetClock(Function<int64()> now)     { clock = pick(now); }
+	    int64 GetNow() const                     { return clock ? clock() : usecs(); }
+	    int64 GetEnteredAt(int i) const          { return members[i].entered_at; }
+
+	    /// Members committed to state more than older_than ago, oldest first.
+	    /// Cost is O(stale members).
+	    Vector<int> GetStale(const String& state, int64 older_than) const;
+
+	    /// Trigger event on the stale members of state; returns the number accepted
+	    int Sweep(const String& state, int64 older_than, const String& event);
+
+	    /// Register a sweep for RunSweeps(), e.g. a timeout event per state
+	    void AddSweep(const String& state, int64 older_than, const String& event);
+	    int RunSweeps();
+
+	    /// Handles one batch of entries into a state. Call done(item, ok) once
+	    /// per item of instances, now or later on the owner thread; each
+	    /// instance finishes its entry with that result.
+	    typedef Function<void(const String& state, const Vector<int>& instances,
+	                          Function<void(int item, bool ok)> done)> EnterBatchHandler;
+
+	    /// Collect entries into state across instances and hand them to handler
+	    /// together, once max_count have arrived or the first has waited
+	    /// max_wait microseconds. Takes the place of the state's own OnEnter.
+	    void SetEnterBatch(const String& state, EnterBatchHandler handler, int max_count, int64 max_wait);
+	    /// Stop batching state; entries already collected are flushed first
+	    void RemoveEnterBatch(const String& state);
+
+	    /// Hand out batches whose first entry has waited max_wait; call it
+	    /// periodically, like RunSweeps(). Returns the number of batches.
+	    int RunEnterBatches();
+	    /// Hand out every collected entry now
+	    int FlushEnterBatches();
+	    int GetPendingEntryCount(const String& state) const;
+	    int64 GetEnterBatchCount() const         { return enter_batches_sent; }
+
+	    /// An instance with its runtime state, handed between routers
+	    struct Migrant : Moveable<Migrant> {
+	        String             key;
+	        One<StateMachine>  machine;
+	        bool               linked = false;    // committed to a state list
+	        int64              entered_at = 0;
+	    };
+
+	    /// Move every instance out, in creation order; the router is left empty
+	    void Release(Vector<Migrant>& out);
+
+	    /// Take over a released instance without restarting it. Fails for an
+	    /// empty key (EmptyRouteKey) or a key already present (DuplicateStateId).
+	    /// Adopt in entry-time order to keep state lists ordered.
+	    bool Adopt(Migrant&& m);
+
+	    /// Re-allocate the index and membership tables, and each instance's
+	    /// queues, history and dispatch cache, from the calling thread, so a
+	    /// pinned owner gets them on its NUMA node. The StateMachine objects
+	    /// themselves are not moved: pending callbacks may point at them.
+	    void Rehome();
+
+	    /// Publish every instance and state into view, then keep it current on
+	    /// each commit; nullptr detaches. The view must stay open while attached.
+	    void SetSharedView(SharedStateView* view);
+	    SharedStateView* GetSharedView() const   { return shared_view; }
+
+	    /// Drop every instance; WhenCreate and sweeps are kept
+	    void Clear();
+
+	    StateMachineError GetLastError() const   { return last_error; }
+	    void ClearError()                        { last_error = StateMachineError::None; }
+
+	private:
+	    struct Slot : Moveable<Slot> {
+	        dword hash = 0;
+	        int   index = -1;    // -1 marks an empty slot
+	    };
+
+	    /// Intrusive list node of one instance
+	    struct Member : Moveable<Member> {
+	        int prev = -1;
+	        int next = -1;
+	        int state = -1;      // index into state_ids, -1 when uncommitted
+	        int64 entered_at = 0;
+	    };
+
+	    struct SweepRule : Moveable<SweepRule> {
+	        String state;
+	        int64  older_than = 0;
+	        String event;
+	    };
+
+	    struct StateList : Moveable<StateList> {
+	        int head = -1;
+	        int tail = -1;
+	        int count = 0;
+	        int64 entered = 0;   // commits into this state
+	    };
+
+	    /// Entries collected for one batched state
+	    struct EnterBatch : Moveable<EnterBatch> {
+	        EnterBatchHandler            handler;
+	        int                          max_count = 1;
+	        int64                        max_wait = 0;
+	        int64                        first_at = 0;
+	        Vector<int>                  instances;
+	        Vector<Function<void(bool)>> done;
+	    };
+
+	    void Fail(StateMachineError e)           { last_error = e; ++error_counts[int(e)]; }
+	    void Unlink(int index);
+	    void Commit(int index, const StateMachine& sm);
+	    void Link(int index, const String& id, int64 entered_at);
+	    void Hook(int index, StateMachine& sm);
+	    bool Enter(int index, const String& state, Function<void(bool)>& done);
+	    void FlushEnterBatch(int i);
+	    void PublishStateIds();
+	    void Insert(const String& key, dword hash);
+	    int Dispatch(const Vector<int>& targets, const String& event);
+	    int FindIndex(const String& key, dword hash) const;
+	    int FindAdd(const String& key);
+	    void Grow();
+
+	    Vector<Slot>         slots;     // power-of-two size, at most half full
+	    Vector<String>       keys;
+	    Vector<dword>        hashes;
+	    Array<StateMachine>  machines;
+	    Vector<Member>       members;
+	    Index<String>        state_ids;
+	    Vector<StateList>    state_lists;
+	    Vector<SweepRule>    sweeps;
+	    VectorMap<String, EnterBatch> enter_batches;
+	    int64                enter_batches_sent = 0;
+	    Function<int64()>    clock;
+	    Vector<int>          batch_index;
+	    Vector<int>          batch_order;
+	    Vector<int>          batch_start;
+	    int64                error_counts[STATE_MACHINE_ERROR_COUNT] = {};
+	    SharedStateView*     shared_view = nullptr;
+	    int                  published_states = 0;
+	    StateMachineError    last_error = StateMachineError::None;
+	};
+
+}
@@ -0,0 +1,558 @@
+/*
+    HistoryArchive implementation
+    =============================
+
+    Purpose
+    - Implements the segmented transition archive declared in
+      statemachine/historyarchive.h.
+
+    Intent
+    - Directory layout: names.dat holds the name dictionary as length-prefixed
+      strings in id order. seg-NNNNNN.rec holds a segment's records, and
+      seg-NNNNNN.idx its index once sealed. Segments are numbered from 0
+      without gaps.
+    - Index file: IndexHeader, the sparse times, MachineEntry rows sorted by
+      machine id, then every machine's record positions in time order.
+      It is written to a temporary name and renamed, so a crash never leaves
+      a half-written index behind.
+    - Open() trims torn tails from names.dat and the last segment, rebuilds
+      the active segment's in-memory index from its records, and seals any
+      earlier segment that lost its index.
+    - Names are written before the records that use them, so every record on
+      disk resolves.
+*/
+#include "historyarchive.h"
+
+#include <chrono>
+
+#ifdef PLATFORM_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Upp {
+
+static constexpr dword ARCHIVE_INDEX_MAGIC = 0x31414853;   // "SHA1"
+static constexpr int PENDING_RECORDS = 256;                // written in batches
+
+struct HistoryArchive::IndexHeader {
+    dword magic;
+    int   machine_count;
+    int64 count;
+    int64 first_time;
+    int64 last_time;
+    int   sparse_count;
+    int   reserved;
+};
+
+struct HistoryArchive::MachineEntry {
+    int   machine;
+    int   count;
+    int64 offset;    // into the positions array
+};
+
+/// A segment's records and index as seen by one query
+struct HistoryArchive::View {
+    const Record*       records = nullptr;
+    int64               count = 0;
+    const int64*        sparse = nullptr;
+    int                 sparse_count = 0;
+    const MachineEntry* machines = nullptr;     // sealed segments only
+    int                 machine_count = 0;
+    const int*          positions = nullptr;
+};
+
+#ifdef PLATFORM_POSIX
+static bool WriteAll(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size) {
+        const ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+/// Read-only mapping of a whole file; nullptr if missing or empty. With
+/// reserve the mapping spans at least that many bytes, so later appends
+/// show through it; pages past the end of the file must not be touched.
+static void* MapFile(const String& path, size_t& size, size_t reserve = 0) {
+    size = 0;
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && max(size_t(st.st_size), reserve) > 0) {
+        size = max(size_t(st.st_size), reserve);
+        p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return p == MAP_FAILED ? nullptr : p;
+}
+#endif
+
+int64 HistoryArchive::GetNow() const {
+    if (clock)
+        return clock();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int64 HistoryArchive::GetRecordCount() const {
+    int64 n = 0;
+    for (const Segment& seg : segments)
+        n += seg.count;
+    return n;
+}
+
+String HistoryArchive::SegmentPath(int i, const char* ext) const {
+    return Format("%s/seg-%06d.%s", directory, i, ext);
+}
+
+bool HistoryArchive::Fail(const String& text) {
+    last_error = StateMachineError::ArchiveFailed;
+    error_text = text;
+    return false;
+}
+
+int HistoryArchive::Name(const String& s) {
+    return names.FindAdd(s);
+}
+
+//------------------------------------------------------------------------------
+// Open / close
+//------------------------------------------------------------------------------
+bool HistoryArchive::Open(const char* dir) {
+    static_assert(sizeof(Record) == 24, "archive records are 24 bytes on disk");
+    Close();
+    ClearError();
+#ifdef PLATFORM_POSIX
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return Fail(String("cannot create directory ") + dir);
+    directory = dir;
+    bool ok = LoadNames();
+    struct stat st;
+    for (int i = 0; ok && stat(SegmentPath(i, "rec"), &st) == 0; ++i)
+        segments.Add();
+    for (int i = 0; ok && i < segments.GetCount(); ++i)
+        ok = LoadSegment(i);
+    if (ok && (segments.IsEmpty() || segments.Top().sealed))
+        ok = StartSegment();
+    if (!ok) {
+        const String text = error_text;
+        Close();
+        return Fail(text);
+    }
+    return true;
+#else
+    return Fail("history archives need POSIX files");
+#endif
+}
+
+void HistoryArchive::Close() {
+#ifdef PLATFORM_POSIX
+    if (IsOpen())
+        Flush();
+    for (Segment& seg : segments) {
+        if (seg.record_map)
+            munmap(seg.record_map, seg.record_size);
+        if (seg.index_map)
+            munmap(seg.index_map, seg.index_size);
+    }
+    if (names_fd >= 0)
+        close(names_fd);
+    if (active_fd >= 0)
+        close(active_fd);
+#endif
+    names_fd = active_fd = -1;
+    directory.Clear();
+    names.Clear();
+    names_written = 0;
+    segments.Clear();
+    pending.Clear();
+    active_positions.Clear();
+    active_sparse.Clear();
+    last_time = 0;
+}
+
+bool HistoryArchive::LoadNames() {
+#ifdef PLATFORM_POSIX
+    const String path = directory + "/names.dat";
+    size_t size = 0;
+    size_t valid = 0;
+    if (void* p = MapFile(path, size)) {
+        const char* s = (const char*)p;
+        int len;
+        while (valid + sizeof(len) <= size) {
+            memcpy(&len, s + valid, sizeof(len));
+            if (len < 0 || valid + sizeof(len) + len > size)
+                break;
+            names.Add(String(s + valid + sizeof(len), len));
+            valid += sizeof(len) + len;
+        }
+        munmap(p, size);
+    }
+    names_written = names.GetCount();
+    names_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (names_fd < 0 || (valid < size && ftruncate(names_fd, off_t(valid)) != 0))
+        return Fail("cannot open " + path);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Sealed: read the index header. Unsealed: rebuild the index from the records,
+// then resume it if it is the last segment or seal it otherwise.
+bool HistoryArchive::LoadSegment(int i) {
+#ifdef PLATFORM_POSIX
+    Segment& seg = segments[i];
+    const String index_path = SegmentPath(i, "idx");
+    const int fd = open(index_path, O_RDONLY);
+    if (fd >= 0) {
+        IndexHeader h;
+        const bool ok = read(fd, &h, sizeof(h)) == ssize_t(sizeof(h)) && h.magic == ARCHIVE_INDEX_MAGIC;
+        close(fd);
+        if (!ok)
+            return Fail("bad index " + index_path);
+        seg.count = h.count;
+        seg.first_time = h.first_time;
+        seg.last_time = h.last_time;
+        seg.sealed = true;
+        last_time = max(last_time, seg.last_time);
+        return true;
+    }
+
+    const String record_path = SegmentPath(i, "rec");
+    size_t size = 0;
+    const void* p = MapFile(record_path, size);
+    const int count = int(size / sizeof(Record));
+    active_positions.Clear();
+    active_sparse.Clear();
+    seg = Segment();
+    for (int k = 0; k < count; ++k) {
+        const Record& r = ((const Record*)p)[k];
+        const int limit = names.GetCount();
+        if (r.machine < 0 || r.machine >= limit || r.from < 0 || r.from >= limit ||
+            r.to < 0 || r.to >= limit || r.event < 0 || r.event >= limit)
+            break;    // torn write: names are always flushed first
+        if (k % SPARSE_STEP == 0)
+            active_sparse.Add(r.time);
+        active_positions.GetAdd(r.machine).Add(k);
+        if (k == 0)
+            seg.first_time = r.time;
+        seg.last_time = r.time;
+        ++seg.count;
+    }
+    if (p)
+        munmap((void*)p, size);
+    last_time = max(last_time, seg.last_time);
+    active_fd = open(record_path, O_WRONLY | O_APPEND);
+    if (active_fd < 0 || ftruncate(active_fd, off_t(seg.count * sizeof(Record))) != 0)
+        return Fail("cannot open " + record_path);
+    return i == segments.GetCount() - 1 || Seal(i);
+#else
+    return false;
+#endif
+}
+
+bool HistoryArchive::StartSegment() {
+#ifdef PLATFORM_POSIX
+    segments.Add();
+    const String path = SegmentPath(segments.GetCount() - 1, "rec");
+    active_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    active_positions.Clear();
+    active_sparse.Clear();
+    if (active_fd < 0)
+        return Fail("cannot create " + path);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool HistoryArchive::Seal(int i) {
+#ifdef PLATFORM_POSIX
+    if (!Flush())
+        return false;
+    const Segment& seg = segments[i];
+    Vector<int> machines;
+    for (int k = 0; k < active_positions.GetCount(); ++k)
+        machines.Add(active_positions.GetKey(k));
+    Sort(machines);
+
+    IndexHeader h;
+    h.magic = ARCHIVE_INDEX_MAGIC;
+    h.machine_count = machines.GetCount();
+    h.count = seg.count;
+    h.first_time = seg.first_time;
+    h.last_time = seg.last_time;
+    h.sparse_count = active_sparse.GetCount();
+    h.reserved = 0;
+    Vector<MachineEntry> entries;
+    int64 offset = 0;
+    for (int m : machines) {
+        MachineEntry& e = entries.Add();
+        e.machine = m;
+        e.count = active_positions.Get(m).GetCount();
+        e.offset = offset;
+        offset += e.count;
+    }
+
+    const String path = SegmentPath(i, "idx");
+    const String temp = path + ".tmp";
+    const int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0
+              && WriteAll(fd, &h, sizeof(h))
+              && WriteAll(fd, active_sparse.Begin(), active_sparse.GetCount() * sizeof(int64))
+              && WriteAll(fd, entries.Begin(), entries.GetCount() * sizeof(MachineEntry));
+    for (int k = 0; ok && k < machines.GetCount(); ++k) {
+        const Vector<int>& positions = active_positions.Get(machines[k]);
+        ok = WriteAll(fd, positions.Begin(), positions.GetCount() * sizeof(int));
+    }
+    if (fd >= 0)
+        ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp, path) != 0) {
+        unlink(temp);
+        return Fail("cannot write " + path);
+    }
+    close(active_fd);
+    active_fd = -1;
+    segments[i].sealed = true;
+    active_positions.Clear();
+    active_sparse.Clear();
+    return true;
+#else
+    return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Appending
+//------------------------------------------------------------------------------
+bool HistoryArchive::Add(const String& machine, const String& from, const String& to, const String& event) {
+    if (!IsOpen())
+        return Fail("archive is not open");
+    const int64 now = max(GetNow(), last_time);
+    last_time = now;
+
+    Segment& seg = segments.Top();
+    const int pos = int(seg.count);
+    Record& r = pending.Add();
+    r.time = now;
+    r.machine = Name(machine);
+    r.from = Name(from);
+    r.to = Name(to);
+    r.event = Name(event);
+    if (pos % SPARSE_STEP == 0)
+        active_sparse.Add(now);
+    active_positions.GetAdd(r.machine).Add(pos);
+    if (seg.count++ == 0)
+        seg.first_time = now;
+    seg.last_time = now;
+
+    if (seg.count >= max_segment_records)
+        return Seal(segments.GetCount() - 1) && StartSegment();
+    if (pending.GetCount() >= PENDING_RECORDS)
+        return Flush();
+    return true;
+}
+
+bool HistoryArchive::Flush() {
+#ifdef PLATFORM_POSIX
+    if (!IsOpen())
+        return Fail("archive is not open");
+    if (names_written < names.GetCount()) {
+        String buffer;
+        for (int i = names_written; i < names.GetCount(); ++i) {
+            const int len = names[i].GetLength();
+            buffer.Cat((const char*)&len, sizeof(len));
+            buffer.Cat(names[i]);
+        }
+        if (!WriteAll(names_fd, buffer.Begin(), buffer.GetLength()))
+            return Fail("cannot write names.dat");
+        names_written = names.GetCount();
+    }
+    if (!pending.IsEmpty()) {
+        if (active_fd < 0 || !WriteAll(active_fd, pending.Begin(), pending.GetCount() * sizeof(Record)))
+            return Fail("cannot write " + SegmentPath(segments.GetCount() - 1, "rec"));
+        pending.Clear();
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Queries
+//------------------------------------------------------------------------------
+int HistoryArchive::Query(const String& machine, int64 begin, int64 end, Vector<ArchivedTransition>& out) {
+    if (!IsOpen()) {
+        Fail("archive is not open");
+        return -1;
+    }
+    const int m = names.Find(machine);
+    return m < 0 ? 0 : QueryRange(m, begin, end, out);
+}
+
+int HistoryArchive::Query(int64 begin, int64 end, Vector<ArchivedTransition>& out) {
+    if (!IsOpen()) {
+        Fail("archive is not open");
+        return -1;
+    }
+    return QueryRange(-1, begin, end, out);
+}
+
+// Segments are in time order: binary-search the first that can hold begin
+int HistoryArchive::QueryRange(int machine, int64 begin, int64 end, Vector<ArchivedTransition>& out) {
+    if (begin >= end)
+        return 0;
+    if (!Flush())
+        return -1;
+    int lo = 0;
+    int hi = segments.GetCount();
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (segments[mid].count && segments[mid].last_time < begin)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int added = 0;
+    for (int i = lo; i < segments.GetCount() && segments[i].first_time < end; ++i) {
+        if (!segments[i].count)
+            continue;
+        const int n = QuerySegment(i, machine, begin, end, out);
+        if (n < 0)
+            return -1;
+        added += n;
+    }
+    return added;
+}
+
+// Mappings are kept in their Segment until Close(). The active segment's
+// spans the whole segment, so the records appended since show through it;
+// Flush() has put them in the file, so no page past its end is touched.
+bool HistoryArchive::MapSegment(int i, View& v) {
+#ifdef PLATFORM_POSIX
+    Segment& seg = segments[i];
+    if (seg.record_map && !seg.sealed && seg.count * sizeof(Record) > seg.record_size) {
+        // Outgrew its mapping after SetMaxSegmentRecords() raised the limit
+        munmap(seg.record_map, seg.record_size);
+        seg.record_map = nullptr;
+    }
+    if (!seg.record_map)
+        seg.record_map = MapFile(SegmentPath(i, "rec"), seg.record_size,
+                                 seg.sealed ? 0 : max<int64>(max_segment_records, seg.count) * sizeof(Record));
+    v.records = (const Record*)seg.record_map;
+    v.count = min(seg.count, int64(seg.record_size / sizeof(Record)));
+    if (!seg.sealed) {
+        v.sparse = active_sparse.Begin();
+        v.sparse_count = active_sparse.GetCount();
+        return v.records;
+    }
+    if (!seg.index_map)
+        seg.index_map = MapFile(SegmentPath(i, "idx"), seg.index_size);
+    const IndexHeader* h = (const IndexHeader*)seg.index_map;
+    if (!v.records || !h || seg.index_size < sizeof(IndexHeader))
+        return false;
+    v.sparse = (const int64*)(h + 1);
+    v.sparse_count = h->sparse_count;
+    v.machines = (const MachineEntry*)(v.sparse + v.sparse_count);
+    v.machine_count = h->machine_count;
+    v.positions = (const int*)(v.machines + v.machine_count);
+    return (const char*)(v.positions + v.count) <= (const char*)seg.index_map + seg.index_size;
+#else
+    return false;
+#endif
+}
+
+int HistoryArchive::QuerySegment(int i, int machine, int64 begin, int64 end, Vector<ArchivedTransition>& out) {
+    View v;
+    if (!MapSegment(i, v)) {
+        Fail("cannot map " + SegmentPath(i, "rec"));
+        return -1;
+    }
+    const Record* records = v.records;
+    int added = 0;
+    auto emit = [&](const Record& r) {
+        ArchivedTransition& t = out.Add();
+        t.time = r.time;
+        t.machine = names[r.machine];
+        t.from = names[r.from];
+        t.to = names[r.to];
+        t.event = names[r.event];
+        ++added;
+    };
+
+    if (machine >= 0) {
+        // The machine's positions are in time order
+        const int* positions = nullptr;
+        int n = 0;
+        if (v.machines) {
+            int lo = 0;
+            int hi = v.machine_count;
+            while (lo < hi) {
+                const int mid = (lo + hi) / 2;
+                if (v.machines[mid].machine < machine)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo < v.machine_count && v.machines[lo].machine == machine) {
+                positions = v.positions + v.machines[lo].offset;
+                n = v.machines[lo].count;
+            }
+        }
+        else if (const Vector<int>* p = active_positions.FindPtr(machine)) {
+            positions = p->Begin();
+            n = p->GetCount();
+        }
+        int lo = 0;
+        int hi = n;
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            if (records[positions[mid]].time < begin)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (int k = lo; k < n && positions[k] < v.count && records[positions[k]].time < end; ++k)
+            emit(records[positions[k]]);
+    }
+    else {
+        // The sparse index narrows the search to one step of records
+        int s = 0;
+        int e = v.sparse_count;
+        while (s < e) {
+            const int mid = (s + e) / 2;
+            if (v.sparse[mid] < begin)
+                s = mid + 1;
+            else
+                e = mid;
+        }
+        int64 lo = max(s - 1, 0) * int64(SPARSE_STEP);
+        int64 hi = s < v.sparse_count ? min(v.count, s * int64(SPARSE_STEP)) : v.count;
+        while (lo < hi) {
+            const int64 mid = (lo + hi) / 2;
+            if (records[mid].time < begin)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (int64 k = lo; k < v.count && records[k].time < end; ++k)
+            emit(records[k]);
+    }
+    return added;
+}
+
+}
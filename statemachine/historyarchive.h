@@ -0,0 +1,143 @@
+/*
+    HistoryArchive
+    ==============
+
+    Purpose
+    - Keeps a complete, time-stamped audit trail of committed transitions
+      for one or more machines on disk, while the machines keep only a
+      bounded window of history in memory.
+
+    Intent
+    - Append-only: every commit (including Start() and GoBack()) becomes one
+      fixed-size record of time, machine, from, to and event. The strings go
+      through a shared name dictionary, so a record is 24 bytes.
+    - Segmented: records go to the active segment until it holds
+      SetMaxSegmentRecords() of them. Then it is sealed with an index file
+      and a new segment starts.
+    - Indexed for range queries: a segment's index holds a sparse time index
+      (every SPARSE_STEP-th record's time) and, per machine, the positions of
+      its records. A query picks segments by time range, maps them, and
+      binary-searches; it never scans records outside the answer. Sealed
+      segments never change and the active one only grows, so each stays
+      mapped from its first query until Close().
+    - Times must not go backwards; earlier stamps are raised to the last one.
+    - Files are in native byte order and are not portable across
+      architectures. Flush() hands buffered records to the OS; it does not
+      fsync.
+
+    Thread context
+    - One thread writes and queries. POSIX only; Open() fails elsewhere.
+*/
+
+#pragma once
+
+#include "statemachine.h"
+
+namespace Upp {
+
+	/// One archived transition as returned by a query
+	struct ArchivedTransition : Moveable<ArchivedTransition> {
+	    int64  time = 0;
+	    String machine;
+	    String from;
+	    String to;
+	    String event;
+	};
+
+	class HistoryArchive {
+	public:
+	    /// Records between two sparse time index entries
+	    static constexpr int SPARSE_STEP = 256;
+
+	    HistoryArchive() = default;
+	    HistoryArchive(const HistoryArchive&) = delete;
+	    HistoryArchive& operator=(const HistoryArchive&) = delete;
+	    ~HistoryArchive()                        { Close(); }
+
+	    /// Open or create the archive in directory dir, resuming its last
+	    /// segment. Fails with ArchiveFailed; GetErrorText() says why.
+	    bool Open(const char* dir);
+	    /// Flush and release files; sealed segments stay as they are
+	    void Close();
+	    bool IsOpen() const                      { return !directory.IsEmpty(); }
+
+	    /// Records per segment before it is sealed; default 1 << 20 (24 MB)
+	    void SetMaxSegmentRecords(int n)         { max_segment_records = max(n, SPARSE_STEP); }
+	    int  GetMaxSegmentRecords() const        { return max_segment_records; }
+
+	    /// Clock used to stamp records, in microseconds; defaults to the
+	    /// system wall clock since the Unix epoch. Tests can install their own.
+	    void  SetClock(Function<int64()> now)    { clock = pick(now); }
+	    int64 GetNow() const;
+
+	    /// Append one record stamped with GetNow()
+	    bool Add(const String& machine, const String& from, const String& to, const String& event);
+	    /// Write buffered records and names to the segment files
+	    bool Flush();
+
+	    /// Append the records with begin <= time < end, in time order, to out.
+	    /// Returns the number appended, or -1 on an I/O error.
+	    int Query(const String& machine, int64 begin, int64 end, Vector<ArchivedTransition>& out);
+	    int Query(int64 begin, int64 end, Vector<ArchivedTransition>& out);
+
+	    int   GetSegmentCount() const            { return segments.GetCount(); }
+	    int64 GetRecordCount() const;
+
+	    StateMachineError GetLastError() const   { return last_error; }
+	    String GetErrorText() const              { return error_text; }
+	    void ClearError()                        { last_error = StateMachineError::None; error_text.Clear(); }
+
+	private:
+	    /// On-disk record; strings are name dictionary indices
+	    struct Record : Moveable<Record> {
+	        int64 time;
+	        int   machine;
+	        int   from;
+	        int   to;
+	        int   event;
+	    };
+
+	    struct IndexHeader;
+	    struct MachineEntry;
+	    struct View;
+
+	    /// Time range of a segment, for choosing which ones a query maps
+	    struct Segment : Moveable<Segment> {
+	        int64  first_time = 0;
+	        int64  last_time = 0;
+	        int64  count = 0;
+	        bool   sealed = false;
+	        void*  record_map = nullptr;    // mapped on first query, until Close()
+	        size_t record_size = 0;
+	        void*  index_map = nullptr;
+	        size_t index_size = 0;
+	    };
+
+	    String SegmentPath(int i, const char* ext) const;
+	    bool   Fail(const String& text);
+	    int    Name(const String& s);
+	    bool   LoadNames();
+	    bool   LoadSegment(int i);
+	    bool   StartSegment();
+	    bool   Seal(int i);
+	    bool   MapSegment(int i, View& v);
+	    int    QueryRange(int machine, int64 begin, int64 end, Vector<ArchivedTransition>& out);
+	    int    QuerySegment(int i, int machine, int64 begin, int64 end, Vector<ArchivedTransition>& out);
+
+	    String                        directory;
+	    Index<String>                 names;
+	    int                           names_written = 0;
+	    int                           names_fd = -1;
+	    int                           active_fd = -1;
+	    Vector<Segment>               segments;      // the last one is active
+	    Vector<Record>                pending;       // not yet written
+	    VectorMap<int, Vector<int>>   active_positions;   // machine -> record numbers
+	    Vector<int64>                 active_sparse;
+	    int                           max_segment_records = 1 << 20;
+	    int64                         last_time = 0;
+	    Function<int64()>             clock;
+	    StateMachineError             last_error = StateMachineError::None;
+	    String                        error_text;
+	};
+
+}
@@ -0,0 +1,88 @@
+/*
+    NumaTopology implementation
+    ===========================
+
+    Purpose
+    - Implements the /sys node discovery and thread pinning declared in
+      statemachine/numatopology.h.
+*/
+#include "numatopology.h"
+
+#ifdef PLATFORM_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace Upp {
+
+Vector<int> NumaTopology::ParseList(const char* s) {
+    Vector<int> result;
+    while (*s) {
+        if (*s < '0' || *s > '9') {
+            ++s;
+            continue;
+        }
+        int first = 0;
+        while (*s >= '0' && *s <= '9')
+            first = 10 * first + *s++ - '0';
+        int last = first;
+        if (*s == '-') {
+            ++s;
+            last = 0;
+            while (*s >= '0' && *s <= '9')
+                last = 10 * last + *s++ - '0';
+        }
+        for (int i = first; i <= last; ++i)
+            result.Add(i);
+    }
+    return result;
+}
+
+void NumaTopology::LoadFallback() {
+    nodes.Clear();
+    Vector<int>& cpus = nodes.Add();
+    for (int i = 0; i < CPU_Cores(); ++i)
+        cpus.Add(i);
+}
+
+bool NumaTopology::Load() {
+    nodes.Clear();
+#ifdef PLATFORM_LINUX
+    const Vector<int> online = ParseList(LoadFile("/sys/devices/system/node/online"));
+    for (int node : online) {
+        Vector<int> cpus = ParseList(LoadFile(Format("/sys/devices/system/node/node%d/cpulist", node)));
+        // Memory-only nodes have no CPUs to run a worker on
+        if (!cpus.IsEmpty())
+            nodes.Add(pick(cpus));
+    }
+#endif
+    if (nodes.IsEmpty()) {
+        LoadFallback();
+        return false;
+    }
+    return true;
+}
+
+int NumaTopology::GetNodeOfCpu(int cpu) const {
+    for (int node = 0; node < nodes.GetCount(); ++node)
+        for (int c : nodes[node])
+            if (c == cpu)
+                return node;
+    return -1;
+}
+
+bool NumaTopology::PinCurrentThread(int cpu) {
+#ifdef PLATFORM_LINUX
+    // CPU_SET() does not check its argument
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+} // namespace Upp
@@ -0,0 +1,46 @@
+/*
+    NumaTopology
+    ============
+
+    Purpose
+    - Discovers NUMA nodes and their CPUs from /sys so runtime memory can be
+      placed on the node of the thread that drives it.
+
+    Intent
+    - No libnuma dependency: placement relies on the kernel's first-touch
+      policy, so pinning a worker and then allocating from it is enough.
+    - Anything that cannot be read (non-Linux, containers without /sys)
+      falls back to a single node holding CPU_Cores() CPUs.
+
+    Thread context
+    - Load() once, then read from any thread.
+*/
+
+#pragma once
+
+#include <Core/Core.h>
+
+namespace Upp {
+
+	class NumaTopology {
+	public:
+	    /// Read /sys/devices/system/node; returns false when it fell back
+	    bool Load();
+
+	    int GetNodeCount() const                 { return nodes.GetCount(); }
+	    const Vector<int>& GetCpus(int node) const { return nodes[node]; }
+	    int GetNodeOfCpu(int cpu) const;
+
+	    /// Pin the calling thread to one CPU; false when unsupported
+	    static bool PinCurrentThread(int cpu);
+
+	    /// Parse a kernel list such as "0-3,8,10-11"
+	    static Vector<int> ParseList(const char* s);
+
+	private:
+	    void LoadFallback();
+
+	    Vector<Vector<int>> nodes;
+	};
+
+}
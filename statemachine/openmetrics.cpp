@@ -0,0 +1,321 @@
+/*
+    OpenMetrics export implementation
+    =================================
+
+    Purpose
+    - Implements the exporter and HTTP responder declared in
+      statemachine/openmetrics.h.
+
+    Intent
+    - Queue wait histograms reuse StateMachineQueueStats buckets: bucket i
+      holds [2^(i-1), 2^i) microseconds, so its inclusive upper bound is
+      2^i - 1 and the last bucket becomes +Inf.
+*/
+#include "openmetrics.h"
+
+namespace Upp {
+
+static void CatLabel(String& out, const char* name, const String& value) {
+    out.Cat(name);
+    out.Cat("=\"");
+    for (int i = 0; i < value.GetLength(); ++i) {
+        const int c = value[i];
+        if (c == '\\' || c == '"')
+            out.Cat('\\');
+        if (c == '\n')
+            out.Cat("\\n");
+        else
+            out.Cat(c);
+    }
+    out.Cat('"');
+}
+
+static String SourceLabel(const String& source) {
+    String label;
+    CatLabel(label, "source", source);
+    return label;
+}
+
+void OpenMetricsExporter::AddMachine(const String& source, const StateMachine& sm) {
+    Source& s = sources.Add();
+    s.label = SourceLabel(source);
+    s.machine = &sm;
+}
+
+void OpenMetricsExporter::AddRouter(const String& source, const EventRouter& router) {
+    Source& s = sources.Add();
+    s.label = SourceLabel(source);
+    s.router = &router;
+}
+
+void OpenMetricsExporter::Reserve(int len) {
+    buffer.SetCount(max(2 * buffer.GetCount(), length + len + 4096));
+}
+
+void OpenMetricsExporter::PutInt(int64 n) {
+    char digits[24];
+    char* p = digits + sizeof(digits);
+    const bool negative = n < 0;
+    uint64 u = negative ? uint64(0) - uint64(n) : uint64(n);
+    do {
+        *--p = char('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (negative)
+        *--p = '-';
+    Put(p, int(digits + sizeof(digits) - p));
+}
+
+void OpenMetricsExporter::PutLabel(const char* name, const String& value) {
+    Put(name);
+    PutLiteral("=\"");
+    const char* s = value.Begin();
+    const char* e = s + value.GetLength();
+    const char* run = s;
+    for (; s < e; ++s) {
+        const char* escape = *s == '\\' ? "\\\\" : *s == '"' ? "\\\"" : *s == '\n' ? "\\n" : nullptr;
+        if (!escape)
+            continue;
+        Put(run, int(s - run));
+        Put(escape);
+        run = s + 1;
+    }
+    Put(run, int(e - run));
+    PutLiteral("\"");
+}
+
+void OpenMetricsExporter::PutSample(const char* name, const Source& s, int64 value) {
+    Put(name);
+    PutLiteral("{");
+    Put(s.label);
+    PutLiteral("} ");
+    PutInt(value);
+    PutLiteral("\n");
+}
+
+void OpenMetricsExporter::Family(const char* name, const char* type, const char* help, const char* unit) {
+    PutLiteral("# TYPE ");
+    Put(name);
+    PutLiteral(" ");
+    Put(type);
+    PutLiteral("\n");
+    if (unit) {
+        PutLiteral("# UNIT ");
+        Put(name);
+        PutLiteral(" ");
+        Put(unit);
+        PutLiteral("\n");
+    }
+    PutLiteral("# HELP ");
+    Put(name);
+    PutLiteral(" ");
+    Put(help);
+    PutLiteral("\n");
+}
+
+void OpenMetricsExporter::Collect(Source& s) {
+    if (s.machine) {
+        s.queue = s.machine->GetQueueStats();
+        s.queued = s.machine->GetQueuedEventCount();
+        s.commits = s.machine->GetCommitCount();
+        memset(s.last_errors, 0, sizeof(s.last_errors));
+        ++s.last_errors[int(s.machine->GetLastError())];
+        return;
+    }
+    StateMachineQueueStats& q = s.queue;
+    q = StateMachineQueueStats();
+    s.queued = 0;
+    s.commits = 0;
+    memset(s.last_errors, 0, sizeof(s.last_errors));
+    for (int i = 0; i < s.router->GetCount(); ++i) {
+        const StateMachine& sm = (*s.router)[i];
+        const StateMachineQueueStats& m = sm.GetQueueStats();
+        s.queued += sm.GetQueuedEventCount();
+        s.commits += sm.GetCommitCount();
+        ++s.last_errors[int(sm.GetLastError())];
+        q.enqueued += m.enqueued;
+        q.dequeued += m.dequeued;
+        q.queue_full += m.queue_full;
+        q.wait_total += m.wait_total;
+        q.depth_high_water = max(q.depth_high_water, m.depth_high_water);
+        if (!m.dequeued)
+            continue;    // every wait bucket is still zero; skip their cache lines
+        for (int b = 0; b < StateMachineQueueStats::BUCKETS; ++b)
+            q.wait_histogram[b] += m.wait_histogram[b];
+    }
+}
+
+const String& OpenMetricsExporter::StateLabel(Source& s, int i) {
+    // State ids only grow until the router is cleared, so a cached label is
+    // rebuilt just when its id no longer matches
+    const String& id = s.router->GetStateId(i);
+    if (i >= s.state_ids.GetCount()) {
+        s.state_ids.SetCount(i + 1);
+        s.state_labels.SetCount(i + 1);
+    }
+    else if (s.state_ids[i] == id)
+        return s.state_labels[i];
+    String label = s.label;
+    label.Cat(',');
+    CatLabel(label, "state", id);
+    s.state_ids[i] = id;
+    s.state_labels[i] = label;
+    return s.state_labels[i];
+}
+
+void OpenMetricsExporter::Render() {
+    length = 0;
+    for (Source& s : sources)
+        if (s.machine || instance_totals)
+            Collect(s);
+
+    Family("statemachine_instances", "gauge", "Instances per committed state.");
+    for (Source& s : sources) {
+        if (s.machine) {
+            if (!s.machine->IsStarted() || s.machine->GetCurrent().IsEmpty())
+                continue;
+            PutLiteral("statemachine_instances{");
+            Put(s.label);
+            PutLiteral(",");
+            PutLabel("state", s.machine->GetCurrent());
+            PutLiteral("} 1\n");
+            continue;
+        }
+        for (int i = 0; i < s.router->GetStateIdCount(); ++i) {
+            PutLiteral("statemachine_instances{");
+            Put(StateLabel(s, i));
+            PutLiteral("} ");
+            PutInt(s.router->GetMemberCountAt(i));
+            PutLiteral("\n");
+        }
+    }
+
+    Family("statemachine_state_entries", "counter", "Commits into each state.");
+    for (Source& s : sources) {
+        if (!s.router)
+            continue;
+        for (int i = 0; i < s.router->GetStateIdCount(); ++i) {
+            PutLiteral("statemachine_state_entries_total{");
+            Put(StateLabel(s, i));
+            PutLiteral("} ");
+            PutInt(s.router->GetEntryCountAt(i));
+            PutLiteral("\n");
+        }
+    }
+
+    Family("statemachine_transitions", "counter", "Transitions committed since start.");
+    for (const Source& s : sources)
+        if (s.machine || instance_totals)
+            PutSample("statemachine_transitions_total", s, s.commits);
+
+    Family("statemachine_errors", "counter", "Routing failures by StateMachineError.");
+    for (const Source& s : sources) {
+        if (!s.router)
+            continue;
+        for (int e = 1; e < STATE_MACHINE_ERROR_COUNT; ++e) {
+            PutLiteral("statemachine_errors_total{");
+            Put(s.label);
+            PutLiteral(",error=\"");
+            Put(GetStateMachineErrorName(StateMachineError(e)));
+            PutLiteral("\"} ");
+            PutInt(s.router->GetErrorCount(StateMachineError(e)));
+            PutLiteral("\n");
+        }
+    }
+
+    Family("statemachine_last_error", "gauge", "Instances by their last StateMachineError.");
+    for (const Source& s : sources) {
+        if (!s.machine && !instance_totals)
+            continue;
+        for (int e = 0; e < STATE_MACHINE_ERROR_COUNT; ++e) {
+            PutLiteral("statemachine_last_error{");
+            Put(s.label);
+            PutLiteral(",error=\"");
+            Put(GetStateMachineErrorName(StateMachineError(e)));
+            PutLiteral("\"} ");
+            PutInt(s.last_errors[e]);
+            PutLiteral("\n");
+        }
+    }
+
+    Family("statemachine_queue_depth", "gauge", "External events currently queued.");
+    for (const Source& s : sources)
+        if (s.machine || instance_totals)
+            PutSample("statemachine_queue_depth", s, s.queued);
+
+    Family("statemachine_queue_depth_high_water", "gauge", "Largest external queue depth seen.");
+    for (const Source& s : sources)
+        if (s.machine || instance_totals)
+            PutSample("statemachine_queue_depth_high_water", s, s.queue.depth_high_water);
+
+    Family("statemachine_queue_full", "counter", "Events rejected by a full queue.");
+    for (const Source& s : sources)
+        if (s.machine || instance_totals)
+            PutSample("statemachine_queue_full_total", s, s.queue.queue_full);
+
+    Family("statemachine_queue_wait_microseconds", "histogram",
+           "Time queued events waited before dispatch.", "microseconds");
+    for (const Source& s : sources) {
+        if (s.router && !instance_totals)
+            continue;
+        int64 cumulative = 0;
+        for (int b = 0; b < StateMachineQueueStats::BUCKETS; ++b) {
+            cumulative += s.queue.wait_histogram[b];
+            PutLiteral("statemachine_queue_wait_microseconds_bucket{");
+            Put(s.label);
+            PutLiteral(",le=\"");
+            if (b == StateMachineQueueStats::BUCKETS - 1)
+                PutLiteral("+Inf");
+            else
+                PutInt((int64(1) << b) - 1);
+            PutLiteral("\"} ");
+            PutInt(cumulative);
+            PutLiteral("\n");
+        }
+        PutSample("statemachine_queue_wait_microseconds_count", s, s.queue.dequeued);
+        PutSample("statemachine_queue_wait_microseconds_sum", s, s.queue.wait_total);
+    }
+
+    PutLiteral("# EOF\n");
+}
+
+bool OpenMetricsResponder::Listen(int port, const char* host) {
+    IpAddrInfo ip;
+    if (!ip.Execute(host, port))
+        return false;
+    return server.Listen(ip, port, 5);
+}
+
+bool OpenMetricsResponder::ServeOne(int timeout_ms) {
+    server.Timeout(timeout_ms);
+    TcpSocket client;
+    if (!client.Accept(server))
+        return false;
+    client.Timeout(1000);
+
+    const String request = client.GetLine();
+    for (;;) {
+        const String header = client.GetLine();
+        if (header.IsEmpty() || client.IsError())
+            break;
+    }
+
+    if (!request.StartsWith("GET /metrics ")) {
+        static const char not_found[] =
+            "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        client.PutAll(not_found, sizeof(not_found) - 1);
+        return true;
+    }
+
+    exporter.Render();
+    String head;
+    head << "HTTP/1.1 200 OK\r\n"
+         << "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+         << "Content-Length: " << exporter.GetLength() << "\r\n"
+         << "Connection: close\r\n\r\n";
+    client.PutAll(head);
+    client.PutAll(exporter.GetText(), exporter.GetLength());
+    return true;
+}
+
+} // namespace Upp
@@ -0,0 +1,106 @@
+/*
+    OpenMetrics export
+    ==================
+
+    Purpose
+    - Renders machine and EventRouter metrics in the OpenMetrics text format
+      for Prometheus-compatible scrapers.
+    - OpenMetricsResponder serves the text over a minimal local HTTP
+      endpoint.
+
+    Intent
+    - Register sources once, then Render() on every scrape. Output goes into
+      one reused buffer, and numbers are formatted in place, so a steady-state
+      scrape does not allocate.
+    - Every family is emitted once, with one sample per source, as the format
+      requires.
+    - Router costs are O(states) for membership, entries and errors, plus
+      O(instances) for summed transitions, queue statistics and last
+      errors, which SetInstanceTotals(false) skips for very large pools.
+    - Failure counts by error exist only for routers, which count failed
+      routes. A StateMachine keeps just its last error, so every source
+      reports instances by last error instead.
+
+    Thread context
+    - Same as the sources: render from the thread that owns them.
+*/
+
+#pragma once
+
+#include "eventrouter.h"
+
+namespace Upp {
+
+	class OpenMetricsExporter {
+	public:
+	    /// Sources are referenced, not copied, and must outlive the exporter
+	    void AddMachine(const String& source, const StateMachine& sm);
+	    void AddRouter(const String& source, const EventRouter& router);
+	    void ClearSources()                      { sources.Clear(); }
+
+	    /// Sum transitions and queue statistics over router instances (default)
+	    void SetInstanceTotals(bool b = true)    { instance_totals = b; }
+
+	    /// Render all sources, replacing the previous text
+	    void Render();
+
+	    const char* GetText() const              { return buffer.Begin(); }
+	    int GetLength() const                    { return length; }
+	    String ToString() const                  { return String(buffer.Begin(), length); }
+
+	private:
+	    struct Source : Moveable<Source> {
+	        String                  label;        // escaped source="name", built once
+	        Vector<String>          state_ids;    // raw ids behind state_labels
+	        Vector<String>          state_labels; // label plus escaped state="id"
+	        const StateMachine*     machine = nullptr;
+	        const EventRouter*      router = nullptr;
+	        StateMachineQueueStats  queue;        // summed over router instances
+	        int64                   queued = 0;
+	        int64                   commits = 0;
+	        int64                   last_errors[STATE_MACHINE_ERROR_COUNT] = {};   // instances per last error
+	    };
+
+	    void Collect(Source& s);
+	    const String& StateLabel(Source& s, int i);
+	    void Put(const char* s, int len) {
+	        if (length + len > buffer.GetCount())
+	            Reserve(len);
+	        memcpy(buffer.Begin() + length, s, len);
+	        length += len;
+	    }
+	    template <int N>
+	    void PutLiteral(const char (&s)[N])      { Put(s, N - 1); }
+	    void Put(const char* s)                  { Put(s, (int)strlen(s)); }
+	    void Put(const String& s)                { Put(s.Begin(), s.GetLength()); }
+	    void Reserve(int len);
+	    void PutInt(int64 n);
+	    void PutLabel(const char* name, const String& value);
+	    void PutSample(const char* name, const Source& s, int64 value);
+	    void Family(const char* name, const char* type, const char* help, const char* unit = nullptr);
+
+	    Vector<Source> sources;
+	    Vector<char>   buffer;    // only grows; length is the rendered part
+	    int            length = 0;
+	    bool           instance_totals = true;
+	};
+
+	/// Minimal blocking HTTP endpoint for an exporter; serves GET /metrics
+	class OpenMetricsResponder {
+	public:
+	    explicit OpenMetricsResponder(OpenMetricsExporter& exporter) : exporter(exporter) {}
+
+	    /// Listen on host:port; loopback by default
+	    bool Listen(int port, const char* host = "127.0.0.1");
+
+	    /// Serve one request if a client connects within timeout_ms
+	    bool ServeOne(int timeout_ms = 0);
+
+	    void Close()                             { server.Close(); }
+
+	private:
+	    OpenMetricsExporter& exporter;
+	    TcpSocket            server;
+	};
+
+}
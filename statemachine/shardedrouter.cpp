@@ -0,0 +1,266 @@
+/*
+    ShardedRouter implementation
+    ============================
+
+    Purpose
+    - Implements the key-sharded runtime declared in
+      statemachine/shardedrouter.h.
+
+    Intent
+    - Post() picks its ring from thread-local pump state: inside Pump() the
+      producer is the pumping shard, anywhere else it is the ingress thread.
+    - Rebalancing drains the rings, releases every instance, and adopts them
+      into the new shards in entry-time order so dwell-time lists stay sorted.
+    - NUMA-aware workers re-home their inbound rings and index tables before
+      any of them pumps; Start() waits for all of them, so no ring is written
+      while it is being moved.
+*/
+#include "shardedrouter.h"
+
+namespace Upp {
+
+static thread_local const ShardedRouter* pump_owner = nullptr;
+static thread_local int pump_shard = -1;
+
+/// Marks the current thread as the producer for one shard
+struct PumpScope {
+    const ShardedRouter* owner;
+    int shard;
+
+    PumpScope(const ShardedRouter* router, int i) : owner(pump_owner), shard(pump_shard) {
+        pump_owner = router;
+        pump_shard = i;
+    }
+    ~PumpScope() {
+        pump_owner = owner;
+        pump_shard = shard;
+    }
+};
+
+ShardedRouter::ShardedRouter() {
+    SetShardCount(1);
+}
+
+ShardedRouter::~ShardedRouter() {
+    Stop();
+}
+
+int ShardedRouter::GetShardIndex(const String& key) const {
+    // Multiplicative mix so shard choice does not correlate with the low bits
+    // each shard's open-addressing table probes with
+    const dword h = dword(GetHashValue(key) * 0x9e3779b1u);
+    return int((uint64(h) * shards.GetCount()) >> 32);
+}
+
+void ShardedRouter::SetupShard(Shard& s) {
+    s.router.WhenCreate = [this](StateMachine& sm, const String& key) {
+        if (WhenCreate)
+            WhenCreate(sm, key);
+    };
+    if (clock)
+        s.router.SetClock(clock);
+    for (const SweepRule& r : sweeps)
+        s.router.AddSweep(r.state, r.older_than, r.event);
+    for (const EnterBatchRule& r : enter_batches)
+        s.router.SetEnterBatch(r.state, r.handler, r.max_count, r.max_wait);
+}
+
+bool ShardedRouter::SetShardCount(int n) {
+    if (running) {
+        last_error = StateMachineError::AlreadyStarted;
+        return false;
+    }
+    n = max(n, 1);
+
+    Vector<RoutedEvent> pending;
+    RoutedEvent e;
+    for (SpscRing<RoutedEvent>& r : rings)
+        while (r.Pop(e))
+            pending.Add(pick(e));
+
+    Vector<EventRouter::Migrant> migrants;
+    for (Shard& s : shards)
+        s.router.Release(migrants);
+    StableSort(migrants, [](const EventRouter::Migrant& a, const EventRouter::Migrant& b) {
+        return a.entered_at < b.entered_at;
+    });
+
+    shards.Clear();
+    for (int i = 0; i < n; ++i)
+        SetupShard(shards.Add());
+    rings.Clear();
+    for (int producer = 0; producer <= n; ++producer)
+        for (int consumer = 0; consumer < n; ++consumer)
+            rings.Add().Reserve(producer < n ? ring_capacity : max(ring_capacity, pending.GetCount()));
+
+    for (EventRouter::Migrant& m : migrants) {
+        const int shard = GetShardIndex(m.key);
+        shards[shard].router.Adopt(pick(m));
+    }
+    for (RoutedEvent& p : pending) {
+        const int shard = GetShardIndex(p.key);
+        GetRing(n, shard).Push(pick(p));
+    }
+    ClearError();
+    return true;
+}
+
+bool ShardedRouter::Post(const String& key, const String& event) {
+    if (key.IsEmpty())
+        return false;
+    const int producer = pump_owner == this ? pump_shard : shards.GetCount();
+    RoutedEvent e;
+    e.key = key;
+    e.event = event;
+    return GetRing(producer, GetShardIndex(key)).Push(pick(e));
+}
+
+int ShardedRouter::Pump(int shard) {
+    Shard& s = shards[shard];
+    s.batch.SetCount(0);
+    RoutedEvent e;
+    for (int producer = 0; producer <= shards.GetCount(); ++producer) {
+        // Take at most one ring's worth so a busy producer cannot starve the rest
+        SpscRing<RoutedEvent>& r = GetRing(producer, shard);
+        for (int n = r.GetCapacity(); n > 0 && r.Pop(e); --n)
+            s.batch.Add(pick(e));
+    }
+    if (s.batch.IsEmpty())
+        return 0;
+    PumpScope scope(this, shard);
+    s.router.RouteBatch(s.batch);
+    return s.batch.GetCount();
+}
+
+void ShardedRouter::AddSweep(const String& state, int64 older_than, const String& event) {
+    SweepRule& r = sweeps.Add();
+    r.state = state;
+    r.older_than = older_than;
+    r.event = event;
+    for (Shard& s : shards)
+        s.router.AddSweep(state, older_than, event);
+}
+
+void ShardedRouter::SetEnterBatch(const String& state, EventRouter::EnterBatchHandler handler, int max_count, int64 max_wait) {
+    EnterBatchRule* r = nullptr;
+    for (EnterBatchRule& b : enter_batches)
+        if (b.state == state)
+            r = &b;
+    if (!r) {
+        r = &enter_batches.Add();
+        r->state = state;
+    }
+    r->handler = pick(handler);
+    r->max_count = max_count;
+    r->max_wait = max_wait;
+    for (Shard& s : shards)
+        s.router.SetEnterBatch(state, r->handler, max_count, max_wait);
+}
+
+void ShardedRouter::SetClock(Function<int64()> now) {
+    clock = pick(now);
+    for (Shard& s : shards)
+        s.router.SetClock(clock);
+}
+
+bool ShardedRouter::SetNumaAware(bool b) {
+    if (running) {
+        last_error = StateMachineError::AlreadyStarted;
+        return false;
+    }
+    numa_aware = b;
+    ClearError();
+    return true;
+}
+
+int ShardedRouter::GetShardNode(int i) const {
+    const int cpu = GetShardCpu(i);
+    return cpu >= 0 && numa_aware ? topology.GetNodeOfCpu(cpu) : -1;
+}
+
+void ShardedRouter::PlaceShards() {
+    shard_cpu.Clear();
+    if (!numa_aware) {
+        for (int i = 0; i < shards.GetCount(); ++i)
+            shard_cpu.Add(i % CPU_Cores());
+        return;
+    }
+    // Round-robin over nodes first, then over each node's CPUs
+    topology.Load();
+    const int nodes = topology.GetNodeCount();
+    for (int i = 0; i < shards.GetCount(); ++i) {
+        const Vector<int>& cpus = topology.GetCpus(i % nodes);
+        shard_cpu.Add(cpus[(i / nodes) % cpus.GetCount()]);
+    }
+}
+
+void ShardedRouter::RunWorker(int shard) {
+    NumaTopology::PinCurrentThread(shard_cpu[shard]);
+    if (numa_aware) {
+        Shard& s = shards[shard];
+        for (int producer = 0; producer <= shards.GetCount(); ++producer)
+            GetRing(producer, shard).Rehome();
+        s.batch = Vector<RoutedEvent>();
+        s.router.Rehome();
+        ++ready_workers;
+        while (ready_workers < shards.GetCount())
+            Sleep(0);
+    }
+    while (!stop_requested.load(std::memory_order_acquire)) {
+        if (Pump(shard))
+            continue;
+        {
+            PumpScope scope(this, shard);
+            shards[shard].router.RunSweeps();
+            shards[shard].router.RunEnterBatches();
+        }
+        Sleep(1);
+    }
+}
+
+bool ShardedRouter::Start() {
+    if (running) {
+        last_error = StateMachineError::AlreadyStarted;
+        return false;
+    }
+    PlaceShards();
+    stop_requested = false;
+    ready_workers = 0;
+    running = true;
+    for (int i = 0; i < shards.GetCount(); ++i)
+        shards[i].worker.Run([this, i] { RunWorker(i); });
+    if (numa_aware)
+        while (ready_workers < shards.GetCount())
+            Sleep(0);
+    ClearError();
+    return true;
+}
+
+void ShardedRouter::DrainAll() {
+    for (;;) {
+        int moved = 0;
+        for (int i = 0; i < shards.GetCount(); ++i)
+            moved += Pump(i);
+        if (!moved)
+            break;
+    }
+}
+
+void ShardedRouter::Stop() {
+    if (!running)
+        return;
+    stop_requested = true;
+    for (Shard& s : shards)
+        s.worker.Wait();
+    running = false;
+    DrainAll();
+}
+
+int ShardedRouter::GetCount() const {
+    int count = 0;
+    for (const Shard& s : shards)
+        count += s.router.GetCount();
+    return count;
+}
+
+} // namespace Upp
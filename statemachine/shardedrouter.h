@@ -0,0 +1,202 @@
+/*
+    ShardedRouter
+    =============
+
+    Purpose
+    - Shared-nothing runtime for large keyed pools: instances are partitioned
+      by key hash into N shards, each an EventRouter owned by one worker.
+
+    Intent
+    - A shard's machines, membership lists, sweep rules and clock are touched
+      only by its owner thread, so no StateMachine needs locking.
+    - Events reach a shard only through bounded single-producer rings: one
+      ingress ring per shard, plus one ring per (source shard, target shard)
+      pair for events posted from machine callbacks.
+    - Start() runs one worker per shard, pinned to a core on Linux. Callers
+      that want their own threads can drive Pump() directly instead.
+    - SetShardCount() rebalances while stopped by moving instances, with
+      their runtime state, into the shard their key now hashes to.
+    - With SetNumaAware(), shards are spread over the NUMA nodes found in
+      /sys and each worker re-allocates its rings, index tables, and its
+      instances' queues and history after pinning, so first-touch places
+      them on the worker's node. StateMachine objects themselves stay put.
+
+    Thread context
+    - Post() may be called from one ingress thread and from machine callbacks
+      running inside Pump(). Everything else is for the controlling thread
+      while workers are stopped.
+*/
+
+#pragma once
+
+#include "eventrouter.h"
+#include "numatopology.h"
+
+namespace Upp {
+
+	/// Bounded single-producer single-consumer ring; capacity is a power of two
+	template <class T>
+	class SpscRing {
+	public:
+	    /// Not thread-safe; call before the ring is shared
+	    void Reserve(int capacity) {
+	        int size = 2;
+	        while (size < capacity)
+	            size <<= 1;
+	        slots.Clear();
+	        slots.SetCount(size);
+	        mask = size - 1;
+	        head.store(0, std::memory_order_relaxed);
+	        tail.store(0, std::memory_order_relaxed);
+	    }
+
+	    /// Producer side; false when the ring is full
+	    bool Push(T&& x) {
+	        const int64 t = tail.load(std::memory_order_relaxed);
+	        if (t - head.load(std::memory_order_acquire) > mask)
+	            return false;
+	        slots[int(t & mask)] = pick(x);
+	        tail.store(t + 1, std::memory_order_release);
+	        return true;
+	    }
+
+	    /// Consumer side; false when the ring is empty
+	    bool Pop(T& x) {
+	        const int64 h = head.load(std::memory_order_relaxed);
+	        if (h == tail.load(std::memory_order_acquire))
+	            return false;
+	        x = pick(slots[int(h & mask)]);
+	        head.store(h + 1, std::memory_order_release);
+	        return true;
+	    }
+
+	    /// Re-allocate the buffer from the calling thread, keeping its contents.
+	    /// Neither side may be active.
+	    void Rehome() {
+	        Vector<T> fresh;
+	        fresh.SetCount(slots.GetCount());
+	        const int64 t = tail.load(std::memory_order_relaxed);
+	        for (int64 i = head.load(std::memory_order_relaxed); i < t; ++i)
+	            fresh[int(i & mask)] = pick(slots[int(i & mask)]);
+	        slots = pick(fresh);
+	    }
+
+	    int GetCapacity() const { return mask + 1; }
+	    int GetCount() const {
+	        return int(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+	    }
+
+	private:
+	    Vector<T> slots;
+	    int mask = -1;
+	    alignas(64) std::atomic<int64> head{0};   // written by the consumer
+	    alignas(64) std::atomic<int64> tail{0};   // written by the producer
+	};
+
+	class ShardedRouter {
+	public:
+	    ShardedRouter();
+	    ~ShardedRouter();
+
+	    /// Configure a new instance; runs on the owning shard's thread, so it
+	    /// must not touch shared state without its own synchronization
+	    Function<void(StateMachine&, const String& key)> WhenCreate;
+
+	    /// Set the shard count, moving existing instances and pending events.
+	    /// Fails with AlreadyStarted while workers run.
+	    bool SetShardCount(int n);
+	    int GetShardCount() const                { return shards.GetCount(); }
+
+	    /// Per-ring capacity used by the next SetShardCount(); default 4096
+	    void SetRingCapacity(int n)              { ring_capacity = max(n, 2); }
+	    int GetRingCapacity() const              { return ring_capacity; }
+
+	    /// Shard a key hashes to
+	    int GetShardIndex(const String& key) const;
+
+	    /// Direct shard access for the controlling thread while stopped
+	    EventRouter& GetShard(int i)             { return shards[i].router; }
+	    const EventRouter& GetShard(int i) const { return shards[i].router; }
+
+	    /// Queue an event for the key's shard. False for an empty key or a full
+	    /// ring; the caller decides whether to retry.
+	    bool Post(const String& key, const String& event);
+
+	    /// Route every event waiting in the shard's rings; returns the number
+	    /// taken. Only the shard's owner may call it.
+	    int Pump(int shard);
+
+	    /// Applied to every shard, including after rebalancing
+	    void AddSweep(const String& state, int64 older_than, const String& event);
+	    /// Batched entry per shard; the handler runs on each shard's thread and
+	    /// its instance indices refer to that shard's router
+	    void SetEnterBatch(const String& state, EventRouter::EnterBatchHandler handler, int max_count, int64 max_wait);
+	    void SetClock(Function<int64()> now);
+
+	    /// Spread shards over NUMA nodes and re-home their memory on Start();
+	    /// fails with AlreadyStarted while workers run
+	    bool SetNumaAware(bool b = true);
+	    bool IsNumaAware() const                 { return numa_aware; }
+
+	    /// Placement chosen by the last Start(); -1 before that
+	    int GetShardCpu(int i) const             { return i < shard_cpu.GetCount() ? shard_cpu[i] : -1; }
+	    int GetShardNode(int i) const;
+
+	    /// One pinned worker per shard; idle workers run sweeps and
+	    /// due enter batches, then sleep 1 ms
+	    bool Start();
+
+	    /// Stop the workers and deliver every event still in the rings
+	    void Stop();
+	    bool IsRunning() const                   { return running; }
+
+	    /// Total instances; for the controlling thread while stopped
+	    int GetCount() const;
+
+	    StateMachineError GetLastError() const   { return last_error; }
+	    void ClearError()                        { last_error = StateMachineError::None; }
+
+	private:
+	    struct Shard {
+	        EventRouter          router;
+	        Thread               worker;
+	        Vector<RoutedEvent>  batch;
+	    };
+
+	    struct SweepRule : Moveable<SweepRule> {
+	        String state;
+	        int64  older_than = 0;
+	        String event;
+	    };
+
+	    struct EnterBatchRule : Moveable<EnterBatchRule> {
+	        String                          state;
+	        EventRouter::EnterBatchHandler  handler;
+	        int                             max_count = 1;
+	        int64                           max_wait = 0;
+	    };
+
+	    SpscRing<RoutedEvent>& GetRing(int producer, int consumer) {
+	        return rings[producer * shards.GetCount() + consumer];
+	    }
+	    void SetupShard(Shard& s);
+	    void PlaceShards();
+	    void RunWorker(int shard);
+	    void DrainAll();
+
+	    Array<Shard>                  shards;
+	    Array<SpscRing<RoutedEvent>>  rings;   // producers 0..N-1 are shards, N is ingress
+	    Vector<SweepRule>             sweeps;
+	    Vector<EnterBatchRule>        enter_batches;
+	    Function<int64()>             clock;
+	    int                           ring_capacity = 4096;
+	    bool                          numa_aware = false;
+	    NumaTopology                  topology;
+	    Vector<int>                   shard_cpu;
+	    std::atomic<int>              ready_workers{0};
+	    std::atomic<bool>             stop_requested{false};
+	    bool                          running = false;
+	    StateMachineError             last_error = StateMachineError::None;
+	};
+
+}
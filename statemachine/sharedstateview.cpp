@@ -0,0 +1,372 @@
+/*
+    SharedStateView implementation
+    ==============================
+
+    Purpose
+    - Implements the shared-memory segment declared in
+      statemachine/sharedstateview.h.
+
+    Intent
+    - Segment layout: header, state records, instance records, then keys,
+      each section aligned to 64 bytes. The header is filled before its magic
+      is stored, so Open() never accepts a half-created segment.
+    - Seqlock protocol: the writer makes a sequence odd, updates the record,
+      and makes it even again. A reader accepts a copy only if the sequence
+      was even and unchanged around it, and gives up after a bounded number
+      of retries (a writer that died mid-update).
+*/
+#include "sharedstateview.h"
+
+#ifdef PLATFORM_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Upp {
+
+static_assert(std::atomic<int64>::is_always_lock_free, "shared counters must be lock-free");
+static_assert(std::atomic<dword>::is_always_lock_free, "shared sequences must be lock-free");
+
+static constexpr dword SHARED_VIEW_MAGIC = 0x31565353;   // "SSV1"
+static constexpr int SEQLOCK_RETRIES = 1000;
+
+struct SharedStateView::Header {
+    std::atomic<dword> magic;
+    int                instance_capacity;
+    int                state_capacity;
+    int                key_length;
+    std::atomic<dword> table_seq;          // state records and state_count
+    std::atomic<int>   instance_count;
+    std::atomic<int>   state_count;
+    std::atomic<int64> instance_overflow;
+    std::atomic<int64> state_overflow;
+};
+
+struct SharedStateView::StateRecord {
+    std::atomic<int64> members;
+    std::atomic<int64> entries;
+    char               id[STATE_ID_LENGTH + 1];
+};
+
+struct SharedStateView::InstanceRecord {
+    std::atomic<dword> seq;
+    std::atomic<int>   state;
+    std::atomic<int64> transitions;
+};
+
+static size_t Align64(size_t n) {
+    return (n + 63) & ~size_t(63);
+}
+
+static void WriteBegin(std::atomic<dword>& seq) {
+    seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void WriteEnd(std::atomic<dword>& seq) {
+    seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+template <class Read>
+static bool ReadConsistent(const std::atomic<dword>& seq, Read read) {
+    for (int attempt = 0; attempt < SEQLOCK_RETRIES; ++attempt) {
+        const dword before = seq.load(std::memory_order_acquire);
+        if (before & 1)
+            continue;
+        read();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) == before)
+            return true;
+    }
+    return false;
+}
+
+template <class T>
+static void Add(std::atomic<T>& x, T delta) {
+    // Single writer: no read-modify-write needed
+    x.store(x.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+size_t SharedStateView::StatesOffset() {
+    return Align64(sizeof(Header));
+}
+
+size_t SharedStateView::InstancesOffset(int states) {
+    return StatesOffset() + Align64(states * sizeof(StateRecord));
+}
+
+size_t SharedStateView::KeysOffset(int instances, int states) {
+    return InstancesOffset(states) + Align64(instances * sizeof(InstanceRecord));
+}
+
+SharedStateView::StateRecord* SharedStateView::GetState(int i) const {
+    return (StateRecord*)((char*)header + StatesOffset()) + i;
+}
+
+SharedStateView::InstanceRecord* SharedStateView::GetInstance(int i) const {
+    return (InstanceRecord*)((char*)header + InstancesOffset(header->state_capacity)) + i;
+}
+
+char* SharedStateView::GetKeyBytes(int i) const {
+    return (char*)header + KeysOffset(header->instance_capacity, header->state_capacity)
+           + size_t(i) * header->key_length;
+}
+
+bool SharedStateView::Map(const char* name, bool create, size_t size) {
+#ifdef PLATFORM_POSIX
+    String path;
+    if (*name != '/')
+        path.Cat('/');
+    path.Cat(name);
+    if (create)
+        shm_unlink(path);
+    const int fd = shm_open(path, create ? O_CREAT | O_EXCL | O_RDWR : O_RDONLY, 0644);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    const bool sized = create ? ftruncate(fd, size) == 0
+                              : fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header);
+    if (!create && sized)
+        size = size_t(st.st_size);
+    void* p = sized ? mmap(nullptr, size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0)
+                    : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+        if (create)
+            shm_unlink(path);
+        return false;
+    }
+    header = (Header*)p;
+    mapped = size;
+    writer = create;
+    shm_name = path;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool SharedStateView::Create(const char* name, int instances, int states, int key_length) {
+    Close();
+    if (instances <= 0 || states <= 0 || key_length < 0)
+        return false;
+    const size_t size = KeysOffset(instances, states) + size_t(instances) * key_length;
+    if (!Map(name, true, size))
+        return false;
+    // ftruncate() zero-fills, which is a valid initial value for every field
+    header->instance_capacity = instances;
+    header->state_capacity = states;
+    header->key_length = key_length;
+    header->magic.store(SHARED_VIEW_MAGIC, std::memory_order_release);
+    return true;
+}
+
+bool SharedStateView::Open(const char* name) {
+    Close();
+    if (!Map(name, false, 0))
+        return false;
+    if (header->magic.load(std::memory_order_acquire) != SHARED_VIEW_MAGIC
+        || header->instance_capacity <= 0 || header->state_capacity <= 0 || header->key_length < 0
+        || KeysOffset(header->instance_capacity, header->state_capacity)
+           + size_t(header->instance_capacity) * header->key_length > mapped) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void SharedStateView::Close() {
+#ifdef PLATFORM_POSIX
+    if (!header)
+        return;
+    munmap(header, mapped);
+    if (writer)
+        shm_unlink(shm_name);
+#endif
+    header = nullptr;
+    mapped = 0;
+    writer = false;
+    shm_name.Clear();
+}
+
+int SharedStateView::GetInstanceCapacity() const {
+    return header ? header->instance_capacity : 0;
+}
+
+int SharedStateView::GetStateCapacity() const {
+    return header ? header->state_capacity : 0;
+}
+
+void SharedStateView::Reset() {
+    if (!writer)
+        return;
+    WriteBegin(header->table_seq);
+    for (int i = 0; i < header->state_count.load(std::memory_order_relaxed); ++i) {
+        StateRecord& s = *GetState(i);
+        s.members.store(0, std::memory_order_relaxed);
+        s.entries.store(0, std::memory_order_relaxed);
+    }
+    header->state_count.store(0, std::memory_order_relaxed);
+    header->instance_count.store(0, std::memory_order_relaxed);
+    header->instance_overflow.store(0, std::memory_order_relaxed);
+    header->state_overflow.store(0, std::memory_order_relaxed);
+    WriteEnd(header->table_seq);
+}
+
+void SharedStateView::SetStateId(int state, const String& id) {
+    if (!writer || state < 0)
+        return;
+    if (state >= header->state_capacity) {
+        const int64 missing = state + 1 - header->state_capacity;
+        if (missing > header->state_overflow.load(std::memory_order_relaxed))
+            header->state_overflow.store(missing, std::memory_order_relaxed);
+        return;
+    }
+    StateRecord& s = *GetState(state);
+    const int length = min(id.GetLength(), STATE_ID_LENGTH);
+    WriteBegin(header->table_seq);
+    memcpy(s.id, id.Begin(), length);
+    s.id[length] = '\0';
+    if (state >= header->state_count.load(std::memory_order_relaxed))
+        header->state_count.store(state + 1, std::memory_order_relaxed);
+    WriteEnd(header->table_seq);
+}
+
+void SharedStateView::SetStateCounts(int state, int64 members, int64 entries) {
+    if (!writer || state < 0 || state >= header->state_capacity)
+        return;
+    StateRecord& s = *GetState(state);
+    WriteBegin(header->table_seq);
+    s.members.store(members, std::memory_order_relaxed);
+    s.entries.store(entries, std::memory_order_relaxed);
+    WriteEnd(header->table_seq);
+}
+
+void SharedStateView::SetKey(int index, const String& key) {
+    if (!writer || index < 0 || index >= header->instance_capacity || !header->key_length)
+        return;
+    InstanceRecord& r = *GetInstance(index);
+    char* bytes = GetKeyBytes(index);
+    const int length = min(key.GetLength(), header->key_length);
+    WriteBegin(r.seq);
+    memcpy(bytes, key.Begin(), length);
+    memset(bytes + length, 0, header->key_length - length);
+    WriteEnd(r.seq);
+}
+
+void SharedStateView::SetInstance(int index, int state, int64 transitions) {
+    if (!writer || index < 0 || index >= header->instance_capacity)
+        return;
+    InstanceRecord& r = *GetInstance(index);
+    WriteBegin(r.seq);
+    r.state.store(state, std::memory_order_relaxed);
+    r.transitions.store(transitions, std::memory_order_relaxed);
+    WriteEnd(r.seq);
+}
+
+void SharedStateView::SetInstanceCount(int n) {
+    if (!writer)
+        return;
+    header->instance_overflow.store(max(n - header->instance_capacity, 0), std::memory_order_relaxed);
+    header->instance_count.store(min(max(n, 0), header->instance_capacity), std::memory_order_release);
+}
+
+void SharedStateView::Commit(int index, int from, int to, int64 transitions, bool entry) {
+    if (!writer)
+        return;
+    SetInstance(index, to, transitions);
+    const bool leave = from >= 0 && from < header->state_capacity;
+    const bool enter = to >= 0 && to < header->state_capacity;
+    if (!leave && !enter)
+        return;
+    WriteBegin(header->table_seq);
+    if (leave)
+        Add(GetState(from)->members, int64(-1));
+    if (enter) {
+        StateRecord& s = *GetState(to);
+        Add(s.members, int64(1));
+        if (entry)
+            Add(s.entries, int64(1));
+    }
+    WriteEnd(header->table_seq);
+}
+
+int SharedStateView::GetInstanceCount() const {
+    return header ? header->instance_count.load(std::memory_order_acquire) : 0;
+}
+
+int SharedStateView::GetStateCount() const {
+    return header ? header->state_count.load(std::memory_order_acquire) : 0;
+}
+
+int64 SharedStateView::GetOverflowCount() const {
+    return header ? header->instance_overflow.load(std::memory_order_relaxed)
+                    + header->state_overflow.load(std::memory_order_relaxed)
+                  : 0;
+}
+
+bool SharedStateView::ReadInstance(int index, SharedInstanceSample& out) const {
+    if (index < 0 || index >= GetInstanceCount())
+        return false;
+    const InstanceRecord& r = *GetInstance(index);
+    out.valid = ReadConsistent(r.seq, [&] {
+        out.state = r.state.load(std::memory_order_relaxed);
+        out.transitions = r.transitions.load(std::memory_order_relaxed);
+    });
+    return out.valid;
+}
+
+int SharedStateView::ReadInstances(int from, int count, Vector<SharedInstanceSample>& out) const {
+    from = max(from, 0);
+    const int end = min(from + count, GetInstanceCount());
+    out.SetCount(max(end - from, 0));
+    // One slot per instance, so a torn record never shifts the ones after it
+    int n = 0;
+    for (int i = from; i < end; ++i) {
+        const InstanceRecord& r = *GetInstance(i);
+        SharedInstanceSample& s = out[i - from];
+        s.valid = ReadConsistent(r.seq, [&] {
+            s.state = r.state.load(std::memory_order_relaxed);
+            s.transitions = r.transitions.load(std::memory_order_relaxed);
+        });
+        n += s.valid;
+    }
+    return n;
+}
+
+String SharedStateView::ReadKey(int index) const {
+    if (index < 0 || index >= GetInstanceCount() || !header->key_length)
+        return String();
+    const InstanceRecord& r = *GetInstance(index);
+    const char* bytes = GetKeyBytes(index);
+    Vector<char> copy;
+    copy.SetCount(header->key_length);
+    if (!ReadConsistent(r.seq, [&] { memcpy(copy.Begin(), bytes, copy.GetCount()); }))
+        return String();
+    int length = 0;
+    while (length < copy.GetCount() && copy[length])
+        ++length;
+    return String(copy.Begin(), length);
+}
+
+bool SharedStateView::ReadStates(Vector<SharedStateSample>& out) const {
+    if (!header)
+        return false;
+    return ReadConsistent(header->table_seq, [&] {
+        const int n = min(header->state_count.load(std::memory_order_relaxed), header->state_capacity);
+        out.SetCount(n);
+        for (int i = 0; i < n; ++i) {
+            const StateRecord& s = *GetState(i);
+            int length = 0;
+            while (length < STATE_ID_LENGTH && s.id[length])
+                ++length;
+            out[i].id = String(s.id, length);
+            out[i].members = s.members.load(std::memory_order_relaxed);
+            out[i].entries = s.entries.load(std::memory_order_relaxed);
+        }
+    });
+}
+
+} // namespace Upp
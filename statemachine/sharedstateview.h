@@ -0,0 +1,111 @@
+/*
+    SharedStateView
+    ===============
+
+    Purpose
+    - Publishes a pool's per-instance state, transition count and key, plus
+      per-state member and entry counters, into a named shared-memory segment
+      so another process can sample them without calling into the owner.
+
+    Intent
+    - Opt-in: nothing is mapped until an EventRouter is given a view.
+    - Fixed-size records, sized at Create(), so publishing never allocates and
+      the reader needs no pointers into the writer's heap.
+    - Seqlocks instead of locks: every instance record has its own sequence,
+      and the state table shares one. The writer never waits; a reader
+      retries the record it caught mid-update.
+    - One commit costs two record updates: the instance and the state table.
+
+    Thread context
+    - One writer thread (the pool's owner). Any number of readers, in this
+      process or others. POSIX only; Create() and Open() fail elsewhere.
+*/
+
+#pragma once
+
+#include <Core/Core.h>
+
+namespace Upp {
+
+	/// One instance as seen by a reader
+	struct SharedInstanceSample : Moveable<SharedInstanceSample> {
+	    int   state = -1;        // state index, -1 while uncommitted
+	    int64 transitions = 0;   // StateMachine::GetCommitCount()
+	    bool  valid = false;     // false if writes kept overlapping the read
+	};
+
+	/// One state as seen by a reader
+	struct SharedStateSample : Moveable<SharedStateSample> {
+	    String id;
+	    int64  members = 0;
+	    int64  entries = 0;
+	};
+
+	class SharedStateView {
+	public:
+	    /// State ids longer than this are truncated in the segment
+	    static constexpr int STATE_ID_LENGTH = 47;
+
+	    SharedStateView() = default;
+	    SharedStateView(const SharedStateView&) = delete;
+	    SharedStateView& operator=(const SharedStateView&) = delete;
+	    ~SharedStateView()                       { Close(); }
+
+	    /// Create (or replace) the segment as its writer. Keys longer than
+	    /// key_length are truncated; 0 publishes no keys.
+	    bool Create(const char* name, int instances, int states, int key_length = 0);
+
+	    /// Map an existing segment read-only
+	    bool Open(const char* name);
+
+	    /// Unmap; the writer also removes the name
+	    void Close();
+	    bool IsOpen() const                      { return header; }
+	    bool IsWriter() const                    { return writer; }
+
+	    int GetInstanceCapacity() const;
+	    int GetStateCapacity() const;
+
+	    /// Writer side
+	    void Reset();
+	    void SetStateId(int state, const String& id);
+	    void SetStateCounts(int state, int64 members, int64 entries);
+	    void SetKey(int index, const String& key);
+	    void SetInstance(int index, int state, int64 transitions);
+	    void SetInstanceCount(int n);
+	    /// Move an instance between states; entry also counts it into 'to'
+	    void Commit(int index, int from, int to, int64 transitions, bool entry = true);
+
+	    /// Reader side; each call returns a consistent record
+	    int GetInstanceCount() const;
+	    int GetStateCount() const;
+	    /// Instances or states that did not fit the capacities given to Create()
+	    int64 GetOverflowCount() const;
+	    bool ReadInstance(int index, SharedInstanceSample& out) const;
+	    /// Sample [from, from + count), clipped to the instance count; out[k] is
+	    /// instance from + k. Returns the number of valid samples.
+	    int ReadInstances(int from, int count, Vector<SharedInstanceSample>& out) const;
+	    String ReadKey(int index) const;
+	    /// Every state, read under one table sequence
+	    bool ReadStates(Vector<SharedStateSample>& out) const;
+
+	private:
+	    struct Header;
+	    struct StateRecord;
+	    struct InstanceRecord;
+
+	    static size_t StatesOffset();
+	    static size_t InstancesOffset(int states);
+	    static size_t KeysOffset(int instances, int states);
+	    StateRecord* GetState(int i) const;
+	    InstanceRecord* GetInstance(int i) const;
+	    char* GetKeyBytes(int i) const;
+	    bool Map(const char* name, bool create, size_t size);
+
+	    Header* header = nullptr;
+	    size_t  mapped = 0;
+	    bool    writer = false;
+	    String  shm_name;
+	};
+
+}
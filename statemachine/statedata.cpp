@@ -0,0 +1,37 @@
+/*
+    StateDataSlot implementation
+    ============================
+
+    Purpose
+    - Implements the state data slot declared in statemachine/statedata.h.
+
+    Intent
+    - Allocated blocks use the aligned operator new, so over-aligned types
+      are honoured too.
+*/
+#include "statedata.h"
+
+namespace Upp {
+
+void StateDataSlot::Construct(const StateDataType& t) {
+    Destroy();
+    if (t.IsEmpty())
+        return;
+    const bool fits = t.size <= INLINE_SIZE && t.align <= int(alignof(std::max_align_t));
+    void* p = fits ? (void*)buffer : ::operator new(size_t(t.size), std::align_val_t(t.align));
+    t.construct(p);
+    type = t;
+    ptr = p;
+}
+
+void StateDataSlot::Destroy() {
+    if (!ptr)
+        return;
+    type.destroy(ptr);
+    if (!IsInline())
+        ::operator delete(ptr, std::align_val_t(type.align));
+    ptr = nullptr;
+    type = StateDataType();
+}
+
+}
@@ -0,0 +1,91 @@
+/*
+    StateData
+    =========
+
+    Purpose
+    - A typed working-data block a state declares for the time the machine
+      is in it: retry counters, partial results, anything that would
+      otherwise live in a side map keyed by GetCurrent().
+
+    Intent
+    - StateDataType describes a block: a per-type tag, size, alignment, and
+      the default-construct / destroy functions. Of<T>() builds it.
+    - StateDataSlot holds at most one constructed block. Types up to
+      INLINE_SIZE bytes with at most max_align_t alignment live in the
+      slot's own buffer; only larger ones are allocated.
+    - Typed access compares the type tag, an address unique per type, so it
+      costs neither a hash lookup nor RTTI.
+
+    Thread context
+    - Same as StateMachine.
+*/
+
+#pragma once
+
+#include <Core/Core.h>
+
+#include <cstddef>
+#include <new>
+
+namespace Upp {
+
+	/// Address that identifies T among state data types. The tag is writable
+	/// so identical-code folding cannot merge the tags of different types.
+	template <class T>
+	const void* StateDataTag() {
+	    static char tag;
+	    return &tag;
+	}
+
+	/// The data block a state keeps while it is current; empty for none
+	struct StateDataType {
+	    const void* tag = nullptr;
+	    int         size = 0;
+	    int         align = 0;
+	    void      (*construct)(void* p) = nullptr;
+	    void      (*destroy)(void* p) = nullptr;
+
+	    bool IsEmpty() const                     { return !tag; }
+
+	    template <class T>
+	    static StateDataType Of() {
+	        StateDataType t;
+	        t.tag = StateDataTag<T>();
+	        t.size = int(sizeof(T));
+	        t.align = int(alignof(T));
+	        t.construct = [](void* p) { new(p) T(); };
+	        t.destroy = [](void* p) { static_cast<T*>(p)->~T(); };
+	        return t;
+	    }
+	};
+
+	class StateDataSlot {
+	public:
+	    /// Largest block kept inline; bigger or over-aligned ones are allocated
+	    static constexpr int INLINE_SIZE = 64;
+
+	    StateDataSlot() = default;
+	    StateDataSlot(const StateDataSlot&) = delete;
+	    StateDataSlot& operator=(const StateDataSlot&) = delete;
+	    ~StateDataSlot()                         { Destroy(); }
+
+	    /// Destroy any held block, then default-construct one of type
+	    void Construct(const StateDataType& type);
+	    void Destroy();
+
+	    bool IsEmpty() const                     { return !ptr; }
+	    bool IsInline() const                    { return ptr == buffer; }
+	    /// Allocated bytes; 0 while empty or inline
+	    int  GetHeapSize() const                 { return ptr && !IsInline() ? type.size : 0; }
+
+	    /// The held block, or nullptr if the slot is empty or holds another type
+	    template <class T>
+	    T* Get() const                           { return ptr && type.tag == StateDataTag<T>() ? static_cast<T*>(ptr) : nullptr; }
+
+	private:
+	    alignas(std::max_align_t) byte buffer[INLINE_SIZE];
+	    void*         ptr = nullptr;
+	    StateDataType type;
+	};
+
+}
@@ -34,11 +34,48 @@
       and invariant-test hardening.
 */
 #include "statemachine.h"
+#include "historyarchive.h"
 
 #include <memory>
 
 namespace Upp {
 
+const char* GetStateMachineErrorName(StateMachineError error) {
+    switch(error) {
+    case StateMachineError::None: return "None";
+    case StateMachineError::EmptyStateId: return "EmptyStateId";
+    case StateMachineError::DuplicateStateId: return "DuplicateStateId";
+    case StateMachineError::EmptyEvent: return "EmptyEvent";
+    case StateMachineError::EmptyFromState: return "EmptyFromState";
+    case StateMachineError::EmptyToState: return "EmptyToState";
+    case StateMachineError::MissingState: return "MissingState";
+    case StateMachineError::MissingFromState: return "MissingFromState";
+    case StateMachineError::MissingToState: return "MissingToState";
+    case StateMachineError::DuplicateTransition: return "DuplicateTransition";
+    case StateMachineError::AlreadyStarted: return "AlreadyStarted";
+    case StateMachineError::NotStarted: return "NotStarted";
+    case StateMachineError::TransitionInProgress: return "TransitionInProgress";
+    case StateMachineError::NoMatchingTransition: return "NoMatchingTransition";
+    case StateMachineError::GuardRejected: return "GuardRejected";
+    case StateMachineError::WrongSourceState: return "WrongSourceState";
+    case StateMachineError::StartEnterFailed: return "StartEnterFailed";
+    case StateMachineError::ExitFailed: return "ExitFailed";
+    case StateMachineError::EnterFailed: return "EnterFailed";
+    case StateMachineError::BackTransitionFailed: return "BackTransitionFailed";
+    case StateMachineError::EventRejectedWhileTransitioning: return "EventRejectedWhileTransitioning";
+    case StateMachineError::EventDroppedWhileTransitioning: return "EventDroppedWhileTransitioning";
+    case StateMachineError::EventQueueFull: return "EventQueueFull";
+    case StateMachineError::EventQueueDrainLimitReached: return "EventQueueDrainLimitReached";
+    case StateMachineError::InvalidSubMachine: return "InvalidSubMachine";
+    case StateMachineError::EmptyRouteKey: return "EmptyRouteKey";
+    case StateMachineError::InvalidDefinition: return "InvalidDefinition";
+    case StateMachineError::UnboundCallback: return "UnboundCallback";
+    case StateMachineError::PrepareFailed: return "PrepareFailed";
+    case StateMachineError::ArchiveFailed: return "ArchiveFailed";
+    }
+    return "Unknown";
+}
+
 static String GetStateMachineErrorText(StateMachineError error) {
     switch(error) {
     case StateMachineError::None: return "None";
@@ -65,6 +102,12 @@ static String GetStateMachineErrorText(StateMachineError error) {
     case StateMachineError::EventDroppedWhileTransitioning: return "Event dropped while transitioning";
     case StateMachineError::EventQueueFull: return "Event queue full";
     case StateMachineError::EventQueueDrainLimitReached: return "Event queue drain limit reached";
+    case StateMachineError::InvalidSubMachine: return "Invalid sub-machine";
+    case StateMachineError::EmptyRouteKey: return "Empty route key";
+    case StateMachineError::InvalidDefinition: return "Invalid definition";
+    case StateMachineError::UnboundCallback: return "Unbound callback";
+    case StateMachineError::PrepareFailed: return "Prepare failed";
+    case StateMachineError::ArchiveFailed: return "History archive failed";
     }
     return "Unknown error";
 }
@@ -73,6 +116,27 @@ String StateMachine::GetLastErrorText() const {
     return GetStateMachineErrorText(last_error);
 }
 
+// Marks machine callbacks on the stack so RunToCompletion can tell events
+// raised from inside them apart from external ones
+struct CallbackScope {
+    int& depth;
+    explicit CallbackScope(int& d) : depth(d) { ++depth; }
+    ~CallbackScope()                         { --depth; }
+};
+
+// A target's Prepare hook, shared by its completion and the exit completion
+struct PrepareProgress {
+    bool finished = false;
+    bool ok = false;
+    bool exit_ok = false;     // the exit succeeded and waits for Prepare
+    bool discarded = false;   // the exit failed; drop the result
+};
+
+// U++ keeps short strings inline; longer ones own a heap block
+static int64 StringHeapBytes(const String& s) {
+    return s.GetLength() > 14 ? s.GetLength() + 1 : 0;
+}
+
 //------------------------------------------------------------------------------
 // TransitionContext carries context during a transition
 //------------------------------------------------------------------------------
@@ -100,7 +164,10 @@ bool StateMachine::AddState(State s) {
         return false;
     }
 
+    state_ids.Add(s.id);
     states.Add(MakeOne<State>(pick(s)));
+    dispatch_cache.Add();
+    dispatch_dirty = true;
     ClearError();
     return true;
 }
@@ -109,6 +176,59 @@ bool StateMachine::AddState(State s) {
 // Add a new transition definition
 //------------------------------------------------------------------------------
 bool StateMachine::AddTransition(Transition t) {
+    if (!CheckTransition(t))
+        return false;
+
+    if (FindTransition(t.from, t.event)) {
+        last_error = StateMachineError::DuplicateTransition;
+        return false;
+    }
+
+    transitions.Add(MakeOne<Transition>(pick(t)));
+    dispatch_dirty = true;
+    ClearError();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Add a guarded candidate to a (from, event) pair
+//------------------------------------------------------------------------------
+bool StateMachine::AddChoice(Transition t) {
+    if (!CheckTransition(t))
+        return false;
+
+    // The first candidate is an ordinary transition, so the dispatch table and
+    // cache need no changes; the rest hang off it
+    const Transition* first = FindTransition(t.from, t.event);
+    if (!first) {
+        transitions.Add(MakeOne<Transition>(pick(t)));
+        dispatch_dirty = true;
+        ClearError();
+        return true;
+    }
+
+    const int i = choices.Find(first);
+    const Transition& last = i >= 0 ? choices[i].Top() : *first;
+    if (!last.Guard) {
+        last_error = StateMachineError::DuplicateTransition;
+        return false;
+    }
+
+    (i >= 0 ? choices[i] : choices.Add(first)).Add(pick(t));
+    dispatch_dirty = true;
+    ClearError();
+    return true;
+}
+
+int StateMachine::GetChoiceCount(const String& from, const String& event) const {
+    const Transition* first = FindTransition(from, event);
+    if (!first)
+        return 0;
+    const int i = choices.Find(first);
+    return 1 + (i >= 0 ? choices[i].GetCount() : 0);
+}
+
+bool StateMachine::CheckTransition(const Transition& t) {
     if (started) {
         last_error = StateMachineError::AlreadyStarted;
         return false;
@@ -135,17 +255,59 @@ bool StateMachine::AddTransition(Transition t) {
         last_error = StateMachineError::MissingToState;
         return false;
     }
+    return true;
+}
 
-    if (FindTransition(t.from, t.event)) {
-        last_error = StateMachineError::DuplicateTransition;
+//------------------------------------------------------------------------------
+// Add a sub-machine instance sharing another machine's definition
+//------------------------------------------------------------------------------
+bool StateMachine::AddSubMachine(const String& id, StateMachine& definition) {
+    if (started) {
+        last_error = StateMachineError::AlreadyStarted;
+        return false;
+    }
+    if (id.IsEmpty()) {
+        last_error = StateMachineError::EmptyStateId;
+        return false;
+    }
+    if (FindStateIndex(id) >= 0 || FindSubMachine(id) >= 0) {
+        last_error = StateMachineError::DuplicateStateId;
         return false;
     }
+    for (const auto& st : states)
+        if (st->id.StartsWith(id + ".")) {
+            last_error = StateMachineError::DuplicateStateId;
+            return false;
+        }
 
-    transitions.Add(MakeOne<Transition>(pick(t)));
+    // Definitions are flat: no self-reference, no nesting, and a valid entry
+    if (&definition == this || !definition.sub_machines.IsEmpty() ||
+        definition.FindStateIndex(definition.initial) < 0)
+    {
+        last_error = StateMachineError::InvalidSubMachine;
+        return false;
+    }
+
+    SubMachineInstance& inst = sub_machines.Add();
+    inst.id = id;
+    inst.definition = &definition;
+    if (sub_machines.GetCount() > 1) {
+        const SubMachineInstance& prev = sub_machines[sub_machines.GetCount() - 2];
+        inst.offset = prev.offset + prev.definition->states.GetCount();
+    }
+    dispatch_dirty = true;
     ClearError();
     return true;
 }
 
+bool StateMachine::HasSubMachine(const String& id) const {
+    return FindSubMachine(id) >= 0;
+}
+
+int StateMachine::GetSubMachineCount() const {
+    return sub_machines.GetCount();
+}
+
 //------------------------------------------------------------------------------
 // Query helpers
 //------------------------------------------------------------------------------
@@ -162,7 +324,10 @@ int StateMachine::GetStateCount() const {
 }
 
 int StateMachine::GetTransitionCount() const {
-    return transitions.GetCount();
+    int count = transitions.GetCount();
+    for (int i = 0; i < choices.GetCount(); ++i)
+        count += choices[i].GetCount();
+    return count;
 }
 
 //------------------------------------------------------------------------------
@@ -182,27 +347,42 @@ bool StateMachine::Start() {
         return false;
     }
 
-    const State* init = FindState(initial);
-    if (!init) {
+    bool definition_dirty = dispatch_dirty;
+    for (const SubMachineInstance& inst : sub_machines)
+        definition_dirty |= inst.definition->dispatch_dirty;
+    if (definition_dirty)
+        CompileDispatch();
+
+    const int init_index = FindStateIndex(initial);
+    if (init_index < 0) {
         last_error = StateMachineError::MissingState;
         return false;
     }
+    const State* init = GetStateAt(init_index);
 
-    const String start_initial = initial;
+    const String start_initial = GetStateIdAt(init_index);
     auto start_finished = std::make_shared<bool>(false);
     started = true;
     transitioning = true;
     current = start_initial;
+    current_index = init_index;
     ClearError();
 
     auto finish_start = [this, start_initial, start_finished](bool success) {
         if (*start_finished)
             return;
         *start_finished = true;
+        if (resource_entering >= 0)
+            SettleResources(success);
+        if (data_entering)
+            SettleStateData(success);
 
         if (success) {
-            transitionHistory.Add(MakeOne<TransitionRecord>("", start_initial, "__start"));
+            transitionHistory.Add("", start_initial, "__start");
+            if (history_archive)
+                history_archive->Add(archive_machine, "", start_initial, "__start");
             transitioning = false;
+            NotifyCommit();
             ClearError();
             DrainQueuedEvents();
             return;
@@ -211,17 +391,53 @@ bool StateMachine::Start() {
         transitioning = false;
         started = false;
         current.Clear();
+        current_index = -1;
         transitionHistory.Clear();
-        queued_events.Clear();
+        ClearQueue();
+        internal_events.Clear();
+        CheckQueueWatermarks();
+        NotifyCommit();
         last_error = StateMachineError::StartEnterFailed;
     };
 
-    if (init->OnEnter)
-        init->OnEnter(*this, [this, finish_start](bool success) {
-            finish_start(success);
+    auto enter_initial = [this, init, init_index, start_initial, finish_start]() {
+        EnterStateData(init_index);
+        if (init->Load && !AcquireResource(init_index)) {
+            finish_start(false);
+            return;
+        }
+        bool entering = false;
+        if (enter_hook || init->OnEnter) {
+            CallbackScope scope(callback_depth);
+            Function<void(bool)> init_done = [this, finish_start](bool success) {
+                finish_start(success);
+            };
+            entering = enter_hook && enter_hook(*this, start_initial, init_done);
+            if (!entering && init->OnEnter) {
+                init->OnEnter(*this, init_done);
+                entering = true;
+            }
+        }
+        if (!entering)
+            finish_start(true);
+    };
+
+    // Nothing to overlap with on start; Prepare simply runs first
+    if (init->Prepare) {
+        auto prepared = std::make_shared<bool>(false);
+        CallbackScope scope(callback_depth);
+        init->Prepare(*this, [prepared, enter_initial, finish_start](bool success) {
+            if (*prepared)
+                return;
+            *prepared = true;
+            if (success)
+                enter_initial();
+            else
+                finish_start(false);
         });
+    }
     else
-        finish_start(true);
+        enter_initial();
     return true;
 }
 
@@ -243,6 +459,8 @@ bool StateMachine::TriggerEvent(const String& e) {
             break;
         case EventPolicy::QueueWhileTransitioning:
             return QueueEvent(e);
+        case EventPolicy::RunToCompletion:
+            return callback_depth > 0 ? QueueInternalEvent(e) : QueueEvent(e);
         }
         return false;
     }
@@ -252,35 +470,59 @@ bool StateMachine::TriggerEvent(const String& e) {
         return false;
     }
 
-    const Transition* t = FindTransition(current, e);
-    if (!t) {
-        last_error = StateMachineError::NoMatchingTransition;
-        return false;
+    // Most states see the same event repeatedly; try the per-state cache first
+    const Transition* t = nullptr;
+    int to_index = -1;
+    DispatchCache* cache = current_index >= 0 && current_index < dispatch_cache.GetCount()
+                           ? &dispatch_cache[current_index] : nullptr;
+    if (cache && cache->transition && cache->event == e) {
+        t = cache->transition;
+        to_index = cache->to_index;
+        ++dispatch_cache_hits;
     }
+    else {
+        ++dispatch_cache_misses;
+        t = ResolveTransition(current_index, e, to_index);
+        if (!t) {
+            last_error = StateMachineError::NoMatchingTransition;
+            return false;
+        }
+        if (to_index < 0) {
+            last_error = StateMachineError::MissingToState;
+            return false;
+        }
 
-    const State* from_state = FindState(t->from);
-    const State* to_state = FindState(t->to);
-    if (!from_state) {
-        last_error = StateMachineError::MissingFromState;
-        return false;
-    }
-    if (!to_state) {
-        last_error = StateMachineError::MissingToState;
-        return false;
+        if (cache) {
+            cache->event = e;
+            cache->transition = t;
+            cache->to_index = to_index;
+        }
     }
 
-    TransitionContext ctx(*this, t->from, t->to, t->event);
-    if (t->Guard && !t->Guard(ctx)) {
+    TransitionContext ctx(*this, current, GetStateIdAt(to_index), t->event);
+    if (t->Guard && !t->Guard(ctx) && !SelectChoice(current_index, t, to_index, ctx)) {
         last_error = StateMachineError::GuardRejected;
         return false;
     }
 
-    if (!DoTransition(*t)) {
+    if (!RunTransition(*t, current_index, to_index, true, {})) {
         return false;
     }
     return true;
 }
 
+//------------------------------------------------------------------------------
+// Trigger an event against a slot the producer reserved earlier
+//------------------------------------------------------------------------------
+bool StateMachine::TriggerReservedEvent(const String& e) {
+    // Handing the slot back first makes room for this event in QueueEvent()
+    if (reserved_slots > 0)
+        --reserved_slots;
+    const bool ok = TriggerEvent(e);
+    CheckQueueWatermarks();
+    return ok;
+}
+
 //------------------------------------------------------------------------------
 // Attempt a transition by descriptor
 //------------------------------------------------------------------------------
@@ -358,16 +600,14 @@ bool StateMachine::GoBack() {
         return false;
     }
 
-    const One<TransitionRecord>& last_step = transitionHistory.Top();
-
     Transition back_transition;
     back_transition.from  = current;
-    back_transition.to    = last_step->from;
+    back_transition.to    = transitionHistory.Top().from;
     back_transition.event = "__back";
 
     bool began = DoTransition(back_transition, false, [this](bool success) {
         if (success) {
-            transitionHistory.Pop();
+            transitionHistory.Drop();
             if (logging)
                 DumpHistory();
             ClearError();
@@ -390,11 +630,22 @@ bool StateMachine::Reset() {
         return false;
     }
 
+    ReleaseResource(resource_pinned);
+    state_data[0].Destroy();
+    state_data[1].Destroy();
     current.Clear();
+    current_index = -1;
     started = false;
     transitioning = false;
     transitionHistory.Clear();
-    queued_events.Clear();
+    ClearQueue();
+    internal_events.Clear();
+    reserved_slots = 0;
+    queue_high = false;
+    ResetDispatchCacheStats();
+    ResetQueueStats();
+    commit_count = 0;
+    NotifyCommit();
     ClearError();
     return true;
 }
@@ -408,14 +659,33 @@ bool StateMachine::Clear() {
         return false;
     }
 
+    ReleaseResource(resource_pinned);
+    own_resources.Purge();
+    state_data[0].Destroy();
+    state_data[1].Destroy();
     current.Clear();
+    current_index = -1;
     initial.Clear();
     started = false;
     transitioning = false;
     states.Clear();
+    state_ids.Clear();
+    choices.Clear();
     transitions.Clear();
+    sub_machines.Clear();
+    dispatch_cache.Clear();
+    dispatch_events.Clear();
+    dispatch_table.Clear();
+    dispatch_dirty = true;
     transitionHistory.Clear();
-    queued_events.Clear();
+    ClearQueue();
+    internal_events.Clear();
+    reserved_slots = 0;
+    queue_high = false;
+    ResetDispatchCacheStats();
+    ResetQueueStats();
+    commit_count = 0;
+    NotifyCommit();
     ClearError();
     return true;
 }
@@ -424,19 +694,383 @@ void StateMachine::SetMaxQueuedEvents(int n) {
     if (n < 0)
         n = 0;
     max_queued_events = n;
-    while (queued_events.GetCount() > max_queued_events)
-        queued_events.Remove(queued_events.GetCount() - 1);
+    if (queued_events.GetCount() > max_queued_events) {
+        while (queued_events.GetCount() > max_queued_events) {
+            queued_events.DropTail();
+            --queued_seq;       // keep seq consecutive for the next push
+        }
+        IndexQueuedLatest();    // the dropped tail may have held a name's newest entry
+    }
+    reserved_slots = min(reserved_slots, max_queued_events - queued_events.GetCount());
+    CheckQueueWatermarks();
     ClearError();
 }
 
+//------------------------------------------------------------------------------
+// Producer flow control
+//------------------------------------------------------------------------------
+int StateMachine::GetQueueCapacityLeft() const {
+    return max(0, max_queued_events - queued_events.GetCount() - reserved_slots);
+}
+
+bool StateMachine::ReserveQueueSlots(int n) {
+    if (n > GetQueueCapacityLeft()) {
+        ++queue_stats.queue_full;
+        last_error = StateMachineError::EventQueueFull;
+        return false;
+    }
+    if (n > 0)
+        reserved_slots += n;
+    CheckQueueWatermarks();
+    ClearError();
+    return true;
+}
+
+void StateMachine::ReleaseQueueSlots(int n) {
+    reserved_slots = max(0, reserved_slots - max(n, 0));
+    CheckQueueWatermarks();
+}
+
+void StateMachine::SetQueueWatermarks(int low_percent, int high_percent) {
+    queue_high_percent = minmax(high_percent, 0, 100);
+    queue_low_percent = minmax(low_percent, 0, queue_high_percent);
+    CheckQueueWatermarks();
+    ClearError();
+}
+
+// Hysteresis: high fires once on the way up, low once on the way back down
+void StateMachine::CheckQueueWatermarks() {
+    if (max_queued_events <= 0)
+        return;
+    const int level = queued_events.GetCount() + reserved_slots;
+    if (!queue_high && level * 100 >= queue_high_percent * max_queued_events && level > 0) {
+        queue_high = true;
+        if (WhenQueueHigh)
+            WhenQueueHigh();
+    }
+    else if (queue_high && level * 100 <= queue_low_percent * max_queued_events) {
+        queue_high = false;
+        if (WhenQueueLow)
+            WhenQueueLow();
+    }
+}
+
+void StateMachine::SetMaxInternalEvents(int n) {
+    if (n < 0)
+        n = 0;
+    max_internal_events = n;
+    while (internal_events.GetCount() > max_internal_events)
+        internal_events.DropTail();
+    ClearError();
+}
+
+void StateMachine::SetMaxSpilledEvents(int n) {
+    if (n < 0)
+        n = 0;
+    max_spilled_events = n;
+    while (spilled_events.GetCount() > max_spilled_events)
+        spilled_events.DropTail();
+    ClearError();
+}
+
+void StateMachine::SetEventOverflowPolicy(const String& event, QueueOverflowPolicy policy) {
+    event_overflow_policies.GetAdd(event) = policy;
+    ClearError();
+}
+
+QueueOverflowPolicy StateMachine::GetEventOverflowPolicy(const String& event) const {
+    return event_overflow_policies.Get(event, overflow_policy);
+}
+
+void StateMachine::ClearQueuedEvents() {
+    ClearQueue();
+    internal_events.Clear();
+    CheckQueueWatermarks();
+    ClearError();
+}
+
+//------------------------------------------------------------------------------
+// Freeze transitions into a dense (state, event) -> transition table
+//------------------------------------------------------------------------------
+void StateMachine::CompileDispatch() {
+    dispatch_events.Clear();
+    dispatch_table.Clear();
+    dispatch_dirty = false;
+
+    // Cached targets are absolute state indices; states added after Reset()
+    // shift every sub-machine state behind them
+    for (DispatchCache& c : dispatch_cache)
+        c = DispatchCache();
+
+    // Definitions may have grown since AddSubMachine(); re-pack the offsets
+    int offset = 0;
+    for (SubMachineInstance& inst : sub_machines) {
+        inst.offset = offset;
+        offset += inst.definition->states.GetCount();
+        inst.exits.Clear();
+        if (inst.definition->dispatch_dirty)
+            inst.definition->CompileDispatch();
+    }
+
+    for (const auto& t : transitions)
+        dispatch_events.FindAdd(t->event);
+
+    // Very wide machines keep the linear lookup instead of a huge sparse table
+    const int own_count = states.GetCount();
+    const int64 cells = int64(own_count) * dispatch_events.GetCount();
+    if (cells > 0 && cells <= max_dispatch_cells)
+        dispatch_table.SetCount(int(cells), -1);
+
+    const int event_count = dispatch_events.GetCount();
+    for (int i = 0; i < transitions.GetCount(); ++i) {
+        const Transition& t = *transitions[i];
+        const int from_index = FindStateIndex(t.from);
+        if (from_index < 0)
+            continue;
+        if (from_index < own_count) {
+            if (!dispatch_table.IsEmpty())
+                dispatch_table[from_index * event_count + dispatch_events.Find(t.event)] = i;
+            continue;
+        }
+        SubMachineInstance& inst = sub_machines[FindSubMachineAt(from_index)];
+        SubMachineExit& exit = inst.exits.Add();
+        exit.transition = i;
+        exit.local = t.from == inst.id ? -1 : from_index - own_count - inst.offset;
+    }
+
+    definition_usage = GetDefinitionUsage();
+}
+
+const Transition* StateMachine::FindCompiledTransition(int from_index, const String& ev) const {
+    const int event_index = dispatch_events.Find(ev);
+    if (from_index < 0 || event_index < 0)
+        return nullptr;
+    const int i = dispatch_table[from_index * dispatch_events.GetCount() + event_index];
+    return i >= 0 ? transitions[i].Get() : nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Memory accounting
+//------------------------------------------------------------------------------
+StateMachineMemoryUsage StateMachine::GetDefinitionUsage() const {
+    StateMachineMemoryUsage u;
+    u.definition = sizeof(StateMachine)
+                 + int64(states.GetAlloc()) * sizeof(One<State>) + int64(states.GetCount()) * sizeof(State)
+                 + int64(transitions.GetAlloc()) * sizeof(One<Transition>) + int64(transitions.GetCount()) * sizeof(Transition)
+                 + int64(dispatch_cache.GetAlloc()) * sizeof(DispatchCache)
+                 + int64(dispatch_events.GetCount() + state_ids.GetCount()) * (sizeof(String) + 2 * sizeof(int))
+                 + int64(dispatch_table.GetAlloc()) * sizeof(int)
+                 + int64(sub_machines.GetAlloc()) * sizeof(SubMachineInstance);
+    for (const auto& st : states) {
+        u.strings += StringHeapBytes(st->id);
+        u.callbacks += bool(st->OnEnter) + bool(st->OnExit) + bool(st->Prepare) + bool(st->Discard) +
+                       bool(st->Load);
+    }
+    for (const auto& t : transitions) {
+        u.strings += StringHeapBytes(t->event) + StringHeapBytes(t->from) + StringHeapBytes(t->to);
+        u.callbacks += bool(t->Guard) + bool(t->OnBefore) + bool(t->OnAfter);
+    }
+    for (int i = 0; i < choices.GetCount(); ++i) {
+        const Array<Transition>& candidates = choices[i];
+        u.definition += sizeof(const Transition*) + sizeof(Array<Transition>)
+                      + int64(candidates.GetCount()) * (sizeof(Transition) + sizeof(void*));
+        for (const Transition& t : candidates) {
+            u.strings += StringHeapBytes(t.event) + StringHeapBytes(t.from) + StringHeapBytes(t.to);
+            u.callbacks += bool(t.Guard) + bool(t.OnBefore) + bool(t.OnAfter);
+        }
+    }
+    for (const SubMachineInstance& inst : sub_machines) {
+        u.definition += int64(inst.exits.GetAlloc()) * sizeof(SubMachineExit);
+        u.strings += StringHeapBytes(inst.id);
+    }
+    u.strings += StringHeapBytes(initial);
+    return u;
+}
+
+void StateMachine::Rehome() {
+    queued_events = clone(queued_events);
+    spilled_events = clone(spilled_events);
+    internal_events = clone(internal_events);
+    queued_latest = clone(queued_latest);
+    transitionHistory.Rehome();
+    dispatch_cache = clone(dispatch_cache);
+}
+
+StateMachineMemoryUsage StateMachine::GetMemoryUsage() const {
+    // Definition is frozen once compiled, so only runtime containers are walked
+    StateMachineMemoryUsage u = dispatch_dirty ? GetDefinitionUsage() : definition_usage;
+    u.callbacks += bool(WhenTransitionStarted) + bool(WhenTransitionFinished);
+
+    // History strings share the definition's buffers, so only records count
+    u.history = transitionHistory.GetMemoryUsage();
+
+    u.queue = int64(queued_events.GetCount() + spilled_events.GetCount()) * sizeof(QueuedEvent)
+            + int64(internal_events.GetCount()) * sizeof(String)
+            + int64(queued_latest.GetCount()) * (sizeof(String) + sizeof(int64));
+    for (int i = 0; i < queued_events.GetCount(); ++i)
+        u.queue += StringHeapBytes(queued_events[i].event);
+    for (int i = 0; i < spilled_events.GetCount(); ++i)
+        u.queue += StringHeapBytes(spilled_events[i].event);
+    for (int i = 0; i < internal_events.GetCount(); ++i)
+        u.queue += StringHeapBytes(internal_events[i]);
+    return u;
+}
+
 //------------------------------------------------------------------------------
 // Lookup helpers
 //------------------------------------------------------------------------------
+// Own states occupy [0, states.GetCount()); each sub-machine instance follows
+// at its offset with the definition's local state indices.
+int StateMachine::FindStateIndex(const String& id) const {
+    const int i = state_ids.Find(id);
+    if (i >= 0)
+        return i;
+    for (const SubMachineInstance& inst : sub_machines) {
+        const int n = inst.id.GetLength();
+        if (!id.StartsWith(inst.id))
+            continue;
+        const StateMachine& def = *inst.definition;
+        int local = -1;
+        if (id.GetLength() == n)
+            local = def.FindStateIndex(def.initial);
+        else if (id[n] == '.')
+            local = def.FindStateIndex(id.Mid(n + 1));
+        else
+            continue;
+        return local >= 0 ? states.GetCount() + inst.offset + local : -1;
+    }
+    return -1;
+}
+
+int StateMachine::FindSubMachine(const String& id) const {
+    for (int i = 0; i < sub_machines.GetCount(); ++i)
+        if (sub_machines[i].id == id)
+            return i;
+    return -1;
+}
+
+int StateMachine::FindSubMachineAt(int index) const {
+    const int local = index - states.GetCount();
+    int lo = 0;
+    int hi = sub_machines.GetCount();
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (sub_machines[mid].offset <= local)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || local < 0)
+        return -1;
+    const SubMachineInstance& inst = sub_machines[lo - 1];
+    return local - inst.offset < inst.definition->states.GetCount() ? lo - 1 : -1;
+}
+
+const State* StateMachine::GetStateAt(int index) const {
+    if (index < 0)
+        return nullptr;
+    if (index < states.GetCount())
+        return states[index].Get();
+    const int k = FindSubMachineAt(index);
+    if (k < 0)
+        return nullptr;
+    const SubMachineInstance& inst = sub_machines[k];
+    return inst.definition->states[index - states.GetCount() - inst.offset].Get();
+}
+
+String StateMachine::GetStateIdAt(int index) const {
+    if (index < 0)
+        return String();
+    if (index < states.GetCount())
+        return states[index]->id;
+    const int k = FindSubMachineAt(index);
+    if (k < 0)
+        return String();
+    const SubMachineInstance& inst = sub_machines[k];
+    return inst.id + "." + inst.definition->states[index - states.GetCount() - inst.offset]->id;
+}
+
 const State* StateMachine::FindState(const String& id) const {
-    for (const auto& s : states)
-        if (s->id == id)
-            return s.Get();
-    return nullptr;
+    return GetStateAt(FindStateIndex(id));
+}
+
+// Lookup order inside an instance: exits bound to that exact state, then the
+// shared definition's transitions, then exits bound to the whole instance.
+const Transition* StateMachine::ResolveTransition(int from_index, const String& ev, int& to_index) const {
+    to_index = -1;
+    const int own_count = states.GetCount();
+    if (from_index < 0)
+        return nullptr;
+    if (from_index < own_count) {
+        const Transition* t = IsDispatchCompiled() ? FindCompiledTransition(from_index, ev)
+                                                   : FindTransition(states[from_index]->id, ev);
+        if (t)
+            to_index = FindStateIndex(t->to);
+        return t;
+    }
+
+    const int k = FindSubMachineAt(from_index);
+    if (k < 0)
+        return nullptr;
+    const SubMachineInstance& inst = sub_machines[k];
+    const StateMachine& def = *inst.definition;
+    const int local = from_index - own_count - inst.offset;
+
+    const Transition* any_state_exit = nullptr;
+    for (const SubMachineExit& exit : inst.exits) {
+        const Transition& t = *transitions[exit.transition];
+        if (t.event != ev)
+            continue;
+        if (exit.local == local) {
+            to_index = FindStateIndex(t.to);
+            return &t;
+        }
+        if (exit.local < 0)
+            any_state_exit = &t;
+    }
+
+    const Transition* t = def.IsDispatchCompiled() ? def.FindCompiledTransition(local, ev)
+                                                   : def.FindTransition(def.states[local]->id, ev);
+    if (t) {
+        const int to_local = def.FindStateIndex(t->to);
+        to_index = to_local >= 0 ? own_count + inst.offset + to_local : -1;
+        return t;
+    }
+    if (any_state_exit)
+        to_index = FindStateIndex(any_state_exit->to);
+    return any_state_exit;
+}
+
+// Later candidates are keyed by the pair's first transition in the machine
+// that owns it: this one, or the shared definition inside an instance.
+bool StateMachine::SelectChoice(int from_index, const Transition*& t, int& to_index,
+                                TransitionContext& ctx) const
+{
+    const StateMachine* owner = this;
+    int base = 0;
+    int i = choices.Find(t);
+    if (i < 0 && from_index >= states.GetCount()) {
+        const int k = FindSubMachineAt(from_index);
+        if (k >= 0) {
+            owner = sub_machines[k].definition;
+            base = states.GetCount() + sub_machines[k].offset;
+            i = owner->choices.Find(t);
+        }
+    }
+    if (i < 0)
+        return false;
+
+    for (const Transition& c : owner->choices[i]) {
+        const int target = owner->FindStateIndex(c.to);
+        const int index = target >= 0 ? base + target : -1;
+        ctx.toState = GetStateIdAt(index);
+        if (!c.Guard || c.Guard(ctx)) {
+            t = &c;
+            to_index = index;
+            return true;
+        }
+    }
+    return false;
 }
 
 const Transition* StateMachine::FindTransition(const String& from, const String& ev) const {
@@ -449,12 +1083,21 @@ const Transition* StateMachine::FindTransition(const String& from, const String&
 bool StateMachine::DoTransition(const Transition& t,
                                 bool record,
                                 Function<void(bool)> on_done)
+{
+    return RunTransition(t, FindStateIndex(t.from), FindStateIndex(t.to), record, pick(on_done));
+}
+
+bool StateMachine::RunTransition(const Transition& t,
+                                 int from_index,
+                                 int to_index,
+                                 bool record,
+                                 Function<void(bool)> on_done)
 {
     if (logging)
         LOG(Format("DoTransition: %s -> %s, record=%d", t.from, t.to, int(record)));
 
-    const State* fromState = FindState(t.from);
-    const State* toState   = FindState(t.to);
+    const State* fromState = GetStateAt(from_index);
+    const State* toState   = GetStateAt(to_index);
     if (!fromState) {
         last_error = StateMachineError::MissingFromState;
         if (logging)
@@ -473,24 +1116,35 @@ bool StateMachine::DoTransition(const Transition& t,
     auto enter_finished = std::make_shared<bool>(false);
     auto exit_finished  = std::make_shared<bool>(false);
     auto enter_started  = std::make_shared<bool>(false);
+    std::shared_ptr<PrepareProgress> prepare;
+    if (toState->Prepare)
+        prepare = std::make_shared<PrepareProgress>();
     ClearError();
     transitioning = true;
-    TransitionContext ctx(*this, t.from, t.to, t.event);
+    TransitionContext ctx(*this, GetStateIdAt(from_index), GetStateIdAt(to_index), t.event);
 
     // OnBefore callback
-    if (WhenTransitionStarted)
-        WhenTransitionStarted(ctx);
-    if (t.OnBefore)
-        t.OnBefore(ctx);
+    {
+        CallbackScope scope(callback_depth);
+        if (WhenTransitionStarted)
+            WhenTransitionStarted(ctx);
+        if (t.OnBefore)
+            t.OnBefore(ctx);
+    }
 
-    // Chain exit → enter → finalize → after
-    auto on_enter_done = [this, ctx, record, on_done, t, enter_finished, enter_started](bool success) {
+    // Chain (exit ‖ prepare) → enter → finalize → after
+    auto on_enter_done = [this, ctx, record, on_done, t, enter_finished, enter_started, prepare](bool success) {
         if (*enter_finished)
             return;
         *enter_finished = true;
+        if (resource_pinned >= 0 || resource_entering >= 0)
+            SettleResources(success);
+        if (data_entering)
+            SettleStateData(success);
 
         if (success) {
             Finalize(ctx, record);
+            CallbackScope scope(callback_depth);
             if (WhenTransitionFinished)
                 WhenTransitionFinished(ctx);
 
@@ -504,6 +1158,8 @@ bool StateMachine::DoTransition(const Transition& t,
                 last_error = StateMachineError::BackTransitionFailed;
             else if (*enter_started)
                 last_error = StateMachineError::EnterFailed;
+            else if (prepare && prepare->finished && !prepare->ok && !prepare->discarded)
+                last_error = StateMachineError::PrepareFailed;
             else
                 last_error = StateMachineError::ExitFailed;
         }
@@ -513,29 +1169,58 @@ bool StateMachine::DoTransition(const Transition& t,
             DrainQueuedEvents();
     };
 
-    auto on_exit_done = [this, toState, ctx, on_enter_done, exit_finished, enter_started, enter_finished, record](bool success) {
+    auto on_exit_done = [this, toState, to_index, ctx, on_enter_done, exit_finished, enter_started, enter_finished, record, prepare](bool success) {
         if (*exit_finished)
             return;
         *exit_finished = true;
 
+        if (success && prepare) {
+            if (!prepare->finished) {
+                prepare->exit_ok = true;    // Prepare's completion resumes here
+                return;
+            }
+            if (!prepare->ok) {
+                if (logging)
+                    LOG("Error: Prepare failed, transition aborted.");
+                on_enter_done(false);
+                return;
+            }
+        }
+
         if (success) {
-            if (toState && toState->OnEnter) {
-                *enter_started = true;
-                toState->OnEnter(*this, [this, ctx, on_enter_done, enter_finished](bool enter_success) {
+            *enter_started = true;
+            EnterStateData(to_index);
+            if (toState->Load && !AcquireResource(to_index)) {
+                if (logging)
+                    LOG("Error: Load failed, transition aborted.");
+                on_enter_done(false);
+                return;
+            }
+            bool entering = false;    // OnEnter or the router's batch owns completion
+            if (enter_hook || toState->OnEnter) {
+                CallbackScope scope(callback_depth);
+                Function<void(bool)> enter_done = [this, ctx, to_index, on_enter_done, enter_finished](bool enter_success) {
                     if (*enter_finished)
                         return;
-                    if (enter_success)
+                    if (enter_success) {
                         current = ctx.toState;
+                        current_index = to_index;
+                    }
                     if (logging) {
                         LOG("Transition " + String(enter_success ? "succeeded" : "failed") +
                             ": now in state " + current);
                     }
                     on_enter_done(enter_success);
-                });
+                };
+                entering = enter_hook && enter_hook(*this, ctx.toState, enter_done);
+                if (!entering && toState->OnEnter) {
+                    toState->OnEnter(*this, enter_done);
+                    entering = true;
+                }
             }
-            else {
-                *enter_started = true;
+            if (!entering) {
                 current = ctx.toState;
+                current_index = to_index;
                 if (logging)
                     LOG("Transition succeeded: now in state " + current);
                 on_enter_done(true);
@@ -544,15 +1229,54 @@ bool StateMachine::DoTransition(const Transition& t,
         else {
             if (logging)
                 LOG("Error: OnExit failed, transition aborted.");
+            if (prepare) {
+                prepare->discarded = true;
+                if (prepare->finished && prepare->ok && toState->Discard) {
+                    CallbackScope scope(callback_depth);
+                    toState->Discard(*this);
+                }
+            }
             transitioning = false;
             last_error = record ? StateMachineError::ExitFailed : StateMachineError::BackTransitionFailed;
             on_enter_done(false);
         }
     };
 
+    // Start the target's Prepare, then the exit, so both run together
+    if (prepare) {
+        CallbackScope scope(callback_depth);
+        toState->Prepare(*this, [this, toState, prepare, on_exit_done, exit_finished](bool ok) {
+            if (prepare->finished)
+                return;
+            prepare->finished = true;
+            prepare->ok = ok;
+            if (prepare->discarded) {
+                if (ok && toState->Discard) {
+                    CallbackScope scope(callback_depth);
+                    toState->Discard(*this);
+                }
+            }
+            else if (prepare->exit_ok) {
+                *exit_finished = false;
+                on_exit_done(true);
+            }
+        });
+    }
+
+    // A Prepare that already failed aborts before the source has exited
+    if (prepare && prepare->finished && !prepare->ok) {
+        if (logging)
+            LOG("Error: Prepare failed, transition aborted.");
+        *exit_finished = true;
+        on_enter_done(false);
+        return true;
+    }
+
     // Start exit phase
-    if (fromState->OnExit)
+    if (fromState->OnExit) {
+        CallbackScope scope(callback_depth);
         fromState->OnExit(*this, on_exit_done);
+    }
     else
         on_exit_done(true);
 
@@ -564,11 +1288,112 @@ bool StateMachine::QueueEvent(const String& e) {
         last_error = StateMachineError::EmptyEvent;
         return false;
     }
-    if (max_queued_events <= 0 || queued_events.GetCount() >= max_queued_events) {
+    if (max_queued_events <= 0 || queued_events.GetCount() + reserved_slots >= max_queued_events) {
+        if (!QueueOverflowEvent(e))
+            return false;
+        ClearError();
+        return true;
+    }
+    PushQueuedEvent(e);
+    ClearError();
+    return true;
+}
+
+bool StateMachine::QueueOverflowEvent(const String& e) {
+    switch (GetEventOverflowPolicy(e)) {
+    case QueueOverflowPolicy::RejectNewest:
+        break;
+    case QueueOverflowPolicy::DropOldest:
+        // Nothing to drop when reservations hold the whole capacity
+        if (queued_events.IsEmpty())
+            break;
+        queued_events.DropHead();
+        ++queue_stats.dropped_oldest;
+        PushQueuedEvent(e);
+        return true;
+    case QueueOverflowPolicy::ReplaceLatest:
+        // The newest entry per name is indexed by seq, so this is O(1) at any
+        // depth. It keeps its enqueued_at, so its wait covers the whole stay.
+        if (const int64* seq = queued_latest.FindPtr(e)) {
+            const int64 i = queued_events.IsEmpty() ? -1 : *seq - queued_events.Head().seq;
+            if (i >= 0 && i < queued_events.GetCount()) {
+                ++queue_stats.replaced;
+                return true;
+            }
+        }
+        break;
+    case QueueOverflowPolicy::Spill:
+        if (spilled_events.GetCount() >= max_spilled_events)
+            break;
+        {
+            QueuedEvent& q = spilled_events.AddTail();
+            q.event = e;
+            q.enqueued_at = usecs();
+        }
+        // Admitted, so dequeuing it later keeps dequeued <= enqueued
+        ++queue_stats.enqueued;
+        ++queue_stats.spilled;
+        return true;
+    }
+    ++queue_stats.queue_full;
+    last_error = StateMachineError::EventQueueFull;
+    return false;
+}
+
+void StateMachine::PushQueuedEvent(const String& e) {
+    QueuedEvent& q = queued_events.AddTail();
+    q.event = e;
+    q.enqueued_at = usecs();
+    q.seq = queued_seq++;
+    queued_latest.GetAdd(e) = q.seq;
+    // Names whose entries have all left pile up; rebuilding is amortized O(1)
+    if (queued_latest.GetCount() > 2 * queued_events.GetCount() + 16)
+        IndexQueuedLatest();
+
+    const int depth = queued_events.GetCount();
+    ++queue_stats.enqueued;
+    ++queue_stats.depth_histogram[StateMachineQueueStats::GetBucket(depth)];
+    if (depth > queue_stats.depth_high_water)
+        queue_stats.depth_high_water = depth;
+    CheckQueueWatermarks();
+}
+
+void StateMachine::ClearQueue() {
+    queued_events.Clear();
+    spilled_events.Clear();
+    queued_latest.Clear();
+}
+
+void StateMachine::IndexQueuedLatest() {
+    queued_latest.Clear();
+    for (int i = 0; i < queued_events.GetCount(); ++i)
+        queued_latest.GetAdd(queued_events[i].event) = queued_events[i].seq;
+}
+
+String StateMachine::TakeQueuedEvent(BiVector<QueuedEvent>& queue) {
+    String event = pick(queue.Head().event);
+    const int64 wait = usecs() - queue.Head().enqueued_at;
+    queue.DropHead();
+
+    ++queue_stats.dequeued;
+    queue_stats.wait_total += wait;
+    ++queue_stats.wait_histogram[StateMachineQueueStats::GetBucket(wait)];
+    if (wait > queue_stats.wait_high_water)
+        queue_stats.wait_high_water = wait;
+    return event;
+}
+
+bool StateMachine::QueueInternalEvent(const String& e) {
+    if (e.IsEmpty()) {
+        last_error = StateMachineError::EmptyEvent;
+        return false;
+    }
+    if (internal_events.GetCount() >= max_internal_events) {
+        ++queue_stats.queue_full;
         last_error = StateMachineError::EventQueueFull;
         return false;
     }
-    queued_events.Add(e);
+    internal_events.AddTail(e);
     ClearError();
     return true;
 }
@@ -580,14 +1405,45 @@ void StateMachine::DrainQueuedEvents() {
     processing_queue = true;
     const int drain_limit = max_queued_events > 0 ? max_queued_events : 0;
     int drain_steps = 0;
-    while (!queued_events.IsEmpty() && started && !transitioning) {
-        if (drain_steps >= drain_limit) {
-            last_error = StateMachineError::EventQueueDrainLimitReached;
-            break;
+    int spill_steps = 0;
+    int internal_steps = 0;
+    while ((!internal_events.IsEmpty() || !queued_events.IsEmpty() || !spilled_events.IsEmpty()) &&
+           started && !transitioning)
+    {
+        // Run to completion: follow-up events from callbacks go before the next external one
+        String event;
+        if (!internal_events.IsEmpty()) {
+            if (internal_steps >= max_internal_events) {
+                ++queue_stats.drain_limit_reached;
+                last_error = StateMachineError::EventQueueDrainLimitReached;
+                break;
+            }
+            event = pick(internal_events.Head());
+            internal_events.DropHead();
+            ++internal_steps;
+        }
+        else if (!queued_events.IsEmpty()) {
+            if (drain_steps >= drain_limit) {
+                ++queue_stats.drain_limit_reached;
+                last_error = StateMachineError::EventQueueDrainLimitReached;
+                break;
+            }
+            event = TakeQueuedEvent(queued_events);
+            CheckQueueWatermarks();
+            ++drain_steps;
+            internal_steps = 0;
+        }
+        else {
+            // Spilled events are lower priority: taken only once the main queue is empty
+            if (spill_steps >= max_spilled_events) {
+                ++queue_stats.drain_limit_reached;
+                last_error = StateMachineError::EventQueueDrainLimitReached;
+                break;
+            }
+            event = TakeQueuedEvent(spilled_events);
+            ++spill_steps;
+            internal_steps = 0;
         }
-        String event = queued_events[0];
-        queued_events.Remove(0);
-        ++drain_steps;
         if (!TriggerEvent(event))
             break;
         if (transitioning)
@@ -601,6 +1457,89 @@ void StateMachine::DrainQueuedEvents() {
 //------------------------------------------------------------------------------
 // Core transition logic (handles OnExit→OnEnter→history→OnAfter)
 //------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+// State resources: the current state's resource stays pinned in the cache;
+// an entry pins the target's first and settles once the entry finishes
+//------------------------------------------------------------------------------
+StateMachine::~StateMachine() {
+    if (resource_cache) {
+        ReleaseResource(resource_entering);
+        ReleaseResource(resource_pinned);
+    }
+}
+
+bool StateMachine::SetResourceCache(StateResourceCache* cache) {
+    if (started) {
+        last_error = StateMachineError::AlreadyStarted;
+        return false;
+    }
+    resource_cache = cache;
+    ClearError();
+    return true;
+}
+
+bool StateMachine::AcquireResource(int index) {
+    StateResourceCache& cache = GetResourceCache();
+    const String id = GetStateIdAt(index);
+    if (!cache.Acquire(id)) {
+        StateResource r;
+        bool loaded;
+        {
+            CallbackScope scope(callback_depth);
+            loaded = GetStateAt(index)->Load(*this, r);
+        }
+        if (!loaded)
+            return false;
+        cache.Add(id, pick(r));
+    }
+    resource_entering = index;
+    return true;
+}
+
+void StateMachine::SettleResources(bool entered) {
+    if (entered) {
+        ReleaseResource(resource_pinned);
+        resource_pinned = resource_entering;
+        resource_entering = -1;
+    }
+    else
+        ReleaseResource(resource_entering);
+}
+
+void StateMachine::ReleaseResource(int& index) {
+    if (index >= 0)
+        GetResourceCache().Release(GetStateIdAt(index));
+    index = -1;
+}
+
+//------------------------------------------------------------------------------
+// State data: an entry constructs the target's block in the spare slot, and
+// a committed entry destroys the source's block and makes the spare current
+//------------------------------------------------------------------------------
+void StateMachine::EnterStateData(int index) {
+    state_data[data_slot ^ 1].Construct(GetStateAt(index)->data);
+    data_entering = true;
+}
+
+void StateMachine::SettleStateData(bool entered) {
+    data_entering = false;
+    if (entered) {
+        state_data[data_slot].Destroy();
+        data_slot ^= 1;
+    }
+    else
+        state_data[data_slot ^ 1].Destroy();
+}
+
+//------------------------------------------------------------------------------
+// Archive every commit; the archive keeps its own errors
+//------------------------------------------------------------------------------
+void StateMachine::SetHistoryArchive(HistoryArchive* archive, const String& machine) {
+    history_archive = archive;
+    archive_machine = machine;
+    ClearError();
+}
+
 //------------------------------------------------------------------------------
 // Record history and dump if needed
 //------------------------------------------------------------------------------
@@ -611,15 +1550,20 @@ void StateMachine::Finalize(const TransitionContext& ctx, bool record) {
     if (record) {
         // prune any divergent history
         while (!transitionHistory.IsEmpty() &&
-               transitionHistory.Top()->to != ctx.fromState)
+               transitionHistory.Top().to != ctx.fromState)
         {
-            transitionHistory.Pop();
+            transitionHistory.Drop();
         }
-        transitionHistory.Add(
-            MakeOne<TransitionRecord>(ctx.fromState, ctx.toState, ctx.event));
+        transitionHistory.Add(ctx.fromState, ctx.toState, ctx.event);
+        if (history_window && transitionHistory.GetCount() >= 2 * history_window)
+            transitionHistory.KeepLast(history_window);
         if (logging)
             DumpHistory();
     }
+    if (history_archive)
+        history_archive->Add(archive_machine, ctx.fromState, ctx.toState, ctx.event);
+    ++commit_count;
+    NotifyCommit();
 }
 
 } // namespace Upp
@@ -45,6 +45,10 @@
 
 #include <Core/Core.h>
 
+#include "statedata.h"
+#include "stateresourcecache.h"
+#include "transitionhistory.h"
+
 namespace Upp {
 
 	enum class StateMachineError {
@@ -72,17 +76,42 @@ namespace Upp {
 		EventDroppedWhileTransitioning,
 		EventQueueFull,
 		EventQueueDrainLimitReached,
+		InvalidSubMachine,
+		EmptyRouteKey,
+		InvalidDefinition,
+		UnboundCallback,
+		PrepareFailed,
+		ArchiveFailed,
 	};
 
+	/// Number of StateMachineError values; follows the last enumerator above
+	constexpr int STATE_MACHINE_ERROR_COUNT = int(StateMachineError::ArchiveFailed) + 1;
+
+	/// Enumerator name, e.g. "EventQueueFull", for logs and metric labels
+	const char* GetStateMachineErrorName(StateMachineError error);
+
 	// Only TriggerEvent() participates in queueing under QueueWhileTransitioning.
+	// RunToCompletion queues external events the same way, but events raised
+	// from machine callbacks go to a separate internal queue that drains first.
 	enum class EventPolicy {
 		RejectWhileTransitioning,
 		DropWhileTransitioning,
 		QueueWhileTransitioning,
+		RunToCompletion,
+	};
+
+	// What QueueEvent() does with an external event when the queue is full.
+	enum class QueueOverflowPolicy {
+		RejectNewest,    // refuse the new event with EventQueueFull
+		DropOldest,      // discard the queue head to make room
+		ReplaceLatest,   // coalesce into the newest queued event of the same name
+		Spill,           // move it to the larger, lower-priority spill buffer
 	};
 
-	// Forward declaration
+	// Forward declarations
 	class StateMachine;
+	class EventRouter;
+	class HistoryArchive;
 	
 	/// Context passed to Guard / OnBefore / OnAfter callbacks
 	struct TransitionContext {
@@ -92,6 +121,10 @@ namespace Upp {
 	    String             event;
 	
 	    TransitionContext(StateMachine& m, String f, String t, String e);
+
+	    /// The data block of the state the machine is in: the source's in a
+	    /// Guard or OnBefore, the target's in OnAfter. It must be a T.
+	    template <class T> T& Data() const;
 	};
 	
 	/// A single state with async entry/exit handlers
@@ -99,6 +132,17 @@ namespace Upp {
 	    String   id;
 	    Function<void(StateMachine&, Function<void(bool)> done)> OnEnter;
 	    Function<void(StateMachine&, Function<void(bool)> done)> OnExit;
+	    /// Optional: starts with the source's OnExit and is awaited before OnEnter
+	    Function<void(StateMachine&, Function<void(bool)> done)> Prepare = {};
+	    /// Optional: releases a successful Prepare whose exit then failed
+	    Function<void(StateMachine&)> Discard = {};
+	    /// Optional: loads the state's resource on entry, unless the resource
+	    /// cache still holds it; false fails the entry
+	    Function<bool(StateMachine&, StateResource& out)> Load = {};
+	    /// Optional: typed working data, e.g. StateDataType::Of<Retry>(),
+	    /// constructed before Load / OnEnter and destroyed once the machine
+	    /// has entered another state
+	    StateDataType data = {};
 	};
 	
 	/// A transition between two states, with optional guard & hooks
@@ -111,19 +155,61 @@ namespace Upp {
 	    Function<void(const TransitionContext&)>      OnAfter;
 	};
 	
-	/// Record of a completed transition (for history)
-	struct TransitionRecord {
-	    String from;
-	    String to;
-	    String event;
+	/// Approximate heap and container footprint of one or more machines, in bytes
+	struct StateMachineMemoryUsage {
+	    int64 definition = 0;   // states, transitions, dispatch tables, instances
+	    int64 history = 0;      // history records and container
+	    int64 queue = 0;        // queued event names and container
+	    int64 strings = 0;      // heap storage behind definition ids and events
+	    int   callbacks = 0;    // bound callbacks; capture sizes are opaque
 	
-	    TransitionRecord(const String& f, const String& t, const String& e)
-	      : from(f), to(t), event(e) {}
+	    int64 GetTotal() const { return definition + history + queue + strings; }
+	
+	    StateMachineMemoryUsage& operator+=(const StateMachineMemoryUsage& b) {
+	        definition += b.definition;
+	        history += b.history;
+	        queue += b.queue;
+	        strings += b.strings;
+	        callbacks += b.callbacks;
+	        return *this;
+	    }
 	};
+
+	/// External event queue instrumentation; times are in microseconds
+	struct StateMachineQueueStats {
+	    /// Histogram bucket i counts values in [2^(i-1), 2^i); bucket 0 is zero,
+	    /// and the last bucket also takes everything larger.
+	    static constexpr int BUCKETS = 20;
+	
+	    int64 enqueued = 0;
+	    int64 dequeued = 0;
+	    int64 queue_full = 0;            // EventQueueFull rejections
+	    int64 dropped_oldest = 0;        // heads discarded by DropOldest
+	    int64 replaced = 0;              // events coalesced by ReplaceLatest
+	    int64 spilled = 0;               // events moved to the spill buffer
+	    int64 drain_limit_reached = 0;   // EventQueueDrainLimitReached stops
+	    int   depth_high_water = 0;
+	    int64 wait_high_water = 0;
+	    int64 wait_total = 0;
+	    int64 wait_histogram[BUCKETS] = {};
+	    int64 depth_histogram[BUCKETS] = {};
 	
+	    static int GetBucket(int64 value) {
+	        int bucket = 0;
+	        while (value > 0 && bucket < BUCKETS - 1) {
+	            value >>= 1;
+	            ++bucket;
+	        }
+	        return bucket;
+	    }
+	};
+
 	/// The main FSM class
 	class StateMachine {
 	public:
+	    /// Drops this machine's pins in a shared resource cache
+	    ~StateMachine();
+
 	    /// Set the initial state by its ID
 	    bool SetInitial(const String& id) {
 	        if (id.IsEmpty()) {
@@ -151,6 +237,28 @@ namespace Upp {
 	    /// Add a transition definition. Returns false for invalid or late additions.
 	    bool AddTransition(Transition t);
 
+	    /// Add a candidate for a (from, event) pair, new or existing. Candidates
+	    /// are tried in the order added and the first whose guard passes is
+	    /// taken, within one dispatch. An unguarded candidate is the default
+	    /// branch; adding anything after it fails with DuplicateTransition.
+	    bool AddChoice(Transition t);
+
+	    /// Number of candidates for (from, event): 0 if none, 1 for a plain transition
+	    int GetChoiceCount(const String& from, const String& event) const;
+
+	    /// Instantiate a shared sub-machine definition under id.
+	    /// Instance states are addressed as "id.local"; targeting "id" enters the
+	    /// definition's initial state, and transitions from "id" leave the
+	    /// instance from any of its states. The definition is shared, not copied:
+	    /// it must outlive this machine and stay unchanged once this one starts.
+	    bool AddSubMachine(const String& id, StateMachine& definition);
+
+	    /// Check whether a sub-machine instance exists.
+	    bool HasSubMachine(const String& id) const;
+
+	    /// Get the number of sub-machine instances.
+	    int GetSubMachineCount() const;
+
 	    /// Check whether a state exists.
 	    bool HasState(const String& id) const;
 
@@ -169,6 +277,9 @@ namespace Upp {
 	    /// Trigger a named event, causing a transition if defined
 	    bool TriggerEvent(const String& e);
 
+	    /// Trigger a named event using one slot claimed by ReserveQueueSlots()
+	    bool TriggerReservedEvent(const String& e);
+
 	    /// Attempt the given transition directly
 	    bool TryTransition(const Transition& t);
 
@@ -188,10 +299,73 @@ namespace Upp {
 	    void SetMaxQueuedEvents(int n);
 	    int GetMaxQueuedEvents() const { return max_queued_events; }
 
+	    /// Overflow handling for a full external queue, per machine and per event name
+	    void SetQueueOverflowPolicy(QueueOverflowPolicy policy) { overflow_policy = policy; ClearError(); }
+	    QueueOverflowPolicy GetQueueOverflowPolicy() const      { return overflow_policy; }
+	    void SetEventOverflowPolicy(const String& event, QueueOverflowPolicy policy);
+	    QueueOverflowPolicy GetEventOverflowPolicy(const String& event) const;
+
+	    /// Capacity of the spill buffer, drained only once the main queue is empty
+	    void SetMaxSpilledEvents(int n);
+	    int GetMaxSpilledEvents() const { return max_spilled_events; }
+	    int GetSpilledEventCount() const { return spilled_events.GetCount(); }
+
+	    /// Configure the internal (callback-raised) event capacity used by RunToCompletion.
+	    /// It also bounds how many internal events one external event may chain.
+	    void SetMaxInternalEvents(int n);
+	    int GetMaxInternalEvents() const { return max_internal_events; }
+
+	    /// Enqueue/dequeue counters, wait and depth histograms for the external queue
+	    const StateMachineQueueStats& GetQueueStats() const { return queue_stats; }
+	    void ResetQueueStats()                   { queue_stats = StateMachineQueueStats(); }
+
+	    /// Producer flow control: free external slots, all-or-nothing slot claims,
+	    /// and low/high watermarks as percentages of GetMaxQueuedEvents().
+	    int GetQueueCapacityLeft() const;
+	    bool ReserveQueueSlots(int n);
+	    void ReleaseQueueSlots(int n);
+	    int GetReservedQueueSlots() const { return reserved_slots; }
+	    void SetQueueWatermarks(int low_percent, int high_percent);
+
 	    /// Queue inspection and control for pending event names.
 	    int GetQueuedEventCount() const { return queued_events.GetCount(); }
-	    bool HasQueuedEvents() const { return !queued_events.IsEmpty(); }
-	    void ClearQueuedEvents() { queued_events.Clear(); ClearError(); }
+	    int GetInternalEventCount() const { return internal_events.GetCount(); }
+	    bool HasQueuedEvents() const { return !queued_events.IsEmpty() || !internal_events.IsEmpty() || !spilled_events.IsEmpty(); }
+	    void ClearQueuedEvents();
+
+	    /// Per-state dispatch cache counters for TriggerEvent() lookups
+	    int64 GetDispatchCacheHits() const       { return dispatch_cache_hits; }
+	    int64 GetDispatchCacheMisses() const     { return dispatch_cache_misses; }
+	    void ResetDispatchCacheStats()           { dispatch_cache_hits = dispatch_cache_misses = 0; }
+
+	    /// Memory breakdown; definition costs are cached once configuration is compiled
+	    StateMachineMemoryUsage GetMemoryUsage() const;
+
+	    /// Re-allocate the runtime queues, history and dispatch cache from the
+	    /// calling thread, so first touch puts them on its NUMA node. The
+	    /// object itself and the shared definition stay where they are.
+	    void Rehome();
+
+	    /// Cache for resources loaded by State::Load, keyed by state id. The
+	    /// machine has its own; SetResourceCache() shares one between
+	    /// machines before they start (nullptr returns to the own cache).
+	    StateResourceCache& GetResourceCache()   { return resource_cache ? *resource_cache : own_resources; }
+	    bool SetResourceCache(StateResourceCache* cache);
+
+	    /// A state's held resource, or nullptr if it is not held or not a T
+	    template <class T>
+	    T* GetResource(const String& state) {
+	        StateResource* r = GetResourceCache().Find(state);
+	        return r && r->data.Is<T>() ? &r->data.Get<T>() : nullptr;
+	    }
+
+	    /// The data block of the state being entered while its Load / OnEnter
+	    /// runs, else the current state's; nullptr if it has none or not a T
+	    template <class T>
+	    T* GetStateData() const                  { return state_data[data_entering ? data_slot ^ 1 : data_slot].Get<T>(); }
+
+	    /// True if Start() built the dense (state, event) dispatch table
+	    bool IsDispatchCompiled() const          { return !dispatch_dirty && !dispatch_table.IsEmpty(); }
 	
 	    /// Get current state ID
 	    String GetCurrent() const                { return current; }
@@ -205,6 +379,9 @@ namespace Upp {
 	    /// True if you can call GoBack()
 	    bool CanGoBack() const                   { return transitionHistory.GetCount() > 1; }
 
+	    /// Transitions committed since Start(), including GoBack()
+	    int64 GetCommitCount() const             { return commit_count; }
+
 	    /// Current error code from the last failing public call
 	    StateMachineError GetLastError() const    { return last_error; }
 
@@ -215,10 +392,27 @@ namespace Upp {
 	    void ClearError()                        { last_error = StateMachineError::None; }
 
 	    /// History inspection for tests and diagnostics
-	    int GetHistoryCount() const              { return transitionHistory.GetCount(); }
-	    String GetHistoryFrom(int i) const       { return (i >= 0 && i < transitionHistory.GetCount()) ? transitionHistory[i]->from : String(); }
-	    String GetHistoryTo(int i) const         { return (i >= 0 && i < transitionHistory.GetCount()) ? transitionHistory[i]->to : String(); }
-	    String GetHistoryEvent(int i) const      { return (i >= 0 && i < transitionHistory.GetCount()) ? transitionHistory[i]->event : String(); }
+	    int64 GetHistoryCount() const            { return transitionHistory.GetCount(); }
+	    String GetHistoryFrom(int64 i) const     { return (i >= 0 && i < transitionHistory.GetCount()) ? transitionHistory[i].from : String(); }
+	    String GetHistoryTo(int64 i) const       { return (i >= 0 && i < transitionHistory.GetCount()) ? transitionHistory[i].to : String(); }
+	    String GetHistoryEvent(int64 i) const    { return (i >= 0 && i < transitionHistory.GetCount()) ? transitionHistory[i].event : String(); }
+	    const TransitionHistory& GetHistory() const { return transitionHistory; }
+
+	    /// Keep at most n in-memory history records (at least 2), trimming the
+	    /// oldest in batches once 2n are held; 0 keeps everything
+	    void SetHistoryWindow(int n)             { history_window = n > 0 ? max(n, 2) : 0; }
+	    int GetHistoryWindow() const             { return history_window; }
+
+	    /// Append every commit, including Start() and GoBack(), to archive
+	    /// under the given machine name; nullptr stops. Archive errors stay
+	    /// on the archive and never fail a transition.
+	    void SetHistoryArchive(HistoryArchive* archive, const String& machine = String());
+	    HistoryArchive* GetHistoryArchive() const { return history_archive; }
+
+	    /// Store repeating cycles of history records as one run each. The
+	    /// accessors and GoBack() behave the same either way.
+	    void EnableHistoryCompression(bool b = true) { transitionHistory.EnableCompression(b); }
+	    bool IsHistoryCompressionEnabled() const { return transitionHistory.IsCompressionEnabled(); }
 	
 	    /// Revert to the previous state (if history allows)
 	    bool GoBack();
@@ -234,42 +428,159 @@ namespace Upp {
 	
 	    /// Called just after any transition completes
 	    Function<void(const TransitionContext&)> WhenTransitionFinished;
+
+	    /// Called when queued plus reserved slots rise to the high watermark
+	    Function<void()> WhenQueueHigh;
+
+	    /// Called when they fall back to the low watermark after WhenQueueHigh
+	    Function<void()> WhenQueueLow;
 	
 	    /// Dump history to LOG()
 	    void DumpHistory() const {
 	        LOG("StateMachine history:");
-	        for(int i = 0; i < transitionHistory.GetCount(); i++) {
-	            auto& rec = *transitionHistory[i];
+	        for(int64 i = 0; i < transitionHistory.GetCount(); i++) {
+	            const TransitionRecord& rec = transitionHistory[i];
 	            LOG(Format("  [%d] %s -> %s (%s)", i, rec.from, rec.to, rec.event));
 	        }
 	    }
 	
 	private:
+	    /// Last (event, transition) pair resolved from one state
+	    struct DispatchCache : Moveable<DispatchCache> {
+	        String            event;
+	        const Transition* transition = nullptr;
+	        int               to_index = -1;
+	    };
+
+	    /// External queue entry stamped at enqueue for wait-time accounting
+	    struct QueuedEvent : Moveable<QueuedEvent> {
+	        String event;
+	        int64  enqueued_at = 0;
+	        int64  seq = 0;       // main queue position; consecutive from head to tail
+	    };
+
+	    /// Parent transition leaving a sub-machine instance
+	    struct SubMachineExit : Moveable<SubMachineExit> {
+	        int transition = -1;
+	        int local = -1;       // -1 leaves from any instance state
+	    };
+
+	    /// Shared definition plus this instance's offset in the state index space
+	    struct SubMachineInstance : Moveable<SubMachineInstance> {
+	        String                 id;
+	        StateMachine*          definition = nullptr;
+	        int                    offset = 0;
+	        Vector<SubMachineExit> exits;
+	    };
+
+	    /// Largest dense dispatch table built by CompileDispatch(), in cells
+	    static constexpr int64 max_dispatch_cells = 1 << 20;
+
+	    bool               CheckTransition(const Transition& t);
+	    bool               SelectChoice(int from_index, const Transition*& t, int& to_index,
+	                                    TransitionContext& ctx) const;
+	    void               CompileDispatch();
+	    StateMachineMemoryUsage GetDefinitionUsage() const;
+	    const Transition*  FindCompiledTransition(int from_index, const String& ev) const;
+	    int                FindStateIndex(const String& id) const;
+	    int                FindSubMachine(const String& id) const;
+	    int                FindSubMachineAt(int index) const;
+	    const State*       GetStateAt(int index) const;
+	    String             GetStateIdAt(int index) const;
 	    const State*       FindState(const String& id) const;
+	    const Transition*  ResolveTransition(int from_index, const String& ev, int& to_index) const;
 	    const Transition*  FindTransition(const String& from, const String& ev) const;
 	
 	    bool DoTransition(const Transition& t,
 	                      bool record = true,
 	                      Function<void(bool)> on_done = {});
+	    bool RunTransition(const Transition& t,
+	                       int from_index,
+	                       int to_index,
+	                       bool record,
+	                       Function<void(bool)> on_done);
 	    bool QueueEvent(const String& e);
+	    bool QueueOverflowEvent(const String& e);
+	    void PushQueuedEvent(const String& e);
+	    void ClearQueue();
+	    void IndexQueuedLatest();
+	    String TakeQueuedEvent(BiVector<QueuedEvent>& queue);
+	    bool QueueInternalEvent(const String& e);
+	    void CheckQueueWatermarks();
 	    void DrainQueuedEvents();
 	
+	    bool AcquireResource(int index);
+	    void SettleResources(bool entered);
+	    void ReleaseResource(int& index);
+	    void EnterStateData(int index);
+	    void SettleStateData(bool entered);
+
 	    void Finalize(const TransitionContext& ctx, bool record);
+	    void NotifyCommit()                      { if (commit_hook) commit_hook(*this); }
+
+	    friend class EventRouter;
+	    friend class DefinitionImporter;
 	
 	    Vector< One<State> >            states;
+	    Index<String>                   state_ids;       // parallel to states
 	    Vector< One<Transition> >       transitions;
-	    Vector< One<TransitionRecord> > transitionHistory;
+	    VectorMap<const Transition*, Array<Transition>> choices;   // candidates after a pair's first
+	    TransitionHistory               transitionHistory;
+	    Vector<DispatchCache>           dispatch_cache;
+	    Vector<SubMachineInstance>      sub_machines;
+	    Index<String>                   dispatch_events;
+	    Vector<int>                     dispatch_table;
+	    bool                            dispatch_dirty = true;
+	    StateMachineMemoryUsage         definition_usage;
 
 	    String current;
+	    int    current_index = -1;
 	    String initial;
 	    bool   started = false;
 	    bool   transitioning = false;
 	    bool   logging = false;
 	    bool   processing_queue = false;
 	    EventPolicy event_policy = EventPolicy::RejectWhileTransitioning;
-	    Vector<String> queued_events;
+	    BiVector<QueuedEvent> queued_events;
+	    BiVector<QueuedEvent> spilled_events;
+	    VectorMap<String, int64> queued_latest;   // event -> seq of its newest main queue entry
+	    int64 queued_seq = 0;
+	    BiVector<String> internal_events;
+	    QueueOverflowPolicy overflow_policy = QueueOverflowPolicy::RejectNewest;
+	    VectorMap<String, QueueOverflowPolicy> event_overflow_policies;
 	    int max_queued_events = 64;
+	    int max_spilled_events = 1024;
+	    int max_internal_events = 16;
+	    int reserved_slots = 0;
+	    int queue_low_percent = 25;
+	    int queue_high_percent = 75;
+	    bool queue_high = false;
+	    int callback_depth = 0;
+	    StateMachineQueueStats queue_stats;
+	    int64 dispatch_cache_hits = 0;
+	    int64 dispatch_cache_misses = 0;
+	    int64 commit_count = 0;
+	    Function<void(StateMachine&)> commit_hook;   // EventRouter membership index
+	    /// EventRouter batched entry; true when it took over done
+	    Function<bool(StateMachine&, const String& state, Function<void(bool)>& done)> enter_hook;
+	    StateResourceCache  own_resources;
+	    StateResourceCache* resource_cache = nullptr;
+	    int resource_pinned = -1;     // state whose resource the machine holds
+	    int resource_entering = -1;   // target whose resource entry pinned
+	    StateDataSlot state_data[2];    // current state's at data_slot, entering one's at data_slot ^ 1
+	    int  data_slot = 0;
+	    bool data_entering = false;
+	    int history_window = 0;
+	    HistoryArchive* history_archive = nullptr;
+	    String archive_machine;
 	    StateMachineError last_error = StateMachineError::None;
 	};
 
+	template <class T>
+	T& TransitionContext::Data() const {
+	    T* data = machine.GetStateData<T>();
+	    ASSERT(data);
+	    return *data;
+	}
+
 } // namespace Upp
@@ -0,0 +1,138 @@
+/*
+    StateResourceCache implementation
+    =================================
+
+    Purpose
+    - Implements the LRU resource cache declared in
+      statemachine/stateresourcecache.h.
+
+    Intent
+    - Only held, unpinned entries are on the LRU list, so eviction never has
+      to skip a pinned one: Trim() takes the tail until the held size fits.
+*/
+#include "stateresourcecache.h"
+
+namespace Upp {
+
+void StateResourceCache::SetMaxSize(int64 bytes) {
+    max_size = max(bytes, (int64)0);
+    Trim();
+}
+
+bool StateResourceCache::Has(const String& key) const {
+    return Find(key);
+}
+
+StateResource* StateResourceCache::Find(const String& key) {
+    const int i = keys.Find(key);
+    return i >= 0 && entries[i].held ? &entries[i].resource : nullptr;
+}
+
+const StateResource* StateResourceCache::Find(const String& key) const {
+    const int i = keys.Find(key);
+    return i >= 0 && entries[i].held ? &entries[i].resource : nullptr;
+}
+
+StateResource* StateResourceCache::Acquire(const String& key) {
+    const int i = keys.Find(key);
+    if (i < 0 || !entries[i].held) {
+        ++misses;
+        return nullptr;
+    }
+    Entry& e = entries[i];
+    if (e.pins++ == 0)
+        Unlink(i);
+    ++hits;
+    return &e.resource;
+}
+
+StateResource& StateResourceCache::Add(const String& key, StateResource&& resource) {
+    const int i = keys.FindAdd(key);
+    if (i == entries.GetCount())
+        entries.Add();
+    Entry& e = entries[i];
+    if (e.held) {
+        // Loaded again while held, e.g. by a machine that missed first
+        size -= e.resource.size;
+        if (e.pins == 0)
+            Unlink(i);
+    }
+    else {
+        e.held = true;
+        ++count;
+    }
+    e.resource = pick(resource);
+    e.resource.size = max(e.resource.size, (int64)0);
+    ++e.pins;
+    size += e.resource.size;
+    Trim();
+    return e.resource;
+}
+
+void StateResourceCache::Release(const String& key) {
+    const int i = keys.Find(key);
+    if (i < 0 || !entries[i].held || entries[i].pins == 0)
+        return;
+    if (--entries[i].pins == 0) {
+        Link(i);
+        Trim();
+    }
+}
+
+bool StateResourceCache::Evict(const String& key) {
+    const int i = keys.Find(key);
+    if (i < 0 || !entries[i].held || entries[i].pins)
+        return false;
+    Drop(i);
+    return true;
+}
+
+void StateResourceCache::Purge() {
+    while (lru_tail >= 0)
+        Drop(lru_tail);
+}
+
+void StateResourceCache::Link(int i) {
+    Entry& e = entries[i];
+    e.prev = -1;
+    e.next = lru_head;
+    if (lru_head >= 0)
+        entries[lru_head].prev = i;
+    else
+        lru_tail = i;
+    lru_head = i;
+    ++lru_count;
+}
+
+void StateResourceCache::Unlink(int i) {
+    Entry& e = entries[i];
+    if (e.prev >= 0)
+        entries[e.prev].next = e.next;
+    else
+        lru_head = e.next;
+    if (e.next >= 0)
+        entries[e.next].prev = e.prev;
+    else
+        lru_tail = e.prev;
+    e.prev = e.next = -1;
+    --lru_count;
+}
+
+void StateResourceCache::Drop(int i) {
+    Unlink(i);
+    Entry& e = entries[i];
+    if (WhenEvict)
+        WhenEvict(keys[i], e.resource);
+    size -= e.resource.size;
+    --count;
+    ++evictions;
+    e.resource = StateResource();
+    e.held = false;
+}
+
+void StateResourceCache::Trim() {
+    while (size > max_size && lru_tail >= 0)
+        Drop(lru_tail);
+}
+
+}
@@ -0,0 +1,102 @@
+/*
+    StateResourceCache
+    ==================
+
+    Purpose
+    - Keeps the heavy resources a state loads on entry (model files, lookup
+      tables) after the state is left, so a quick return to it skips the
+      reload.
+
+    Intent
+    - One resource per key; StateMachine keys them by state id.
+    - A resource is pinned while a machine is in, or entering, its state.
+      Pinned resources are never evicted, even when they alone exceed the
+      budget.
+    - Each resource declares its size in bytes. Unpinned resources stay held
+      until the held total exceeds the budget, then the least recently used
+      ones go first.
+    - O(1) per acquire, add and release: a hash index over the keys plus an
+      intrusive LRU list of the unpinned entries. Keys are never removed, so
+      entry slots stay stable; the set of state ids is finite anyway.
+
+    Thread context
+    - No locking. Machines sharing one cache must run on one thread.
+*/
+
+#pragma once
+
+#include <Core/Core.h>
+
+namespace Upp {
+
+	/// A loaded resource and the bytes it is charged against the budget
+	struct StateResource : Moveable<StateResource> {
+	    Any   data;
+	    int64 size = 0;
+	};
+
+	class StateResourceCache {
+	public:
+	    /// Budget for held resources, in bytes; lowering it evicts at once.
+	    /// 0 (the default) keeps nothing past its state's exit.
+	    void  SetMaxSize(int64 bytes);
+	    int64 GetMaxSize() const                 { return max_size; }
+
+	    /// Bytes and resources held, pinned ones included
+	    int64 GetSize() const                    { return size; }
+	    int   GetCount() const                   { return count; }
+	    int   GetPinnedCount() const             { return count - lru_count; }
+
+	    bool  Has(const String& key) const;
+	    /// Look up without pinning or touching the LRU order
+	    StateResource*       Find(const String& key);
+	    const StateResource* Find(const String& key) const;
+
+	    /// Pin a held resource and count a hit; nullptr and a miss otherwise
+	    StateResource* Acquire(const String& key);
+	    /// Hold a freshly loaded resource, pinned, then evict down to the budget
+	    StateResource& Add(const String& key, StateResource&& resource);
+	    /// Drop one pin; the last one makes the resource most recently used
+	    void Release(const String& key);
+
+	    /// Drop an unpinned resource now, e.g. after its source file changed
+	    bool Evict(const String& key);
+	    /// Drop every unpinned resource
+	    void Purge();
+
+	    int64 GetHits() const                    { return hits; }
+	    int64 GetMisses() const                  { return misses; }
+	    int64 GetEvictions() const               { return evictions; }
+	    void  ResetStats()                       { hits = misses = evictions = 0; }
+
+	    /// Called before an evicted resource is destroyed
+	    Function<void(const String& key, StateResource& resource)> WhenEvict;
+
+	private:
+	    struct Entry : Moveable<Entry> {
+	        StateResource resource;
+	        int           pins = 0;
+	        int           prev = -1;      // LRU neighbours, unpinned entries only
+	        int           next = -1;
+	        bool          held = false;
+	    };
+
+	    void Link(int i);
+	    void Unlink(int i);
+	    void Drop(int i);
+	    void Trim();
+
+	    Index<String> keys;
+	    Vector<Entry> entries;            // parallel to keys
+	    int           lru_head = -1;      // most recently used
+	    int           lru_tail = -1;      // next eviction victim
+	    int           lru_count = 0;
+	    int           count = 0;
+	    int64         size = 0;
+	    int64         max_size = 0;
+	    int64         hits = 0;
+	    int64         misses = 0;
+	    int64         evictions = 0;
+	};
+
+}
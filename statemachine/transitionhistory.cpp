@@ -0,0 +1,121 @@
+/*
+    TransitionHistory implementation
+    ================================
+
+    Purpose
+    - Implements the run-length history declared in
+      statemachine/transitionhistory.h.
+
+    Intent
+    - Invariant: every run covers at least its pattern once (length >=
+      period), and a run with length == period is literal. Only the last run
+      may be literal and still grow; Add() either extends it, splits a cycle
+      off its tail, or starts a new run.
+*/
+#include "transitionhistory.h"
+
+namespace Upp {
+
+void TransitionHistory::Add(const String& from, const String& to, const String& event) {
+    TransitionRecord rec(from, to, event);
+    ++count;
+    if (!runs.IsEmpty()) {
+        Run& r = runs.Top();
+        if (r.length == r.period) {
+            if (compress) {
+                // Does rec close a cycle with the last p records?
+                const int tail = records.GetCount();
+                for (int p = 1; p <= min(r.period, MAX_CYCLE); ++p) {
+                    if (!(records[tail - p] == rec))
+                        continue;
+                    if (p == r.period) {
+                        ++r.length;
+                        return;
+                    }
+                    r.period -= p;
+                    r.length -= p;
+                    Run c;
+                    c.first = tail - p;
+                    c.period = p;
+                    c.start = r.start + r.length;
+                    c.length = p + 1;
+                    runs.Add(c);
+                    return;
+                }
+            }
+            records.Add(pick(rec));
+            ++r.period;
+            ++r.length;
+            return;
+        }
+        if (compress && records[r.first + int(r.length % r.period)] == rec) {
+            ++r.length;
+            return;
+        }
+    }
+    Run n;
+    n.first = records.GetCount();
+    n.period = n.length = 1;
+    n.start = count - 1;
+    runs.Add(n);
+    records.Add(pick(rec));
+}
+
+void TransitionHistory::Drop() {
+    if (runs.IsEmpty())
+        return;
+    Run& r = runs.Top();
+    --count;
+    if (--r.length < r.period) {
+        // Back inside the pattern: its last record is no longer covered
+        records.Drop();
+        r.period = int(r.length);
+    }
+    if (r.length == 0)
+        runs.Drop();
+}
+
+void TransitionHistory::KeepLast(int64 n) {
+    if (n >= count)
+        return;
+    TransitionHistory kept;
+    kept.compress = compress;
+    for (int64 i = max(count - n, (int64)0); i < count; ++i) {
+        const TransitionRecord& r = (*this)[i];
+        kept.Add(r.from, r.to, r.event);
+    }
+    *this = pick(kept);
+}
+
+void TransitionHistory::Clear() {
+    records.Clear();
+    runs.Clear();
+    count = 0;
+}
+
+const TransitionRecord& TransitionHistory::operator[](int64 i) const {
+    ASSERT(i >= 0 && i < count);
+    int lo = 0;
+    int hi = runs.GetCount() - 1;
+    if (runs[hi].start <= i)
+        return At(runs[hi], i);    // reads mostly land near the top
+    while (lo < hi) {
+        const int mid = (lo + hi + 1) / 2;
+        if (runs[mid].start <= i)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return At(runs[lo], i);
+}
+
+const TransitionRecord& TransitionHistory::Top() const {
+    ASSERT(count > 0);
+    return At(runs.Top(), count - 1);
+}
+
+int64 TransitionHistory::GetMemoryUsage() const {
+    return int64(records.GetAlloc()) * sizeof(TransitionRecord) + int64(runs.GetAlloc()) * sizeof(Run);
+}
+
+}
@@ -0,0 +1,93 @@
+/*
+    TransitionHistory
+    =================
+
+    Purpose
+    - The history stack behind StateMachine's history accessors and
+      GoBack(), with optional run-length compression of repeating cycles.
+
+    Intent
+    - Records are stored as runs. A run has a pattern of one or more records,
+      repeated for its length, so an IDLE -> POLL -> IDLE loop of any
+      duration is one run holding two records. Positions and run lengths
+      are 64-bit, so a compressed loop can outlive 2^31 records.
+    - Without compression every run is literal: each pattern record appears
+      once. With it, an added record that repeats the record 1 to
+      MAX_CYCLE places back turns the tail of the literal run into a
+      repeating run. Later records that follow the cycle only bump its
+      length.
+    - Records are never expanded. Index access finds the run by binary
+      search, and Top() / Drop() only touch the last run, so GoBack() and the
+      accessors keep their exact semantics.
+    - Patterns are stored back to back in run order. The last run's pattern
+      is always at the tail of that pool, so it can grow and shrink in place.
+
+    Thread context
+    - Same as StateMachine.
+*/
+
+#pragma once
+
+#include <Core/Core.h>
+
+namespace Upp {
+
+	/// Record of a completed transition (for history)
+	struct TransitionRecord : Moveable<TransitionRecord> {
+	    String from;
+	    String to;
+	    String event;
+
+	    TransitionRecord(const String& f, const String& t, const String& e)
+	      : from(f), to(t), event(e) {}
+
+	    bool operator==(const TransitionRecord& b) const { return from == b.from && to == b.to && event == b.event; }
+	};
+
+	class TransitionHistory {
+	public:
+	    /// Longest cycle, in records, that compression detects
+	    static constexpr int MAX_CYCLE = 8;
+
+	    /// Affects records added from now on; existing runs stay as they are
+	    void EnableCompression(bool b = true)    { compress = b; }
+	    bool IsCompressionEnabled() const        { return compress; }
+
+	    int64 GetCount() const                   { return count; }
+	    bool  IsEmpty() const                    { return count == 0; }
+	    /// Runs, and records actually stored: GetCount() without compression
+	    int   GetRunCount() const                { return runs.GetCount(); }
+	    int   GetStoredCount() const             { return records.GetCount(); }
+
+	    void Add(const String& from, const String& to, const String& event);
+	    /// Remove the newest record
+	    void Drop();
+	    /// Keep only the newest n records, re-running compression over them
+	    void KeepLast(int64 n);
+	    void Clear();
+	    /// Re-allocate the storage from the calling thread, keeping the records
+	    void Rehome()                            { records = clone(records); runs = clone(runs); }
+
+	    const TransitionRecord& operator[](int64 i) const;
+	    const TransitionRecord& Top() const;
+
+	    /// Bytes held by runs and records; strings are shared with the definition
+	    int64 GetMemoryUsage() const;
+
+	private:
+	    struct Run : Moveable<Run> {
+	        int   first = 0;   // pattern start in records
+	        int   period = 0;  // pattern length; equals length while literal
+	        int64 start = 0;   // index of the run's first record
+	        int64 length = 0;  // records covered
+	    };
+
+	    const TransitionRecord& At(const Run& r, int64 i) const { return records[r.first + int((i - r.start) % r.period)]; }
+
+	    Vector<TransitionRecord> records;
+	    Vector<Run>              runs;
+	    int64                    count = 0;
+	    bool                     compress = false;
+	};
+
+}
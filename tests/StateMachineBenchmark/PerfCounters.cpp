@@ -0,0 +1,108 @@
+#include "PerfCounters.h"
+
+#ifdef PLATFORM_LINUX
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Upp {
+
+PerfCounters::PerfCounters()
+{
+    for(int i = 0; i < COUNT; i++) {
+        fd[i] = -1;
+        value[i] = -1;
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    Close();
+}
+
+const char* PerfCounters::GetName(Kind k)
+{
+    switch(k) {
+    case CYCLES: return "cycles";
+    case INSTRUCTIONS: return "instructions";
+    case CACHE_MISSES: return "cache-misses";
+    case BRANCH_MISSES: return "branch-misses";
+    default: break;
+    }
+    return "?";
+}
+
+bool PerfCounters::Open()
+{
+    Close();
+#ifdef PLATFORM_LINUX
+    static const uint64 config[COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for(int i = 0; i < COUNT; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+    return IsAvailable();
+}
+
+void PerfCounters::Close()
+{
+    for(int i = 0; i < COUNT; i++) {
+#ifdef PLATFORM_LINUX
+        if(fd[i] >= 0)
+            close(fd[i]);
+#endif
+        fd[i] = -1;
+        value[i] = -1;
+    }
+}
+
+bool PerfCounters::IsAvailable() const
+{
+    for(int i = 0; i < COUNT; i++)
+        if(fd[i] >= 0)
+            return true;
+    return false;
+}
+
+void PerfCounters::Start()
+{
+#ifdef PLATFORM_LINUX
+    for(int i = 0; i < COUNT; i++)
+        if(fd[i] >= 0) {
+            ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+}
+
+void PerfCounters::Stop()
+{
+    for(int i = 0; i < COUNT; i++) {
+        value[i] = -1;
+#ifdef PLATFORM_LINUX
+        if(fd[i] < 0)
+            continue;
+        ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64 v = 0;
+        if(read(fd[i], &v, sizeof(v)) == sizeof(v))
+            value[i] = (int64)v;
+#endif
+    }
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef _StateMachineBenchmark_PerfCounters_h_
+#define _StateMachineBenchmark_PerfCounters_h_
+
+/*
+    Apache License 2.0
+
+    PerfCounters
+    ============
+
+    Purpose
+    - Optional Linux perf_event_open() counters around benchmark loops.
+
+    Intent
+    - Report cycles, instructions, cache misses, and branch misses next to the
+      wall-clock numbers.
+    - Degrade quietly: counters that cannot be opened (non-Linux builds,
+      containers, perf_event_paranoid) are reported as unavailable.
+*/
+
+#include <Core/Core.h>
+
+namespace Upp {
+
+class PerfCounters {
+public:
+    enum Kind { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, COUNT };
+
+    PerfCounters();
+    ~PerfCounters();
+
+    /// Try to open every counter for the calling thread; true if any opened.
+    bool Open();
+    void Close();
+
+    bool IsAvailable() const;
+    bool IsAvailable(Kind k) const      { return fd[k] >= 0; }
+
+    void Start();
+    void Stop();
+
+    /// Counter value from the last Start()/Stop() window, or -1 if unavailable
+    int64 Get(Kind k) const              { return value[k]; }
+
+    static const char* GetName(Kind k);
+
+private:
+    int   fd[COUNT];
+    int64 value[COUNT];
+};
+
+}
+
+#endif
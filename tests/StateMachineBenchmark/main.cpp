@@ -0,0 +1,492 @@
+/*
+    Author
+    - C Edwards (dodobar)
+
+    License
+    - Apache License 2.0, matching this repository's LICENSE file.
+
+    StateMachineBenchmark
+    =====================
+
+    Purpose
+    - Console micro-benchmarks for the StateMachine core hot paths.
+
+    Intent
+    - Time TriggerEvent() dispatch, including guarded choices, queued-event
+      draining, machine construction, routing with batched entry,
+      OpenMetrics rendering, and shared-view publishing and sampling with
+      deterministic, pasteable output.
+    - Optionally read Linux hardware counters around each loop so lookup
+      changes can be judged by cycles and misses, not only wall clock.
+
+    Thread context
+    - Console process, single thread, except --numa, which builds and drives
+      a pool from pinned helper threads.
+
+    Usage
+    - StateMachineBenchmark [--perf] [--iterations N] [--numa]
+    - --perf reports per-operation hardware counters when perf_event_open() is
+      permitted; otherwise the counters are reported as unavailable.
+    - --numa compares routed dispatch on a pool built on the driving thread's
+      NUMA node against one built on a remote node. Hardware counters do not
+      follow the helper threads, so --perf does not apply to it.
+*/
+
+#include <Core/Core.h>
+#include <statemachine/statemachine.h>
+#include <statemachine/eventrouter.h>
+#include <statemachine/numatopology.h>
+#include <statemachine/openmetrics.h>
+#include <statemachine/sharedstateview.h>
+#include <statemachine/definitionimporter.h>
+#include <statemachine/historyarchive.h>
+
+#include "PerfCounters.h"
+
+using namespace Upp;
+
+struct BenchConfig {
+    bool perf = false;
+    bool numa = false;
+    int  iterations = 200000;
+};
+
+static PerfCounters counters;
+
+template <class Fn>
+static void RunBench(const BenchConfig& cfg, const char* name, Fn fn)
+{
+    if(cfg.perf)
+        counters.Start();
+    int64 t0 = usecs();
+    int64 ops = fn();
+    int64 elapsed = usecs() - t0;
+    if(cfg.perf)
+        counters.Stop();
+
+    if(ops <= 0)
+        ops = 1;
+    Cout() << Format("%-14s %10d ops %10.1f ns/op", name, (int)ops, 1000.0 * elapsed / ops);
+    if(cfg.perf) {
+        for(int i = 0; i < PerfCounters::COUNT; i++) {
+            PerfCounters::Kind k = (PerfCounters::Kind)i;
+            Cout() << "  " << PerfCounters::GetName(k) << "=";
+            if(counters.Get(k) >= 0)
+                Cout() << Format("%.2f", double(counters.Get(k)) / ops);
+            else
+                Cout() << "n/a";
+        }
+    }
+    Cout() << "\n";
+}
+
+static int64 BenchTriggerEvent(int iterations, bool compressed, HistoryArchive* archive = nullptr)
+{
+    StateMachine sm;
+    sm.EnableHistoryCompression(compressed);
+    if(archive) {
+        sm.SetHistoryArchive(archive, "bench");
+        sm.SetHistoryWindow(1024);
+    }
+    sm.SetInitial("A");
+    sm.AddState({"A", {}, {}});
+    sm.AddState({"B", {}, {}});
+    sm.AddTransition({"go", "A", "B"});
+    sm.AddTransition({"back", "B", "A"});
+    sm.Start();
+
+    int64 ops = 0;
+    for(int i = 0; i < iterations / 2; i++) {
+        ops += sm.TriggerEvent("go");
+        ops += sm.TriggerEvent("back");
+    }
+    return ops;
+}
+
+// Same go/back loop, but B loads a 1 MB table that the cache keeps held
+static int64 BenchResourceCycle(int iterations)
+{
+    StateMachine sm;
+    sm.GetResourceCache().SetMaxSize(1 << 20);
+    sm.SetInitial("A");
+    sm.AddState({"A", {}, {}});
+    State b{"B", {}, {}};
+    b.Load = [](StateMachine&, StateResource& out) {
+        out.data.Create<Vector<byte>>().SetCount(1 << 20);
+        out.size = 1 << 20;
+        return true;
+    };
+    sm.AddState(pick(b));
+    sm.AddTransition({"go", "A", "B"});
+    sm.AddTransition({"back", "B", "A"});
+    sm.Start();
+
+    int64 ops = 0;
+    for(int i = 0; i < iterations / 2; i++) {
+        ops += sm.TriggerEvent("go");
+        ops += sm.TriggerEvent("back");
+    }
+    return ops;
+}
+
+// Same go/back loop; B keeps an inline data block that its guard updates
+static int64 BenchStateDataCycle(int iterations)
+{
+    struct Attempts { int count = 0; };
+    StateMachine sm;
+    sm.SetInitial("A");
+    sm.AddState({"A", {}, {}});
+    State b{"B", {}, {}};
+    b.data = StateDataType::Of<Attempts>();
+    sm.AddState(pick(b));
+    sm.AddTransition({"go", "A", "B"});
+    Transition back{"back", "B", "A"};
+    back.Guard = [](const TransitionContext& ctx) { return ++ctx.Data<Attempts>().count > 0; };
+    sm.AddTransition(pick(back));
+    sm.Start();
+
+    int64 ops = 0;
+    for(int i = 0; i < iterations / 2; i++) {
+        ops += sm.TriggerEvent("go");
+        ops += sm.TriggerEvent("back");
+    }
+    return ops;
+}
+
+// Same go/back loop, but "go" takes the default after a rejecting guard
+static int64 BenchChoice(int iterations)
+{
+    StateMachine sm;
+    sm.SetInitial("A");
+    sm.AddState({"A", {}, {}});
+    sm.AddState({"B", {}, {}});
+    sm.AddState({"C", {}, {}});
+    Transition rejected;
+    rejected.event = "go";
+    rejected.from = "A";
+    rejected.to = "C";
+    rejected.Guard = [](const TransitionContext&) { return false; };
+    sm.AddChoice(rejected);
+    sm.AddChoice({"go", "A", "B"});
+    sm.AddTransition({"back", "B", "A"});
+    sm.Start();
+
+    int64 ops = 0;
+    for(int i = 0; i < iterations / 2; i++) {
+        ops += sm.TriggerEvent("go");
+        ops += sm.TriggerEvent("back");
+    }
+    return ops;
+}
+
+static int64 BenchQueueDrain(int iterations)
+{
+    const int batch = 64;
+    bool hold = false;
+    Function<void(bool)> finish_exit;
+
+    StateMachine sm;
+    sm.SetInitial("A");
+    sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+    sm.SetMaxQueuedEvents(batch);
+    sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) {
+        if(hold)
+            finish_exit = pick(done);
+        else
+            done(true);
+    }});
+    sm.AddState({"B", {}, {}});
+    sm.AddTransition({"go", "A", "B"});
+    sm.AddTransition({"back", "B", "A"});
+    sm.Start();
+
+    int64 ops = 0;
+    for(int round = 0; round < iterations / batch; round++) {
+        hold = true;
+        sm.TriggerEvent("go");
+        hold = false;
+        for(int i = 0; i < batch; i++)
+            sm.TriggerEvent(i & 1 ? "go" : "back");
+        finish_exit(true);
+        ops += batch - sm.GetQueuedEventCount();
+        sm.TriggerEvent("back");
+    }
+    return ops;
+}
+
+static int64 BenchConstruction(int iterations)
+{
+    const int state_count = 64;
+    Vector<String> ids;
+    for(int i = 0; i < state_count; i++)
+        ids.Add(Format("S%d", i));
+
+    int64 ops = 0;
+    for(int round = 0; round < iterations / state_count; round++) {
+        StateMachine sm;
+        sm.SetInitial(ids[0]);
+        for(int i = 0; i < state_count; i++)
+            sm.AddState({ids[i], {}, {}});
+        for(int i = 0; i < state_count; i++)
+            sm.AddTransition({"next", ids[i], ids[(i + 1) % state_count]});
+        ops += sm.Start();
+    }
+    return ops;
+}
+
+// A pool of 10k single-state instances, one distinct state each
+static void OpenMetricsPool(EventRouter& router)
+{
+    router.WhenCreate = [](StateMachine& sm, const String& key) {
+        sm.SetInitial(key);
+        sm.AddState({key, {}, {}});
+        sm.AddTransition({"self", key, key});
+    };
+    for(int i = 0; i < 10000; i++)
+        router.Route(Format("state%d", i), "self");
+}
+
+// Render the pool's metrics; one op per render
+static int64 BenchOpenMetrics(const EventRouter& router, int iterations)
+{
+    OpenMetricsExporter exporter;
+    exporter.AddRouter("pool", router);
+    int64 renders = max(1, iterations / 2000);
+    for(int i = 0; i < renders; i++)
+        exporter.Render();
+    return renders;
+}
+
+// Route go/back over 4096 keys, optionally mirrored into a shared view
+static int64 BenchRoute(int iterations, bool shared)
+{
+    const int key_count = 4096;
+    Vector<String> keys;
+    for(int i = 0; i < key_count; i++)
+        keys.Add(Format("key%d", i));
+
+    EventRouter router;
+    router.WhenCreate = [](StateMachine& sm, const String&) {
+        sm.SetInitial("A");
+        sm.AddState({"A", {}, {}});
+        sm.AddState({"B", {}, {}});
+        sm.AddTransition({"go", "A", "B"});
+        sm.AddTransition({"back", "B", "A"});
+    };
+    SharedStateView view;
+    if(shared && view.Create(Format("/statemachine_bench_%d", int(usecs() % 1000000)), key_count, 4, 16))
+        router.SetSharedView(&view);
+
+    int64 ops = 0;
+    for(int i = 0; i < iterations; i++)
+        ops += router.Route(keys[i % key_count], (i / key_count) & 1 ? "back" : "go");
+    return ops;
+}
+
+// Route go/back with entries into B handed out 256 at a time
+static int64 BenchEnterBatch(int iterations)
+{
+    const int key_count = 4096;
+    Vector<String> keys;
+    for(int i = 0; i < key_count; i++)
+        keys.Add(Format("key%d", i));
+
+    EventRouter router;
+    router.WhenCreate = [](StateMachine& sm, const String&) {
+        sm.SetInitial("A");
+        sm.AddState({"A", {}, {}});
+        sm.AddState({"B", {}, {}});
+        sm.AddTransition({"go", "A", "B"});
+        sm.AddTransition({"back", "B", "A"});
+    };
+    router.SetEnterBatch("B", [](const String&, const Vector<int>& instances, Function<void(int, bool)> done) {
+        for(int i = 0; i < instances.GetCount(); i++)
+            done(i, true);
+    }, 256, 1000000);
+
+    int64 ops = 0;
+    for(int i = 0; i < iterations; i++)
+        ops += router.Route(keys[i % key_count], (i / key_count) & 1 ? "back" : "go");
+    router.FlushEnterBatches();
+    return ops;
+}
+
+// Sample one million published instances, as a sidecar would
+static int64 BenchSharedViewSample(int iterations)
+{
+    const int instance_count = 1000000;
+    SharedStateView view;
+    if(!view.Create(Format("/statemachine_bench_%d", int(usecs() % 1000000)), instance_count, 4))
+        return 0;
+    view.SetStateId(0, "A");
+    for(int i = 0; i < instance_count; i++)
+        view.SetInstance(i, 0, i);
+    view.SetInstanceCount(instance_count);
+
+    Vector<SharedInstanceSample> sample;
+    int64 ops = 0;
+    for(int i = 0; i < max(1, iterations / 20000); i++)
+        ops += view.ReadInstances(0, instance_count, sample);
+    return ops;
+}
+
+// One-machine range queries over 1M records from 1000 machines, filled
+// beforehand; each query window holds about ten of that machine's records
+static int64 BenchArchiveQuery(HistoryArchive& archive, int64 first, int64 span, int iterations)
+{
+    const int machine_count = 1000;
+    Vector<ArchivedTransition> out;
+    int64 ops = 0;
+    for(int i = 0; i < max(1, iterations / 10); i++) {
+        out.Clear();
+        const int64 begin = first + (int64(i) * 7919) % span;
+        if(archive.Query(Format("m%d", i % machine_count), begin, begin + 10 * machine_count, out) >= 0)
+            ops++;
+    }
+    return ops;
+}
+
+// 10k states with ten outgoing events each, as a modelling tool would export
+static String ImportDefinition()
+{
+    const int state_count = 10000;
+    String json = "{\"initial\": \"S0\",\n\"states\": [";
+    for(int i = 0; i < state_count; i++)
+        json << (i ? ", " : "") << "{\"id\": \"S" << i << "\", \"onEnter\": \"enter\"}";
+    json << "],\n\"transitions\": [\n";
+    for(int i = 0; i < state_count; i++)
+        for(int e = 0; e < 10; e++)
+            json << (i || e ? ",\n" : "") << "{\"event\": \"e" << e << "\", \"from\": \"S" << i
+                 << "\", \"to\": \"S" << (i + e + 1) % state_count << "\", \"guard\": \"allow\"}";
+    json << "]}\n";
+    return json;
+}
+
+// Load and bind the 100k-transition definition; one op per transition
+static int64 BenchImport(const String& json, int iterations)
+{
+    CallbackRegistry registry;
+    registry.AddStateCallback("enter", [](StateMachine&, Function<void(bool)> done) { done(true); });
+    registry.AddGuard("allow", [](const TransitionContext&) { return true; });
+
+    int64 ops = 0;
+    for(int i = 0; i < max(1, iterations / 2000000); i++) {
+        StateMachine sm;
+        DefinitionImporter importer;
+        if(importer.LoadJson(sm, json) && importer.Bind(sm, registry))
+            ops += sm.GetTransitionCount();
+    }
+    return ops;
+}
+
+// Build a keyed pool from a thread pinned to build_cpu, then time routed
+// events from a thread pinned to run_cpu. First-touch puts the pool's memory
+// on build_cpu's node.
+static double BenchPlacement(int build_cpu, int run_cpu, int iterations)
+{
+    const int key_count = 4096;
+    Vector<String> keys;
+    for(int i = 0; i < key_count; i++)
+        keys.Add(Format("key%d", i));
+
+    EventRouter router;
+    router.WhenCreate = [](StateMachine& sm, const String&) {
+        sm.SetInitial("A");
+        sm.AddState({"A", {}, {}});
+        sm.AddState({"B", {}, {}});
+        sm.AddTransition({"go", "A", "B"});
+        sm.AddTransition({"back", "B", "A"});
+    };
+
+    Thread build;
+    build.Run([&] {
+        NumaTopology::PinCurrentThread(build_cpu);
+        for(const String& key : keys)
+            router.Route(key, "go");
+    });
+    build.Wait();
+
+    int64 ops = 0;
+    int64 elapsed = 0;
+    Thread run;
+    run.Run([&] {
+        NumaTopology::PinCurrentThread(run_cpu);
+        int64 t0 = usecs();
+        for(int i = 0; i < iterations; i++)
+            ops += router.Route(keys[i % key_count], (i / key_count) & 1 ? "go" : "back");
+        elapsed = usecs() - t0;
+    });
+    run.Wait();
+    return 1000.0 * elapsed / max(ops, (int64)1);
+}
+
+static void RunNumaBench(const BenchConfig& cfg)
+{
+    NumaTopology topology;
+    bool from_sys = topology.Load();
+    Cout() << "NUMA nodes=" << topology.GetNodeCount() << (from_sys ? "" : " (fallback)") << "\n";
+
+    int local = topology.GetCpus(0)[0];
+    Cout() << Format("%-14s %10.1f ns/op\n", "NumaLocal", BenchPlacement(local, local, cfg.iterations));
+    if(topology.GetNodeCount() < 2) {
+        Cout() << Format("%-14s %10s (single NUMA node)\n", "NumaRemote", "n/a");
+        return;
+    }
+    int remote = topology.GetCpus(1)[0];
+    Cout() << Format("%-14s %10.1f ns/op\n", "NumaRemote", BenchPlacement(remote, local, cfg.iterations));
+}
+
+CONSOLE_APP_MAIN
+{
+    BenchConfig cfg;
+    const Vector<String>& args = CommandLine();
+    for(int i = 0; i < args.GetCount(); i++) {
+        if(args[i] == "--perf")
+            cfg.perf = true;
+        else if(args[i] == "--numa")
+            cfg.numa = true;
+        else if(args[i] == "--iterations" && i + 1 < args.GetCount())
+            cfg.iterations = max(1, atoi(args[++i]));
+    }
+
+    if(cfg.perf && !counters.Open()) {
+        Cout() << "perf_event_open() unavailable; hardware counters disabled\n";
+        cfg.perf = false;
+    }
+
+    Cout() << "StateMachineBenchmark iterations=" << cfg.iterations << "\n";
+    RunBench(cfg, "TriggerEvent", [&] { return BenchTriggerEvent(cfg.iterations, false); });
+    RunBench(cfg, "TriggerRLE", [&] { return BenchTriggerEvent(cfg.iterations, true); });
+    RunBench(cfg, "Choice", [&] { return BenchChoice(cfg.iterations); });
+    RunBench(cfg, "ResourceCycle", [&] { return BenchResourceCycle(cfg.iterations); });
+    RunBench(cfg, "StateDataCycle", [&] { return BenchStateDataCycle(cfg.iterations); });
+    RunBench(cfg, "QueueDrain", [&] { return BenchQueueDrain(cfg.iterations); });
+    RunBench(cfg, "Construction", [&] { return BenchConstruction(cfg.iterations); });
+    EventRouter metrics_pool;
+    OpenMetricsPool(metrics_pool);
+    RunBench(cfg, "OpenMetrics10k", [&] { return BenchOpenMetrics(metrics_pool, cfg.iterations); });
+    RunBench(cfg, "Route", [&] { return BenchRoute(cfg.iterations, false); });
+    RunBench(cfg, "RouteShared", [&] { return BenchRoute(cfg.iterations, true); });
+    RunBench(cfg, "RouteBatched", [&] { return BenchEnterBatch(cfg.iterations); });
+    RunBench(cfg, "SharedRead1M", [&] { return BenchSharedViewSample(cfg.iterations); });
+    String import_json = ImportDefinition();
+    RunBench(cfg, "Import100k", [&] { return BenchImport(import_json, cfg.iterations); });
+
+    // A virtual clock, so each record is one tick and query windows are exact
+    String archive_dir = GetTempFileName("statemachine_bench");
+    HistoryArchive archive;
+    int64 tick = 0;
+    archive.SetClock([&] { return ++tick; });
+    if(archive.Open(archive_dir)) {
+        RunBench(cfg, "TriggerArchive", [&] { return BenchTriggerEvent(cfg.iterations, false, &archive); });
+        const int64 first = tick;
+        for(int i = 0; i < 1000000; i++)
+            archive.Add(Format("m%d", i % 1000), "Idle", "Poll", "poll");
+        RunBench(cfg, "ArchiveQuery", [&] { return BenchArchiveQuery(archive, first, tick - first, cfg.iterations); });
+        archive.Close();
+    }
+    DeleteFolderDeep(archive_dir);
+
+    if(cfg.numa)
+        RunNumaBench(cfg);
+}
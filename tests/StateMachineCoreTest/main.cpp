@@ -26,7 +26,8 @@
 
     Usage
     - Build/run with the U++ toolchain and assembly recorded for this repository.
-    - Expected v1.0.1 release baseline: StateMachineCoreTest passes 190/190.
+    - Expected result: every test passes and the summary prints
+      ALL TESTS PASSED with the current count (190 at the v1.0.1 release).
 
     Changelog
     - 2026-06: hardened for v1.0.1 with invariant checks, seeded sequence tests,
@@ -35,6 +36,12 @@
 
 #include <Core/Core.h>
 #include <statemachine/statemachine.h>
+#include <statemachine/shardedrouter.h>
+#include <statemachine/openmetrics.h>
+#include <statemachine/sharedstateview.h>
+#include <statemachine/definitionimporter.h>
+#include <statemachine/historyarchive.h>
+#include <tests/StateMachineFuzz/FuzzTargets.h>
 
 using namespace Upp;
 
@@ -294,6 +301,15 @@ void RunGroup(const String& name, int& passed, int& failed, Fn fn) {
     });
 }
 
+/// State data block that counts live instances
+struct TrackedData {
+    static int live;
+    int tries = 0;
+    TrackedData()  { ++live; }
+    ~TrackedData() { --live; }
+};
+int TrackedData::live = 0;
+
 CONSOLE_APP_MAIN
 {
     StdLogSetup(LOG_COUT);
@@ -4655,6 +4671,2452 @@ CONSOLE_APP_MAIN
         });
     });
 
+    RunGroup("Dispatch cache", passed, failed, [&](auto add) {
+        add("Repeated events hit the per-state dispatch cache", [](TestContext& ctx) {
+            StateMachine sm;
+            bool ok = true;
+
+            sm.SetInitial("A");
+            sm.AddState({"A", [](auto&, auto done) { done(true); }, {}});
+            sm.AddState({"B", [](auto&, auto done) { done(true); }, {}});
+            sm.AddTransition({"to_b", "A", "B"});
+            sm.AddTransition({"to_a", "B", "A"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            for (int i = 0; i < 100; ++i) {
+                ok &= sm.TriggerEvent("to_b");
+                ok &= sm.GetCurrent() == "B";
+                ok &= sm.TriggerEvent("to_a");
+                ok &= sm.GetCurrent() == "A";
+            }
+
+            ctx.Check(ok, "Cached dispatch should keep alternating between A and B");
+            ctx.Check(sm.GetDispatchCacheMisses() == 2, "Only the first event per state should miss the cache");
+            ctx.Check(sm.GetDispatchCacheHits() == 198, "Every later event should hit the cache");
+            ctx.Check(sm.GetHistoryCount() == 201, "Cached dispatch should still record history");
+        });
+
+        add("Different event in the same state replaces the cache entry", [](TestContext& ctx) {
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", {}, {}});
+            sm.AddState({"C", {}, {}});
+            sm.AddTransition({"to_b", "A", "B"});
+            sm.AddTransition({"to_c", "A", "C"});
+            sm.AddTransition({"back", "B", "A"});
+            sm.AddTransition({"back", "C", "A"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("to_b") && sm.GetCurrent() == "B", "to_b should reach B");
+            ctx.Check(sm.TriggerEvent("back") && sm.GetCurrent() == "A", "back should return to A");
+            ctx.Check(sm.TriggerEvent("to_c") && sm.GetCurrent() == "C", "to_c should reach C, not the cached B");
+            ctx.Check(sm.TriggerEvent("back") && sm.GetCurrent() == "A", "back should return to A from C");
+            ctx.Check(sm.TriggerEvent("to_c") && sm.GetCurrent() == "C", "to_c should reach C again");
+            ctx.Check(sm.GetDispatchCacheMisses() == 4, "Each new state/event pair should miss once");
+            ctx.Check(sm.GetDispatchCacheHits() == 1, "Repeated to_c from A should hit");
+        });
+
+        add("Unmatched events are not cached", [](TestContext& ctx) {
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(!sm.TriggerEvent("missing"), "Unknown event should fail");
+            ctx.Check(sm.GetLastError() == StateMachineError::NoMatchingTransition, "Unknown event should report NoMatchingTransition");
+            ctx.Check(!sm.TriggerEvent("missing"), "Unknown event should fail again");
+            ctx.Check(sm.GetDispatchCacheMisses() == 2, "Unknown events should always take the full lookup");
+            ctx.Check(sm.GetDispatchCacheHits() == 0, "Unknown events should never hit");
+            ctx.Check(sm.TriggerEvent("go"), "Known event should still dispatch");
+            ctx.Check(sm.GetCurrent() == "B", "Known event should reach B");
+        });
+
+        add("Guards still run on cache hits", [](TestContext& ctx) {
+            StateMachine sm;
+            bool allow = true;
+            int guard_calls = 0;
+
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", {}, {}});
+            Transition go;
+            go.event = "go";
+            go.from = "A";
+            go.to = "B";
+            go.Guard = [&](const TransitionContext&) { ++guard_calls; return allow; };
+            sm.AddTransition(go);
+            sm.AddTransition({"back", "B", "A"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "First go should pass the guard");
+            ctx.Check(sm.TriggerEvent("back"), "back should return to A");
+            allow = false;
+            ctx.Check(!sm.TriggerEvent("go"), "Cached go should still be rejected by the guard");
+            ctx.Check(sm.GetLastError() == StateMachineError::GuardRejected, "Cached rejection should report GuardRejected");
+            ctx.Check(sm.GetDispatchCacheHits() == 1, "Rejected go should have been a cache hit");
+            ctx.Check(guard_calls == 2, "Guard should run on every dispatch");
+            ctx.Check(sm.GetCurrent() == "A", "Rejected guard should leave A current");
+        });
+
+        add("Reset and Clear zero dispatch cache counters", [](TestContext& ctx) {
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"back", "B", "A"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            sm.TriggerEvent("go");
+            sm.TriggerEvent("back");
+            sm.TriggerEvent("go");
+            ctx.Check(sm.GetDispatchCacheHits() == 1, "Second go should hit");
+            ctx.Check(sm.Reset(), "Reset() should return true");
+            ctx.Check(sm.GetDispatchCacheHits() == 0 && sm.GetDispatchCacheMisses() == 0, "Reset() should zero counters");
+            ctx.Check(sm.AddState({"C", {}, {}}) && sm.AddTransition({"skip", "B", "C"}), "Reset() should reopen configuration");
+            ctx.Check(sm.Start(), "Start() after Reset() should return true");
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "B", "Dispatch after Reset() should still reach B");
+            ctx.Check(sm.GetDispatchCacheMisses() == 1, "Recompiling should have cleared the cached go");
+            ctx.Check(sm.TriggerEvent("skip") && sm.GetCurrent() == "C", "A transition added after Reset() should dispatch");
+            ctx.Check(sm.Clear(), "Clear() should return true");
+            ctx.Check(sm.GetDispatchCacheHits() == 0 && sm.GetDispatchCacheMisses() == 0, "Clear() should zero counters");
+        });
+    });
+
+    RunGroup("Compiled dispatch", passed, failed, [&](auto add) {
+        add("Start compiles the dispatch table", [](TestContext& ctx) {
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+
+            ctx.Check(!sm.IsDispatchCompiled(), "Dispatch should not be compiled before Start()");
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.IsDispatchCompiled(), "Start() should compile the dispatch table");
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "B", "Compiled dispatch should reach B");
+            ctx.Check(sm.Clear(), "Clear() should return true");
+            ctx.Check(!sm.IsDispatchCompiled(), "Clear() should drop the compiled table");
+        });
+
+        add("Compiled dispatch resolves shared event names per state", [](TestContext& ctx) {
+            StateMachine sm;
+            bool ok = true;
+
+            sm.SetInitial("S0");
+            for (int i = 0; i < 50; ++i)
+                sm.AddState({Format("S%d", i), {}, {}});
+            for (int i = 0; i < 50; ++i) {
+                sm.AddTransition({"next", Format("S%d", i), Format("S%d", (i + 1) % 50)});
+                sm.AddTransition({Format("jump%d", i % 7), Format("S%d", i), Format("S%d", (i + 25) % 50)});
+            }
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.IsDispatchCompiled(), "Dispatch table should be compiled");
+            for (int i = 0; i < 50; ++i) {
+                ok &= sm.TriggerEvent("next");
+                ok &= sm.GetCurrent() == Format("S%d", (i + 1) % 50);
+            }
+            ok &= !sm.TriggerEvent("jump1");
+            ok &= sm.GetLastError() == StateMachineError::NoMatchingTransition;
+            ok &= sm.TriggerEvent("jump0");
+            ok &= sm.GetCurrent() == "S25";
+            ctx.Check(ok, "Compiled dispatch should match the configured transitions");
+        });
+
+        add("Oversized tables fall back to linear lookup", [](TestContext& ctx) {
+            StateMachine sm;
+
+            sm.SetInitial("S0");
+            for (int i = 0; i < 1100; ++i)
+                sm.AddState({Format("S%d", i), {}, {}});
+            for (int i = 0; i < 1000; ++i)
+                sm.AddTransition({Format("e%d", i), Format("S%d", i), Format("S%d", i + 1)});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(!sm.IsDispatchCompiled(), "A 1,100 x 1,000 table should not be compiled");
+            ctx.Check(sm.TriggerEvent("e0") && sm.GetCurrent() == "S1", "Fallback lookup should reach S1");
+            ctx.Check(!sm.TriggerEvent("e0"), "Fallback lookup should reject e0 from S1");
+        });
+    });
+
+    RunGroup("Sub-machines", passed, failed, [&](auto add) {
+        add("Shared definition runs inside two instances", [](TestContext& ctx) {
+            StateMachine retry;
+            int wait_enters = 0;
+            Vector<String> guard_states;
+
+            retry.SetInitial("Wait");
+            retry.AddState({"Wait", [&](auto&, auto done) { ++wait_enters; done(true); }, {}});
+            retry.AddState({"Try", {}, {}});
+            retry.AddState({"Failed", {}, {}});
+            Transition tick;
+            tick.event = "tick";
+            tick.from = "Wait";
+            tick.to = "Try";
+            tick.Guard = [&](const TransitionContext& tc) {
+                guard_states.Add(tc.fromState + ">" + tc.toState);
+                return true;
+            };
+            retry.AddTransition(tick);
+            retry.AddTransition({"fail", "Try", "Wait"});
+            retry.AddTransition({"give_up", "Try", "Failed"});
+
+            StateMachine sm;
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Done", {}, {}});
+            ctx.Check(sm.AddSubMachine("upload", retry), "First instance should be added");
+            ctx.Check(sm.AddSubMachine("download", retry), "Second instance should be added");
+            ctx.Check(sm.GetSubMachineCount() == 2, "Two instances should exist");
+            ctx.Check(sm.GetStateCount() == 2, "Instances should not add parent states");
+            ctx.Check(sm.HasState("upload.Try"), "Instance state should be addressable");
+            ctx.Check(sm.AddTransition({"send", "Idle", "upload"}), "Entry binding should be accepted");
+            ctx.Check(sm.AddTransition({"ok", "upload", "download"}), "Instance-wide exit should be accepted");
+            ctx.Check(sm.AddTransition({"ok", "download.Try", "Done"}), "State-specific exit should be accepted");
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("send"), "send should enter the upload instance");
+            ctx.Check(sm.GetCurrent() == "upload.Wait", "Entry should land on the definition's initial state");
+            ctx.Check(sm.TriggerEvent("tick") && sm.GetCurrent() == "upload.Try", "Shared transition should run in upload");
+            ctx.Check(sm.TriggerEvent("fail") && sm.GetCurrent() == "upload.Wait", "Shared fail should return to upload.Wait");
+            ctx.Check(sm.TriggerEvent("ok") && sm.GetCurrent() == "download.Wait", "Instance-wide exit should enter download");
+            ctx.Check(!sm.TriggerEvent("ok"), "download.Wait has no ok exit");
+            ctx.Check(sm.TriggerEvent("tick") && sm.GetCurrent() == "download.Try", "Shared transition should run in download");
+            ctx.Check(sm.TriggerEvent("ok") && sm.GetCurrent() == "Done", "State-specific exit should leave download");
+            ctx.Check(wait_enters == 3, "Shared OnEnter should run for both instances");
+            ctx.Check(guard_states.GetCount() == 2 && guard_states[0] == "upload.Wait>upload.Try" &&
+                      guard_states[1] == "download.Wait>download.Try", "Guards should see instance-qualified ids");
+            ctx.Check(sm.GetHistoryFrom(3) == "upload.Try" && sm.GetHistoryTo(3) == "upload.Wait", "History should record qualified ids");
+        });
+
+        add("Definition transitions are overridden by state-specific exits", [](TestContext& ctx) {
+            StateMachine def;
+            def.SetInitial("A");
+            def.AddState({"A", {}, {}});
+            def.AddState({"B", {}, {}});
+            def.AddTransition({"go", "A", "B"});
+
+            StateMachine sm;
+            sm.SetInitial("sub");
+            sm.AddState({"Out", {}, {}});
+            sm.AddSubMachine("sub", def);
+            sm.AddTransition({"go", "sub.A", "Out"});
+            sm.AddTransition({"go", "sub", "sub.A"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.GetCurrent() == "sub.A", "Start() should enter the instance initial");
+            ctx.Check(sm.GetHistoryTo(0) == "sub.A", "Start history should record the qualified id");
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "Out", "State-specific exit should win over the definition");
+        });
+
+        add("Instance-wide exits apply only when the definition has no match", [](TestContext& ctx) {
+            StateMachine def;
+            def.SetInitial("A");
+            def.AddState({"A", {}, {}});
+            def.AddState({"B", {}, {}});
+            def.AddTransition({"go", "A", "B"});
+
+            StateMachine sm;
+            sm.SetInitial("sub");
+            sm.AddState({"Out", {}, {}});
+            sm.AddSubMachine("sub", def);
+            sm.AddTransition({"go", "sub", "Out"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "sub.B", "Definition transition should win over instance-wide exit");
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "Out", "Instance-wide exit should leave from sub.B");
+            ctx.Check(sm.GoBack() && sm.GetCurrent() == "sub.B", "GoBack() should return into the instance");
+        });
+
+        add("Invalid sub-machines are rejected", [](TestContext& ctx) {
+            StateMachine def;
+            def.AddState({"A", {}, {}});
+
+            StateMachine sm;
+            sm.AddState({"X", {}, {}});
+            ctx.Check(!sm.AddSubMachine("sub", def), "Definition without initial should be rejected");
+            ctx.Check(sm.GetLastError() == StateMachineError::InvalidSubMachine, "Missing initial should report InvalidSubMachine");
+            def.SetInitial("A");
+            ctx.Check(!sm.AddSubMachine("", def), "Empty id should be rejected");
+            ctx.Check(sm.GetLastError() == StateMachineError::EmptyStateId, "Empty id should report EmptyStateId");
+            ctx.Check(!sm.AddSubMachine("X", def), "Id clashing with a state should be rejected");
+            ctx.Check(sm.GetLastError() == StateMachineError::DuplicateStateId, "Clash should report DuplicateStateId");
+            ctx.Check(!sm.AddSubMachine("self", sm), "Self reference should be rejected");
+            ctx.Check(sm.GetLastError() == StateMachineError::InvalidSubMachine, "Self reference should report InvalidSubMachine");
+            ctx.Check(sm.AddSubMachine("sub", def), "Valid definition should be accepted");
+            ctx.Check(!sm.AddSubMachine("sub", def), "Duplicate instance id should be rejected");
+            ctx.Check(!sm.AddState({"sub.A", {}, {}}), "State clashing with an instance state should be rejected");
+
+            StateMachine outer;
+            sm.SetInitial("X");
+            ctx.Check(!outer.AddSubMachine("nested", sm), "Nested sub-machines should be rejected");
+            ctx.Check(outer.GetLastErrorText() == "Invalid sub-machine", "Error text should describe the sub-machine failure");
+            ctx.Check(sm.Clear() && sm.GetSubMachineCount() == 0, "Clear() should remove instances");
+        });
+
+        add("States added after Reset() do not leave stale cached targets", [](TestContext& ctx) {
+            StateMachine def;
+            def.SetInitial("X");
+            def.AddState({"X", {}, {}});
+            def.AddState({"Y", {}, {}});
+
+            StateMachine sm;
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, {}});
+            sm.AddSubMachine("sub", def);
+            sm.AddTransition({"go", "A", "sub.Y"});
+
+            ctx.Check(sm.Start() && sm.TriggerEvent("go") && sm.GetCurrent() == "sub.Y", "go should reach sub.Y");
+            ctx.Check(sm.Reset() && sm.AddState({"B", {}, {}}), "Reset() should allow another own state");
+            ctx.Check(sm.Start() && sm.TriggerEvent("go"), "go should dispatch after the restart");
+            ctx.Check(sm.GetCurrent() == "sub.Y", "go should still reach sub.Y, not a shifted index");
+        });
+    });
+
+    RunGroup("Memory usage", passed, failed, [&](auto add) {
+        add("GetMemoryUsage reports definition and callbacks", [](TestContext& ctx) {
+            StateMachine sm;
+            const StateMachineMemoryUsage empty = sm.GetMemoryUsage();
+
+            sm.SetInitial("A");
+            sm.AddState({"A", [](auto&, auto done) { done(true); }, {}});
+            sm.AddState({"A_state_with_a_long_identifier", {}, [](auto&, auto done) { done(true); }});
+            sm.AddTransition({"go", "A", "A_state_with_a_long_identifier"});
+            sm.WhenTransitionStarted = [](const TransitionContext&) {};
+
+            const StateMachineMemoryUsage u = sm.GetMemoryUsage();
+            ctx.Check(empty.definition > 0, "An empty machine should still report its own size");
+            ctx.Check(u.definition > empty.definition, "States and transitions should grow the definition");
+            ctx.Check(u.strings > 0, "Long ids should report heap string storage");
+            ctx.Check(u.callbacks == 3, "Two state callbacks and one hook should be counted");
+            ctx.Check(u.history == 0 && u.queue == 0, "Unstarted machine should have no history or queue");
+            ctx.Check(u.GetTotal() == u.definition + u.history + u.queue + u.strings, "Total should sum the byte categories");
+        });
+
+        add("GetMemoryUsage tracks history and queue growth", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"back", "B", "A"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            const StateMachineMemoryUsage started = sm.GetMemoryUsage();
+            ctx.Check(started.history > 0, "Start() should record history");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.TriggerEvent("back"), "back should queue");
+            const StateMachineMemoryUsage queued = sm.GetMemoryUsage();
+            ctx.Check(queued.queue > 0, "Queued events should be reported");
+            ctx.Check(queued.definition == started.definition, "Definition should be stable after Start()");
+            finish_exit(true);
+            ctx.Check(sm.GetMemoryUsage().history > started.history, "Completed transitions should grow history");
+        });
+
+        add("Memory usage aggregates across machines", [](TestContext& ctx) {
+            StateMachine a;
+            StateMachine b;
+            a.AddState({"A", {}, {}});
+            b.AddState({"B", [](auto&, auto done) { done(true); }, {}});
+
+            StateMachineMemoryUsage sum;
+            sum += a.GetMemoryUsage();
+            sum += b.GetMemoryUsage();
+            ctx.Check(sum.definition == a.GetMemoryUsage().definition + b.GetMemoryUsage().definition, "Definitions should add up");
+            ctx.Check(sum.callbacks == 1, "Callbacks should add up");
+            ctx.Check(sum.GetTotal() == a.GetMemoryUsage().GetTotal() + b.GetMemoryUsage().GetTotal(), "Totals should add up");
+        });
+    });
+
+    RunGroup("Run to completion", passed, failed, [&](auto add) {
+        add("Callback-raised events bypass the external queue capacity", [](TestContext& ctx) {
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::RunToCompletion);
+            sm.SetMaxQueuedEvents(0);
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", [&](StateMachine& m, auto done) {
+                ctx.Check(m.TriggerEvent("next"), "Follow-up event should be accepted from OnEnter");
+                ctx.Check(m.GetInternalEventCount() == 1, "Follow-up event should use the internal queue");
+                done(true);
+            }, {}});
+            sm.AddState({"C", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"next", "B", "C"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.GetCurrent() == "C", "Follow-up event should run after go completes");
+            ctx.Check(sm.GetHistoryCount() == 3, "Both transitions should be recorded");
+            ctx.Check(!sm.HasQueuedEvents(), "Both queues should be empty");
+            ctx.Check(sm.GetLastError() == StateMachineError::None, "Run-to-completion chain should leave no error");
+        });
+
+        add("Internal events run before earlier external events", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            Vector<String> entered;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::RunToCompletion);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", [&](StateMachine& m, auto done) {
+                entered.Add("B");
+                m.TriggerEvent("follow");
+                done(true);
+            }, {}});
+            sm.AddState({"C", [&](auto&, auto done) { entered.Add("C"); done(true); }, {}});
+            sm.AddState({"D", [&](auto&, auto done) { entered.Add("D"); done(true); }, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"follow", "B", "C"});
+            sm.AddTransition({"ext", "C", "D"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.TriggerEvent("ext"), "External event should queue while transitioning");
+            ctx.Check(sm.GetQueuedEventCount() == 1 && sm.GetInternalEventCount() == 0, "External event should use the external queue");
+            finish_exit(true);
+            ctx.Check(SameOrder(entered, {"B", "C", "D"}), "Internal follow-up should run before the queued external event");
+            ctx.Check(sm.GetCurrent() == "D", "Machine should end in D");
+        });
+
+        add("Self-feeding internal chains stop at the internal limit", [](TestContext& ctx) {
+            StateMachine sm;
+            int enters = 0;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::RunToCompletion);
+            sm.SetMaxInternalEvents(4);
+            sm.AddState({"A", [&](StateMachine& m, auto done) { ++enters; m.TriggerEvent("flip"); done(true); }, {}});
+            sm.AddState({"B", [&](StateMachine& m, auto done) { ++enters; m.TriggerEvent("flip"); done(true); }, {}});
+            sm.AddTransition({"flip", "A", "B"});
+            sm.AddTransition({"flip", "B", "A"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(enters == 5, "Initial enter plus four internal hops should run");
+            ctx.Check(sm.GetLastError() == StateMachineError::EventQueueDrainLimitReached, "Chain should stop at the internal limit");
+            ctx.Check(sm.GetInternalEventCount() == 1, "The unprocessed follow-up should stay queued");
+            ctx.Check(!sm.IsTransitioning(), "Machine should remain usable");
+            ctx.Check(sm.GetHistoryTo(sm.GetHistoryCount() - 1) == sm.GetCurrent(), "History should match current");
+        });
+
+        add("QueueWhileTransitioning keeps callback events in the external queue", [](TestContext& ctx) {
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(0);
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", [&](StateMachine& m, auto done) {
+                ctx.Check(!m.TriggerEvent("next"), "Full external queue should reject the follow-up");
+                ctx.Check(m.GetLastError() == StateMachineError::EventQueueFull, "Rejection should report EventQueueFull");
+                done(true);
+            }, {}});
+            sm.AddState({"C", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"next", "B", "C"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.GetCurrent() == "B", "Follow-up should have been rejected");
+            ctx.Check(sm.GetInternalEventCount() == 0, "Internal queue should stay unused");
+        });
+    });
+
+    RunGroup("Queue stats", passed, failed, [&](auto add) {
+        add("Queue stats count enqueues, dequeues and depth", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            bool hold = true;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(3);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) {
+                if (hold)
+                    finish_exit = pick(done);
+                else
+                    done(true);
+            }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"back", "B", "A"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.TriggerEvent("back"), "back should queue");
+            ctx.Check(sm.TriggerEvent("go"), "go should queue");
+            ctx.Check(sm.TriggerEvent("back"), "back should queue");
+            ctx.Check(!sm.TriggerEvent("go"), "Fourth queued event should be rejected");
+
+            const StateMachineQueueStats& q = sm.GetQueueStats();
+            ctx.Check(q.enqueued == 3, "Three events should be enqueued");
+            ctx.Check(q.queue_full == 1, "One EventQueueFull should be counted");
+            ctx.Check(q.depth_high_water == 3, "Depth high-water mark should be 3");
+            int64 depth_samples = 0;
+            for (int i = 0; i < StateMachineQueueStats::BUCKETS; ++i)
+                depth_samples += q.depth_histogram[i];
+            ctx.Check(depth_samples == 3, "Depth histogram should hold one sample per enqueue");
+            ctx.Check(q.depth_histogram[1] == 1 && q.depth_histogram[2] == 2, "Depths 1, 2, 3 should fall into buckets 1, 2, 2");
+
+            hold = false;
+            finish_exit(true);
+            ctx.Check(sm.GetCurrent() == "A", "Queued events should drain to A");
+            ctx.Check(q.dequeued == 3, "All queued events should be dequeued");
+            int64 wait_samples = 0;
+            for (int i = 0; i < StateMachineQueueStats::BUCKETS; ++i)
+                wait_samples += q.wait_histogram[i];
+            ctx.Check(wait_samples == 3, "Wait histogram should hold one sample per dequeue");
+            ctx.Check(q.wait_high_water >= 0 && q.wait_total >= q.wait_high_water, "Wait totals should be consistent");
+        });
+
+        add("Queue stats count drain limit stops", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(2);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            Transition loop{"loop", "B", "B"};
+            loop.OnAfter = [&](const TransitionContext&) { sm.TriggerEvent("loop"); };
+            sm.AddTransition(loop);
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.TriggerEvent("loop"), "loop should queue");
+            finish_exit(true);
+            ctx.Check(sm.GetLastError() == StateMachineError::EventQueueDrainLimitReached, "Drain should stop at the limit");
+            ctx.Check(sm.GetQueueStats().drain_limit_reached == 1, "Drain limit stop should be counted");
+            ctx.Check(sm.GetQueueStats().dequeued == 2, "Two loop events should be dequeued");
+            ctx.Check(sm.Reset(), "Reset() should return true");
+            ctx.Check(sm.GetQueueStats().enqueued == 0 && sm.GetQueueStats().drain_limit_reached == 0, "Reset() should zero queue stats");
+        });
+
+        add("Queue stats buckets are powers of two", [](TestContext& ctx) {
+            ctx.Check(StateMachineQueueStats::GetBucket(0) == 0, "Zero should use bucket 0");
+            ctx.Check(StateMachineQueueStats::GetBucket(1) == 1, "One should use bucket 1");
+            ctx.Check(StateMachineQueueStats::GetBucket(3) == 2, "Three should use bucket 2");
+            ctx.Check(StateMachineQueueStats::GetBucket(4) == 3, "Four should use bucket 3");
+            ctx.Check(StateMachineQueueStats::GetBucket(int64(1) << 40) == StateMachineQueueStats::BUCKETS - 1, "Huge values should clamp to the last bucket");
+        });
+    });
+
+    RunGroup("Queue flow control", passed, failed, [&](auto add) {
+        add("Reserved slots reduce capacity for other producers", [](TestContext& ctx) {
+            StateMachine sm;
+            sm.SetMaxQueuedEvents(4);
+
+            ctx.Check(sm.GetQueueCapacityLeft() == 4, "Empty queue should have full capacity");
+            ctx.Check(sm.ReserveQueueSlots(3), "Reserving three slots should succeed");
+            ctx.Check(sm.GetReservedQueueSlots() == 3, "Three slots should be reserved");
+            ctx.Check(sm.GetQueueCapacityLeft() == 1, "One slot should remain");
+            ctx.Check(!sm.ReserveQueueSlots(2), "Over-reserving should fail as a whole");
+            ctx.Check(sm.GetLastError() == StateMachineError::EventQueueFull, "Over-reserving should report EventQueueFull");
+            ctx.Check(sm.GetReservedQueueSlots() == 3, "Failed reservation should not claim anything");
+            sm.ReleaseQueueSlots(1);
+            ctx.Check(sm.GetQueueCapacityLeft() == 2, "Released slot should become available");
+            sm.SetMaxQueuedEvents(1);
+            ctx.Check(sm.GetReservedQueueSlots() == 1, "Shrinking capacity should clamp reservations");
+        });
+
+        add("TriggerReservedEvent queues into a claimed slot", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(2);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddState({"C", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"next", "B", "C"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.ReserveQueueSlots(2), "Producer should claim both slots");
+            ctx.Check(!sm.TriggerEvent("next"), "Unreserved producers should see a full queue");
+            ctx.Check(sm.GetLastError() == StateMachineError::EventQueueFull, "Unreserved event should report EventQueueFull");
+            ctx.Check(sm.TriggerReservedEvent("next"), "Reserved event should queue");
+            ctx.Check(sm.GetQueuedEventCount() == 1 && sm.GetReservedQueueSlots() == 1, "One slot should move from reserved to queued");
+            finish_exit(true);
+            ctx.Check(sm.GetCurrent() == "C", "Reserved event should drain normally");
+            ctx.Check(sm.Reset() && sm.GetReservedQueueSlots() == 0, "Reset() should drop reservations");
+        });
+
+        add("Watermark callbacks fire with hysteresis", [](TestContext& ctx) {
+            StateMachine sm;
+            int high = 0;
+            int low = 0;
+
+            sm.SetMaxQueuedEvents(4);
+            sm.SetQueueWatermarks(25, 75);
+            sm.WhenQueueHigh = [&] { ++high; };
+            sm.WhenQueueLow = [&] { ++low; };
+
+            sm.ReserveQueueSlots(2);
+            ctx.Check(high == 0, "Half full should stay below the high watermark");
+            sm.ReserveQueueSlots(1);
+            ctx.Check(high == 1, "Three of four should reach the high watermark");
+            sm.ReleaseQueueSlots(1);
+            ctx.Check(low == 0, "Half full should stay above the low watermark");
+            sm.ReleaseQueueSlots(1);
+            ctx.Check(low == 1, "One of four should reach the low watermark");
+            sm.ReserveQueueSlots(3);
+            ctx.Check(high == 2, "Rising again should re-arm the high watermark");
+            sm.ReserveQueueSlots(0);
+            ctx.Check(high == 2, "Staying high should not fire again");
+        });
+    });
+
+    RunGroup("Queue overflow", passed, failed, [&](auto add) {
+        add("DropOldest discards the queue head", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            Vector<String> seen;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(2);
+            sm.SetQueueOverflowPolicy(QueueOverflowPolicy::DropOldest);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            for (const char* e : {"e1", "e2", "e3"}) {
+                Transition t{e, "B", "B"};
+                t.OnAfter = [&seen, e](const TransitionContext&) { seen.Add(e); };
+                sm.AddTransition(t);
+            }
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.TriggerEvent("e1") && sm.TriggerEvent("e2"), "e1 and e2 should queue");
+            ctx.Check(sm.TriggerEvent("e3"), "e3 should be accepted by dropping e1");
+            ctx.Check(sm.GetQueuedEventCount() == 2, "Queue should stay at capacity");
+            ctx.Check(sm.GetQueueStats().dropped_oldest == 1, "One dropped head should be counted");
+            finish_exit(true);
+            ctx.Check(seen.GetCount() == 2 && seen[0] == "e2" && seen[1] == "e3", "Only e2 and e3 should run, in order");
+        });
+
+        add("ReplaceLatest coalesces same-name events", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(2);
+            sm.SetEventOverflowPolicy("sync", QueueOverflowPolicy::ReplaceLatest);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"sync", "B", "B"});
+            sm.AddTransition({"other", "B", "B"});
+
+            ctx.Check(sm.GetEventOverflowPolicy("sync") == QueueOverflowPolicy::ReplaceLatest, "Per-event policy should be stored");
+            ctx.Check(sm.GetEventOverflowPolicy("other") == QueueOverflowPolicy::RejectNewest, "Other events should use the machine policy");
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.TriggerEvent("sync") && sm.TriggerEvent("other"), "sync and other should queue");
+            Sleep(3);
+            ctx.Check(sm.TriggerEvent("sync"), "Overflowing sync should coalesce");
+            ctx.Check(!sm.TriggerEvent("other"), "Overflowing other should be rejected");
+            ctx.Check(sm.GetLastError() == StateMachineError::EventQueueFull, "Rejection should report EventQueueFull");
+            ctx.Check(sm.GetQueueStats().replaced == 1, "One replacement should be counted");
+            ctx.Check(sm.GetQueueStats().queue_full == 1, "One rejection should be counted");
+            ctx.Check(sm.GetQueuedEventCount() == 2, "Queue depth should be unchanged");
+            finish_exit(true);
+            const StateMachineQueueStats& stats = sm.GetQueueStats();
+            int64 short_waits = 0;
+            for (int i = 0; i < StateMachineQueueStats::GetBucket(3000); ++i)
+                short_waits += stats.wait_histogram[i];
+            ctx.Check(stats.dequeued == 2 && short_waits == 0, "The coalesced sync should keep its first enqueue time");
+        });
+
+        add("ReplaceLatest still coalesces after the queue shrinks", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(8);
+            sm.SetEventOverflowPolicy("x", QueueOverflowPolicy::ReplaceLatest);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"x", "B", "B"});
+            sm.AddTransition({"y", "B", "B"});
+
+            sm.Start();
+            sm.TriggerEvent("go");
+            for (int i = 0; i < 5; ++i)
+                sm.TriggerEvent("y");
+            sm.SetMaxQueuedEvents(2);
+            sm.SetMaxQueuedEvents(3);
+            ctx.Check(sm.TriggerEvent("x"), "x should fill the last slot");
+            ctx.Check(sm.TriggerEvent("x"), "The second x should replace the first");
+            ctx.Check(sm.GetQueueStats().replaced == 1, "One replacement should be counted");
+            ctx.Check(sm.GetQueuedEventCount() == 3, "Queue depth should stay at the cap");
+            finish_exit(true);
+            ctx.Check(sm.GetHistoryCount() == 5, "y, y and x should run after go");
+        });
+
+        add("Spill buffer drains after the main queue", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            Vector<String> seen;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(1);
+            sm.SetMaxSpilledEvents(2);
+            sm.SetQueueOverflowPolicy(QueueOverflowPolicy::Spill);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            for (const char* e : {"e1", "e2", "e3", "e4"}) {
+                Transition t{e, "B", "B"};
+                t.OnAfter = [&seen, e](const TransitionContext&) { seen.Add(e); };
+                sm.AddTransition(t);
+            }
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.TriggerEvent("e1"), "e1 should queue");
+            ctx.Check(sm.TriggerEvent("e2") && sm.TriggerEvent("e3"), "e2 and e3 should spill");
+            ctx.Check(!sm.TriggerEvent("e4"), "e4 should be rejected once the spill buffer is full");
+            ctx.Check(sm.GetSpilledEventCount() == 2, "Two events should be spilled");
+            ctx.Check(sm.GetQueueStats().spilled == 2, "Spills should be counted");
+            ctx.Check(sm.HasQueuedEvents(), "Spilled events should count as queued work");
+            finish_exit(true);
+            ctx.Check(seen.GetCount() == 3 && seen[0] == "e1" && seen[1] == "e2" && seen[2] == "e3", "Main queue should drain before the spill buffer");
+            ctx.Check(sm.GetSpilledEventCount() == 0, "Spill buffer should be empty after draining");
+            ctx.Check(sm.GetQueueStats().enqueued == 3 && sm.GetQueueStats().dequeued == 3, "Spilled events should count as enqueued");
+
+            ctx.Check(sm.TriggerEvent("e1"), "Idle machine should dispatch directly");
+            sm.SetMaxSpilledEvents(-3);
+            ctx.Check(sm.GetMaxSpilledEvents() == 0, "Negative spill capacity should clamp to zero");
+        });
+
+        add("ClearQueuedEvents clears the spill buffer", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            StateMachine sm;
+
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.SetMaxQueuedEvents(1);
+            sm.SetQueueOverflowPolicy(QueueOverflowPolicy::Spill);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"x", "B", "B"});
+
+            ctx.Check(sm.Start(), "Start() should return true");
+            ctx.Check(sm.TriggerEvent("go"), "go should begin");
+            ctx.Check(sm.TriggerEvent("x") && sm.TriggerEvent("x"), "x should queue then spill");
+            sm.ClearQueuedEvents();
+            ctx.Check(!sm.HasQueuedEvents() && sm.GetSpilledEventCount() == 0, "ClearQueuedEvents() should empty every queue");
+            finish_exit(true);
+            ctx.Check(sm.GetCurrent() == "B", "Nothing should run after clearing");
+        });
+    });
+
+    RunGroup("Event router", passed, failed, [&](auto add) {
+        auto define = [](StateMachine& sm, const String&) {
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Busy", {}, {}});
+            sm.AddTransition({"work", "Idle", "Busy"});
+            sm.AddTransition({"rest", "Busy", "Idle"});
+        };
+
+        add("Router creates instances lazily per key", [define](TestContext& ctx) {
+            EventRouter router;
+            Vector<String> created;
+            router.WhenCreate = [&](StateMachine& sm, const String& key) { created.Add(key); define(sm, key); };
+
+            ctx.Check(router.Find("a") == nullptr, "Unknown key should not be found");
+            ctx.Check(router.GetCount() == 0, "Find() should not create instances");
+            ctx.Check(router.Route("a", "work"), "First event should create and dispatch");
+            ctx.Check(router.Route("b", "work") && router.Route("a", "rest"), "Further events should dispatch");
+            ctx.Check(created.GetCount() == 2 && created[0] == "a" && created[1] == "b", "Each key should be created once");
+            ctx.Check(router.GetCount() == 2 && router.GetKey(1) == "b", "Instances should keep creation order");
+            ctx.Check(router.Find("a")->GetCurrent() == "Idle", "Instance a should be back in Idle");
+            ctx.Check(router.Find("b")->GetCurrent() == "Busy", "Instance b should be in Busy");
+        });
+
+        add("Router reports empty keys and failed dispatch", [define](TestContext& ctx) {
+            EventRouter router;
+            router.WhenCreate = define;
+
+            ctx.Check(!router.Route("", "work"), "Empty key should be rejected");
+            ctx.Check(router.GetLastError() == StateMachineError::EmptyRouteKey, "Empty key should report EmptyRouteKey");
+            ctx.Check(!router.Route("a", "rest"), "Unknown event should fail");
+            ctx.Check(router.GetLastError() == StateMachineError::NoMatchingTransition, "Machine error should be surfaced");
+            ctx.Check(router.GetCount() == 1, "Instance should still be created");
+        });
+
+        add("Router drops instances that fail to start", [](TestContext& ctx) {
+            EventRouter router;
+            ctx.Check(!router.Route("a", "work"), "Unconfigured instance should fail to start");
+            ctx.Check(router.GetLastError() != StateMachineError::None, "Start failure should be reported");
+            ctx.Check(router.GetCount() == 0 && router.Find("a") == nullptr, "Failed instance should not be kept");
+        });
+
+        add("Router survives table growth", [define](TestContext& ctx) {
+            EventRouter router;
+            router.WhenCreate = define;
+            bool ok = true;
+            for (int i = 0; i < 200; ++i)
+                ok = router.Route(AsString(i), "work") && ok;
+            ctx.Check(ok && router.GetCount() == 200, "All keys should be created");
+            for (int i = 0; i < 200; ++i)
+                ok = router.Find(AsString(i)) == &router[i] && ok;
+            ctx.Check(ok, "Every key should still map to its instance");
+            router.Clear();
+            ctx.Check(router.GetCount() == 0 && router.Find("0") == nullptr, "Clear() should drop instances");
+        });
+
+        add("RouteBatch groups by instance in arrival order", [](TestContext& ctx) {
+            EventRouter router;
+            VectorMap<String, Vector<String>> seen;
+            router.WhenCreate = [&](StateMachine& sm, const String& key) {
+                sm.SetInitial("S");
+                sm.AddState({"S", {}, {}});
+                for (const char* e : {"e1", "e2", "e3"}) {
+                    Transition t{e, "S", "S"};
+                    t.OnAfter = [&seen, key, e](const TransitionContext&) { seen.GetAdd(key).Add(e); };
+                    sm.AddTransition(t);
+                }
+            };
+
+            Vector<RoutedEvent> batch;
+            auto add_event = [&](const char* key, const char* event) {
+                RoutedEvent& r = batch.Add();
+                r.key = key;
+                r.event = event;
+            };
+            add_event("x", "e1");
+            add_event("y", "e1");
+            add_event("x", "e2");
+            add_event("", "e1");
+            add_event("y", "bad");
+            add_event("x", "e3");
+            ctx.Check(router.RouteBatch(batch) == 4, "Four events should be accepted");
+            ctx.Check(router.GetLastError() == StateMachineError::NoMatchingTransition, "Last failure should be kept");
+            ctx.Check(seen.GetCount() == 2 && seen.GetKey(0) == "x", "Instance x should be dispatched first");
+            const Vector<String>& x = seen.Get("x");
+            ctx.Check(x.GetCount() == 3 && x[0] == "e1" && x[1] == "e2" && x[2] == "e3", "x events should keep arrival order");
+            ctx.Check(seen.Get("y").GetCount() == 1, "y should get its valid event");
+        });
+    });
+
+    RunGroup("Router membership", passed, failed, [&](auto add) {
+        auto define = [](StateMachine& sm, const String&) {
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Busy", {}, {}});
+            sm.AddTransition({"work", "Idle", "Busy"});
+            sm.AddTransition({"rest", "Busy", "Idle"});
+            sm.AddTransition({"poke", "Busy", "Busy"});
+        };
+
+        add("Membership counts follow commits", [define](TestContext& ctx) {
+            EventRouter router;
+            router.WhenCreate = define;
+
+            ctx.Check(router.GetMemberCount("Idle") == 0, "Unknown state should have no members");
+            ctx.Check(router.Route("a", "work") && router.Route("b", "work") && router.Route("c", "work"), "Three instances should go Busy");
+            ctx.Check(router.GetMemberCount("Busy") == 3 && router.GetMemberCount("Idle") == 0, "All three should be Busy");
+            ctx.Check(router.Route("b", "rest"), "b should rest");
+            ctx.Check(router.GetMemberCount("Busy") == 2 && router.GetMemberCount("Idle") == 1, "b should move to Idle");
+
+            Vector<int> busy = router.GetMembers("Busy");
+            ctx.Check(busy.GetCount() == 2 && busy[0] == 0 && busy[1] == 2, "Busy members should be a and c in commit order");
+            ctx.Check(router.GetFirstMember("Idle") == 1 && router.GetNextMember(1) < 0, "Idle list should hold only b");
+
+            ctx.Check(router.Route("a", "poke"), "Self-transition should commit");
+            busy = router.GetMembers("Busy");
+            ctx.Check(busy.GetCount() == 2 && busy[0] == 2 && busy[1] == 0, "Recommitted instance should move to the tail");
+
+            ctx.Check(router[2].Reset(), "Reset() should succeed");
+            ctx.Check(router.GetMemberCount("Busy") == 1, "Reset instance should leave its state list");
+        });
+
+        add("Async start joins membership on completion", [](TestContext& ctx) {
+            EventRouter router;
+            Function<void(bool)> finish_enter;
+            router.WhenCreate = [&](StateMachine& sm, const String&) {
+                sm.SetInitial("Idle");
+                sm.AddState({"Idle", [&](StateMachine&, Function<void(bool)> done) { finish_enter = pick(done); }, {}});
+                sm.AddState({"Busy", {}, {}});
+                sm.AddTransition({"work", "Idle", "Busy"});
+            };
+            ctx.Check(!router.Route("a", "work"), "Event during async start should be rejected");
+            ctx.Check(router.GetCount() == 1 && router.GetMemberCount("Idle") == 0, "Starting instance should be in no state");
+            finish_enter(true);
+            ctx.Check(router.GetMemberCount("Idle") == 1, "Completed start should commit Idle");
+        });
+
+        add("Broadcast dispatches only to members of a state", [define](TestContext& ctx) {
+            EventRouter router;
+            router.WhenCreate = define;
+            for (const char* key : {"a", "b", "c", "d"})
+                router.Route(key, "work");
+            router.Route("d", "rest");
+
+            ctx.Check(router.Broadcast("rest", "Busy") == 3, "Three Busy instances should accept rest");
+            ctx.Check(router.GetMemberCount("Idle") == 4 && router.GetMemberCount("Busy") == 0, "Everyone should be Idle");
+            ctx.Check(router.Broadcast("work", "Idle") == 4, "Moved members should each be visited once");
+            ctx.Check(router.GetMemberCount("Busy") == 4, "Everyone should be Busy");
+            ctx.Check(router.Broadcast("work", "Missing") == 0, "Unknown state should broadcast to nobody");
+
+            router.Clear();
+            ctx.Check(router.GetMemberCount("Busy") == 0, "Clear() should drop membership");
+        });
+    });
+
+    RunGroup("Router dwell time", passed, failed, [&](auto add) {
+        auto define = [](StateMachine& sm, const String&) {
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Busy", {}, {}});
+            sm.AddState({"Stuck", {}, {}});
+            sm.AddTransition({"work", "Idle", "Busy"});
+            sm.AddTransition({"timeout", "Busy", "Stuck"});
+            sm.AddTransition({"poke", "Busy", "Busy"});
+        };
+
+        add("Stale queries use the entry-time order", [define](TestContext& ctx) {
+            EventRouter router;
+            int64 now = 1000;
+            router.SetClock([&] { return now; });
+            router.WhenCreate = define;
+
+            router.Route("a", "work");
+            now = 1100;
+            router.Route("b", "work");
+            now = 1200;
+            router.Route("c", "work");
+            ctx.Check(router.GetEnteredAt(0) == 1000 && router.GetEnteredAt(2) == 1200, "Commits should be stamped by the clock");
+
+            now = 1250;
+            Vector<int> stale = router.GetStale("Busy", 100);
+            ctx.Check(stale.GetCount() == 2 && stale[0] == 0 && stale[1] == 1, "a and b should be stale, oldest first");
+            ctx.Check(router.GetStale("Busy", 1000).IsEmpty(), "Nobody should be older than 1000");
+
+            router.Route("a", "poke");
+            stale = router.GetStale("Busy", 100);
+            ctx.Check(stale.GetCount() == 1 && stale[0] == 1, "Re-entered a should be fresh again");
+        });
+
+        add("Sweeps move stale instances", [define](TestContext& ctx) {
+            EventRouter router;
+            int64 now = 0;
+            router.SetClock([&] { return now; });
+            router.WhenCreate = define;
+            router.AddSweep("Busy", 500, "timeout");
+
+            router.Route("a", "work");
+            router.Route("b", "work");
+            now = 400;
+            router.Route("c", "work");
+            router.Route("d", "work");
+            now = 600;
+            ctx.Check(router.RunSweeps() == 2, "Two instances should time out");
+            ctx.Check(router.GetMemberCount("Stuck") == 2 && router.GetMemberCount("Busy") == 2, "a and b should be Stuck");
+            ctx.Check(router.RunSweeps() == 0, "Nothing else should be stale yet");
+
+            now = 1000;
+            ctx.Check(router.Sweep("Busy", 500, "poke") == 2, "Direct sweep should reach c and d");
+            ctx.Check(router.Sweep("Busy", 500, "poke") == 0, "Poked instances should be fresh");
+            ctx.Check(router.Sweep("Stuck", 0, "poke") == 0, "Stuck has no poke transition");
+            ctx.Check(router.GetLastError() == StateMachineError::NoMatchingTransition, "Sweep failures should be reported");
+        });
+    });
+
+    RunGroup("Sharded router", passed, failed, [&](auto add) {
+        auto define = [](StateMachine& sm, const String&) {
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Busy", {}, {}});
+            sm.AddTransition({"work", "Idle", "Busy"});
+            sm.AddTransition({"rest", "Busy", "Idle"});
+        };
+
+        add("Posted events reach the key's shard", [define](TestContext& ctx) {
+            ShardedRouter router;
+            router.WhenCreate = define;
+            ctx.Check(router.SetShardCount(4), "SetShardCount() should succeed");
+            ctx.Check(router.GetShardCount() == 4, "Four shards should exist");
+
+            bool ok = true;
+            for (int i = 0; i < 64; ++i)
+                ok = router.Post(AsString(i), "work") && ok;
+            ctx.Check(ok, "Posts should fit in the rings");
+            ctx.Check(!router.Post("", "work"), "Empty key should be refused");
+
+            int pumped = 0;
+            for (int i = 0; i < 4; ++i)
+                pumped += router.Pump(i);
+            ctx.Check(pumped == 64 && router.GetCount() == 64, "Every key should get an instance");
+            for (int i = 0; i < 64; ++i) {
+                const StateMachine* sm = router.GetShard(router.GetShardIndex(AsString(i))).Find(AsString(i));
+                ok = sm && sm->GetCurrent() == "Busy" && ok;
+            }
+            ctx.Check(ok, "Each instance should live in its key's shard");
+            int used = 0;
+            for (int i = 0; i < 4; ++i)
+                used += router.GetShard(i).GetCount() > 0;
+            ctx.Check(used > 1, "Keys should spread over several shards");
+        });
+
+        add("Callback posts travel between shards", [](TestContext& ctx) {
+            ShardedRouter router;
+            router.SetShardCount(2);
+            router.WhenCreate = [&](StateMachine& sm, const String& key) {
+                sm.SetInitial("Idle");
+                sm.AddState({"Idle", {}, {}});
+                sm.AddState({"Busy", {}, {}});
+                Transition work{"work", "Idle", "Busy"};
+                work.OnAfter = [&router, key](const TransitionContext&) {
+                    if (key.GetCount() < 4)
+                        router.Post(key + "x", "work");
+                };
+                sm.AddTransition(work);
+            };
+
+            router.Post("a", "work");
+            for (int round = 0; round < 8; ++round)
+                for (int i = 0; i < 2; ++i)
+                    router.Pump(i);
+            ctx.Check(router.GetCount() == 4, "The chain a, ax, axx, axxx should be created");
+            const StateMachine* last = router.GetShard(router.GetShardIndex("axxx")).Find("axxx");
+            ctx.Check(last && last->GetCurrent() == "Busy", "The last link should have run");
+        });
+
+        add("Rebalancing keeps instances, stamps and pending events", [define](TestContext& ctx) {
+            ShardedRouter router;
+            int64 now = 0;
+            router.SetClock([&] { return now; });
+            router.WhenCreate = define;
+            router.SetShardCount(3);
+            for (int i = 0; i < 30; ++i) {
+                now = i;
+                router.Post(AsString(i), "work");
+                router.Pump(router.GetShardIndex(AsString(i)));
+            }
+            router.Post("5", "rest");
+
+            ctx.Check(router.SetShardCount(5), "Rebalance should succeed");
+            ctx.Check(router.GetCount() == 30, "No instance should be lost");
+            bool ok = true;
+            for (int i = 0; i < 30; ++i) {
+                const EventRouter& shard = router.GetShard(router.GetShardIndex(AsString(i)));
+                const StateMachine* sm = shard.Find(AsString(i));
+                ok = sm && sm->GetCurrent() == "Busy" && sm->GetHistoryCount() == 2 && ok;
+            }
+            ctx.Check(ok, "Instances should keep their runtime state");
+
+            for (int i = 0; i < 5; ++i)
+                router.Pump(i);
+            const StateMachine* five = router.GetShard(router.GetShardIndex("5")).Find("5");
+            ctx.Check(five && five->GetCurrent() == "Idle", "Pending event should follow its key");
+
+            now = 100;
+            ok = true;
+            for (int i = 0; i < 5; ++i) {
+                Vector<int> stale = router.GetShard(i).GetStale("Busy", 0);
+                for (int j = 1; j < stale.GetCount(); ++j)
+                    ok = router.GetShard(i).GetEnteredAt(stale[j - 1]) <= router.GetShard(i).GetEnteredAt(stale[j]) && ok;
+            }
+            ctx.Check(ok, "State lists should stay in entry-time order");
+        });
+
+        add("Full rings refuse posts", [define](TestContext& ctx) {
+            ShardedRouter router;
+            router.WhenCreate = define;
+            router.SetRingCapacity(2);
+            router.SetShardCount(1);
+            ctx.Check(router.Post("a", "work") && router.Post("b", "work"), "Two posts should fit");
+            ctx.Check(!router.Post("c", "work"), "Third post should be refused");
+            ctx.Check(router.Pump(0) == 2, "Pump should take both");
+            ctx.Check(router.Post("c", "work"), "Space should be free again");
+        });
+
+        add("Workers process posts until stopped", [define](TestContext& ctx) {
+            ShardedRouter router;
+            router.WhenCreate = define;
+            router.SetShardCount(4);
+            ctx.Check(router.Start(), "Start() should succeed");
+            ctx.Check(!router.SetShardCount(2), "Rebalancing while running should fail");
+            ctx.Check(router.GetLastError() == StateMachineError::AlreadyStarted, "Running workers should report AlreadyStarted");
+            for (int i = 0; i < 2000; ++i)
+                while (!router.Post(AsString(i % 100), (i / 100) % 2 ? "rest" : "work"))
+                    Sleep(0);
+            router.Stop();
+            ctx.Check(!router.IsRunning(), "Stop() should join the workers");
+            ctx.Check(router.GetCount() == 100, "Every key should have an instance");
+            int idle = 0;
+            for (int i = 0; i < 4; ++i)
+                idle += router.GetShard(i).GetMemberCount("Idle");
+            ctx.Check(idle == 100, "Every instance should end Idle after work/rest pairs");
+        });
+
+        add("Idle workers flush aged enter batches", [](TestContext& ctx) {
+            ShardedRouter router;
+            router.WhenCreate = [](StateMachine& sm, const String&) {
+                sm.SetInitial("Idle");
+                sm.AddState({"Idle", {}, {}});
+                sm.AddState({"Persisting", [](StateMachine&, Function<void(bool)>) {}, {}});
+                sm.AddTransition({"save", "Idle", "Persisting"});
+            };
+            std::atomic<int> entered{0};
+            router.SetEnterBatch("Persisting", [&](const String&, const Vector<int>& instances, auto done) {
+                for (int i = 0; i < instances.GetCount(); ++i)
+                    done(i, true);
+                entered += instances.GetCount();
+            }, 1000, 2000);
+            router.SetShardCount(2);
+            ctx.Check(router.Start(), "Start() should succeed");
+            for (int i = 0; i < 10; ++i)
+                router.Post(AsString(i), "save");
+            for (int n = 0; n < 5000 && entered < 10; ++n)
+                Sleep(1);
+            ctx.Check(entered == 10, "Partial batches should be handed out once they age");
+            router.Stop();
+            int members = 0;
+            for (int i = 0; i < 2; ++i)
+                members += router.GetShard(i).GetMemberCount("Persisting");
+            ctx.Check(members == 10, "Every entry should have completed");
+        });
+    });
+
+    RunGroup("NUMA placement", passed, failed, [&](auto add) {
+        add("Kernel CPU lists parse ranges and singles", [](TestContext& ctx) {
+            Vector<int> cpus = NumaTopology::ParseList("0-3,8,10-11\n");
+            ctx.Check(cpus.GetCount() == 7, "Seven CPUs should be listed");
+            ctx.Check(cpus[0] == 0 && cpus[3] == 3 && cpus[4] == 8 && cpus[6] == 11, "Ranges should expand in order");
+            ctx.Check(NumaTopology::ParseList("").IsEmpty(), "Empty list should parse to nothing");
+        });
+
+        add("Topology always has a node with CPUs", [](TestContext& ctx) {
+            NumaTopology topology;
+            topology.Load();
+            ctx.Check(topology.GetNodeCount() >= 1, "At least one node should exist");
+            ctx.Check(!topology.GetCpus(0).IsEmpty(), "Node 0 should have CPUs");
+            ctx.Check(topology.GetNodeOfCpu(topology.GetCpus(0)[0]) == 0, "CPU lookup should find its node");
+            ctx.Check(topology.GetNodeOfCpu(-1) == -1, "Unknown CPU should have no node");
+            ctx.Check(!NumaTopology::PinCurrentThread(-1), "A negative CPU id should not be pinned");
+            ctx.Check(!NumaTopology::PinCurrentThread(1 << 20), "A CPU id past the affinity mask should not be pinned");
+        });
+
+        add("Re-homing a machine keeps its queue and history", [](TestContext& ctx) {
+            Function<void(bool)> finish_exit;
+            StateMachine sm;
+            sm.SetInitial("A");
+            sm.SetEventPolicy(EventPolicy::QueueWhileTransitioning);
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { finish_exit = pick(done); }});
+            sm.AddState({"B", {}, {}});
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"stay", "B", "B"});
+            sm.Start();
+            sm.TriggerEvent("go");
+            sm.TriggerEvent("stay");
+            sm.Rehome();
+            ctx.Check(sm.GetQueuedEventCount() == 1 && sm.GetHistoryCount() == 1, "Queue and history should survive");
+            finish_exit(true);
+            ctx.Check(sm.GetCurrent() == "B" && sm.GetHistoryCount() == 3, "The queued event should still run");
+        });
+
+        add("NUMA-aware shards are placed and keep working", [](TestContext& ctx) {
+            ShardedRouter router;
+            router.WhenCreate = [](StateMachine& sm, const String&) {
+                sm.SetInitial("Idle");
+                sm.AddState({"Idle", {}, {}});
+                sm.AddState({"Busy", {}, {}});
+                sm.AddTransition({"work", "Idle", "Busy"});
+            };
+            router.SetShardCount(4);
+            for (int i = 0; i < 40; ++i)
+                router.Post(AsString(i), "work");
+            ctx.Check(router.GetShardNode(0) == -1, "Placement should be unknown before Start()");
+            ctx.Check(router.SetNumaAware(), "SetNumaAware() should succeed while stopped");
+            ctx.Check(router.Start(), "Start() should succeed");
+            ctx.Check(!router.SetNumaAware(false), "Placement cannot change while running");
+            bool placed = true;
+            for (int i = 0; i < 4; ++i)
+                placed = router.GetShardCpu(i) >= 0 && router.GetShardNode(i) >= 0 && placed;
+            ctx.Check(placed, "Every shard should have a CPU on a known node");
+            for (int i = 40; i < 80; ++i)
+                while (!router.Post(AsString(i), "work"))
+                    Sleep(0);
+            router.Stop();
+            int busy = 0;
+            for (int i = 0; i < 4; ++i)
+                busy += router.GetShard(i).GetMemberCount("Busy");
+            ctx.Check(busy == 80, "Events posted before and after re-homing should all arrive");
+        });
+    });
+
+    RunGroup("OpenMetrics export", passed, failed, [&](auto add) {
+        auto define = [](StateMachine& sm, const String&) {
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Busy", {}, {}});
+            sm.AddTransition({"work", "Idle", "Busy"});
+            sm.AddTransition({"rest", "Busy", "Idle"});
+        };
+
+        add("Error names match enumerators", [](TestContext& ctx) {
+            ctx.Check(String(GetStateMachineErrorName(StateMachineError::None)) == "None", "None should be named");
+            ctx.Check(String(GetStateMachineErrorName(StateMachineError::EventQueueFull)) == "EventQueueFull", "EventQueueFull should be named");
+            ctx.Check(String(GetStateMachineErrorName(StateMachineError(STATE_MACHINE_ERROR_COUNT - 1))) != "Unknown", "Last enumerator should be covered");
+        });
+
+        add("Exporter renders machine and router families", [define](TestContext& ctx) {
+            StateMachine sm;
+            define(sm, "");
+            sm.Start();
+            sm.TriggerEvent("work");
+            sm.TriggerEvent("missing");
+
+            EventRouter router;
+            router.WhenCreate = define;
+            router.Route("a", "work");
+            router.Route("b", "work");
+            router.Route("b", "rest");
+            router.Route("", "work");
+
+            OpenMetricsExporter exporter;
+            exporter.AddMachine("single", sm);
+            exporter.AddRouter("pool", router);
+            exporter.Render();
+            String text = exporter.ToString();
+
+            ctx.Check(text.Find("# TYPE statemachine_instances gauge\n") >= 0, "Gauge family should be declared");
+            ctx.Check(text.Find("statemachine_instances{source=\"single\",state=\"Busy\"} 1\n") >= 0, "Machine state should be exported");
+            ctx.Check(text.Find("statemachine_instances{source=\"pool\",state=\"Busy\"} 1\n") >= 0, "Router Busy count should be exported");
+            ctx.Check(text.Find("statemachine_instances{source=\"pool\",state=\"Idle\"} 1\n") >= 0, "Router Idle count should be exported");
+            ctx.Check(text.Find("statemachine_state_entries_total{source=\"pool\",state=\"Idle\"} 3\n") >= 0, "Idle entries should count starts and returns");
+            ctx.Check(text.Find("statemachine_transitions_total{source=\"single\"} 1\n") >= 0, "Machine transitions should be exported");
+            ctx.Check(text.Find("statemachine_transitions_total{source=\"pool\"} 3\n") >= 0, "Router transitions should be summed");
+            ctx.Check(text.Find("statemachine_errors_total{source=\"pool\",error=\"EmptyRouteKey\"} 1\n") >= 0, "Router errors should be counted");
+            ctx.Check(text.Find("statemachine_last_error{source=\"single\",error=\"NoMatchingTransition\"} 1\n") >= 0, "Machine last error should be exported");
+            ctx.Check(text.Find("statemachine_last_error{source=\"single\",error=\"None\"} 0\n") >= 0, "Other machine errors should be zero");
+            ctx.Check(text.Find("statemachine_last_error{source=\"pool\",error=\"None\"} 2\n") >= 0, "Router instances should be counted by last error");
+            ctx.Check(text.Find("# UNIT statemachine_queue_wait_microseconds microseconds\n") >= 0, "Histogram unit should be declared");
+            ctx.Check(text.Find("statemachine_queue_wait_microseconds_bucket{source=\"pool\",le=\"+Inf\"} 0\n") >= 0, "Histogram should end at +Inf");
+            ctx.Check(text.EndsWith("# EOF\n"), "Output should end with EOF");
+            ctx.Check(text.Find("# TYPE statemachine_instances") == text.Find("# TYPE statemachine_instances gauge"), "Each family should be declared once");
+
+            const int length = exporter.GetLength();
+            exporter.Render();
+            ctx.Check(exporter.GetLength() == length, "Rendering again should replace the previous text");
+        });
+
+        add("Router labels follow state ids and totals can be skipped", [](TestContext& ctx) {
+            EventRouter router;
+            router.WhenCreate = [](StateMachine& sm, const String& key) {
+                sm.SetInitial(key);
+                sm.AddState({key, {}, {}});
+            };
+            router.Route("old", "x");
+            OpenMetricsExporter exporter;
+            exporter.AddRouter("pool", router);
+            exporter.Render();
+
+            router.Clear();
+            router.Route("new", "x");
+            exporter.SetInstanceTotals(false);
+            exporter.Render();
+            String text = exporter.ToString();
+            ctx.Check(text.Find("statemachine_instances{source=\"pool\",state=\"new\"} 1\n") >= 0, "Cleared router should export its new state id");
+            ctx.Check(text.Find("state=\"old\"") < 0, "Stale state labels should not be reused");
+            ctx.Check(text.Find("statemachine_transitions_total{") < 0, "Instance totals should be skipped");
+            ctx.Check(text.Find("statemachine_queue_wait_microseconds_bucket{") < 0, "Queue histograms should be skipped");
+            ctx.Check(text.Find("statemachine_errors_total{source=\"pool\"") >= 0, "Router counters should remain");
+        });
+
+        add("Label values are escaped", [](TestContext& ctx) {
+            StateMachine sm;
+            sm.SetInitial("a\"b\\c");
+            sm.AddState({"a\"b\\c", {}, {}});
+            sm.Start();
+            OpenMetricsExporter exporter;
+            exporter.AddMachine("m\n1", sm);
+            exporter.Render();
+            ctx.Check(exporter.ToString().Find("statemachine_instances{source=\"m\\n1\",state=\"a\\\"b\\\\c\"} 1\n") >= 0, "Quotes, backslashes and newlines should be escaped");
+        });
+
+        add("Responder serves metrics to a loopback client", [](TestContext& ctx) {
+            StateMachine sm;
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.Start();
+            OpenMetricsExporter exporter;
+            exporter.AddMachine("single", sm);
+            OpenMetricsResponder responder(exporter);
+
+            int port = 0;
+            for (int attempt = 0; attempt < 20 && !port; ++attempt) {
+                const int candidate = 40000 + int((usecs() + 7919 * attempt) % 20000);
+                if (responder.Listen(candidate))
+                    port = candidate;
+            }
+            ctx.Check(port > 0, "Responder should listen on a loopback port");
+
+            TcpSocket client;
+            ctx.Check(client.Connect("127.0.0.1", port), "Client should connect");
+            client.Timeout(2000);
+            client.PutAll("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+            ctx.Check(responder.ServeOne(2000), "Responder should serve the request");
+            ctx.Check(client.GetLine() == "HTTP/1.1 200 OK", "Status should be 200");
+            int length = -1;
+            for (;;) {
+                String header = client.GetLine();
+                if (header.IsEmpty())
+                    break;
+                if (header.StartsWith("Content-Length: "))
+                    length = atoi(header.Mid(16));
+            }
+            ctx.Check(length == exporter.GetLength(), "Content-Length should match the rendered text");
+            String body = client.GetAll(length);
+            ctx.Check(body.Find("statemachine_instances{source=\"single\",state=\"Idle\"} 1") >= 0, "Body should hold the metrics");
+
+            TcpSocket other;
+            other.Connect("127.0.0.1", port);
+            other.Timeout(2000);
+            other.PutAll("GET / HTTP/1.1\r\n\r\n");
+            responder.ServeOne(2000);
+            ctx.Check(other.GetLine() == "HTTP/1.1 404 Not Found", "Other paths should get 404");
+            ctx.Check(!responder.ServeOne(10), "Nothing else should be pending");
+            responder.Close();
+        });
+    });
+
+    RunGroup("Shared state view", passed, failed, [&](auto add) {
+        auto define = [](StateMachine& sm, const String&) {
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Busy", {}, {}});
+            sm.AddTransition({"work", "Idle", "Busy"});
+            sm.AddTransition({"rest", "Busy", "Idle"});
+        };
+        auto segment = [](const char* tag) {
+            return Format("/statemachine_test_%s_%d", tag, int(usecs() % 1000000));
+        };
+
+        add("Reader sees router states, counters and keys", [define, segment](TestContext& ctx) {
+            const String name = segment("router");
+            SharedStateView writer;
+            ctx.Check(writer.Create(name, 16, 8, 8), "Writer should create the segment");
+            EventRouter router;
+            router.WhenCreate = define;
+            router.SetSharedView(&writer);
+            router.Route("a", "work");
+            router.Route("b", "work");
+            router.Route("b", "rest");
+            router.Route("long-key-here", "work");
+
+            SharedStateView reader;
+            ctx.Check(reader.Open(name), "Reader should open the segment");
+            ctx.Check(!reader.IsWriter(), "Reader should not be a writer");
+            ctx.Check(reader.GetInstanceCount() == 3, "Every instance should be published");
+
+            Vector<SharedStateSample> states;
+            ctx.Check(reader.ReadStates(states), "State table should be readable");
+            ctx.Check(states.GetCount() == 2, "Both states should be published");
+            int idle = -1;
+            for (int i = 0; i < states.GetCount(); ++i)
+                if (states[i].id == "Idle")
+                    idle = i;
+            ctx.Check(idle >= 0 && states[idle].members == 1 && states[idle].entries == 4, "Idle counters should match the router");
+            ctx.Check(states[1 - idle].members == 2 && states[1 - idle].entries == 3, "Busy counters should match the router");
+
+            SharedInstanceSample b;
+            ctx.Check(reader.ReadInstance(1, b), "Instance should be readable");
+            ctx.Check(b.state == idle && b.transitions == 2, "Instance should carry its state and transition count");
+            ctx.Check(reader.ReadKey(0) == "a", "Keys should be published");
+            ctx.Check(reader.ReadKey(2) == "long-key", "Long keys should be truncated");
+
+            Vector<SharedInstanceSample> all;
+            ctx.Check(reader.ReadInstances(1, 10, all) == 2, "Range reads should clip to the instance count");
+            ctx.Check(all.GetCount() == 2 && all[0].valid && all[1].valid, "Each instance should get a valid slot");
+            ctx.Check(all[0].state == b.state && all[0].transitions == b.transitions, "Slot k should be instance from + k");
+            reader.SetInstance(0, idle, 99);
+            SharedInstanceSample a;
+            ctx.Check(reader.ReadInstance(0, a) && a.transitions == 1, "Readers should not write");
+        });
+
+        add("Attach, clear and overflow", [define, segment](TestContext& ctx) {
+            const String name = segment("attach");
+            EventRouter router;
+            router.WhenCreate = define;
+            router.Route("a", "work");
+            router.Route("b", "work");
+            router.Route("c", "work");
+
+            SharedStateView view;
+            ctx.Check(view.Create(name, 2, 1), "View should be created");
+            router.SetSharedView(&view);
+            ctx.Check(view.GetInstanceCount() == 2, "Instances beyond capacity should be left out");
+            ctx.Check(view.GetOverflowCount() == 2, "Missing instances and states should be counted");
+            Vector<SharedStateSample> states;
+            ctx.Check(view.ReadStates(states) && states.GetCount() == 1, "Only the first state should fit");
+            ctx.Check(view.ReadKey(0).IsEmpty(), "No keys should be published without a key length");
+
+            router.Clear();
+            ctx.Check(view.GetInstanceCount() == 0 && view.GetStateCount() == 0, "Clear should reset the view");
+            ctx.Check(view.GetOverflowCount() == 0, "Clear should reset the overflow");
+            router.Route("d", "work");
+            ctx.Check(view.GetInstanceCount() == 1, "New instances should be published after a clear");
+
+            router.SetSharedView(nullptr);
+            router.Route("e", "work");
+            ctx.Check(view.GetInstanceCount() == 1, "A detached view should not change");
+
+            SharedStateView missing;
+            ctx.Check(!missing.Open(segment("missing")), "Opening an unknown segment should fail");
+            ctx.Check(!view.Create(name, 0, 1), "Zero capacity should be rejected");
+        });
+
+        add("Readers get consistent records during writes", [segment](TestContext& ctx) {
+            const String name = segment("seqlock");
+            SharedStateView writer;
+            ctx.Check(writer.Create(name, 4, 2), "Writer should create the segment");
+            writer.SetStateId(0, "Even");
+            writer.SetStateId(1, "Odd");
+            writer.SetStateCounts(0, 4, 0);
+            for (int i = 0; i < 4; ++i)
+                writer.SetInstance(i, 0, 0);
+            writer.SetInstanceCount(4);
+
+            SharedStateView reader;
+            ctx.Check(reader.Open(name), "Reader should open the segment");
+            std::atomic<bool> done{false};
+            Thread worker;
+            worker.Run([&] {
+                for (int64 n = 4; n < 200004; ++n)
+                    writer.Commit(int(n % 4), int((n / 4 + 1) % 2), int((n / 4) % 2), n / 4);
+                done = true;
+            });
+
+            int torn = 0;
+            int reads = 0;
+            while (!done || reads < 1000) {
+                SharedInstanceSample s;
+                if (reader.ReadInstance(reads % 4, s) && s.state != int(s.transitions % 2))
+                    ++torn;
+                Vector<SharedStateSample> states;
+                if (reader.ReadStates(states) && states[0].members + states[1].members != 4)
+                    ++torn;
+                ++reads;
+            }
+            worker.Wait();
+            ctx.Check(torn == 0, "Every accepted read should be consistent");
+        });
+    });
+
+    RunGroup("Choice transitions", passed, failed, [&](auto add) {
+        auto guarded = [](const char* event, const char* from, const char* to, const bool* flag) {
+            Transition t;
+            t.event = event;
+            t.from = from;
+            t.to = to;
+            t.Guard = [flag](const TransitionContext&) { return *flag; };
+            return t;
+        };
+
+        add("First passing candidate wins in one dispatch", [guarded](TestContext& ctx) {
+            bool to_a = false;
+            bool to_b = true;
+            Vector<String> targets;
+            StateMachine sm;
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", {}, {}});
+            sm.AddState({"C", {}, {}});
+            ctx.Check(sm.AddChoice(guarded("go", "Idle", "A", &to_a)), "First candidate should be accepted");
+            Transition to_b_transition = guarded("go", "Idle", "B", &to_b);
+            to_b_transition.OnBefore = [&](const TransitionContext& tc) { targets.Add(tc.toState); };
+            ctx.Check(sm.AddChoice(to_b_transition), "Second candidate should be accepted");
+            ctx.Check(sm.AddChoice({"go", "Idle", "C"}), "Unguarded default should be accepted");
+            sm.AddTransition({"back", "A", "Idle"});
+            sm.AddTransition({"back", "B", "Idle"});
+            sm.AddTransition({"back", "C", "Idle"});
+            ctx.Check(sm.GetChoiceCount("Idle", "go") == 3, "Pair should hold three candidates");
+            ctx.Check(sm.GetTransitionCount() == 6, "Candidates should count as transitions");
+            ctx.Check(sm.Start(), "Start() should return true");
+
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "B", "Second candidate should be taken");
+            ctx.Check(targets.GetCount() == 1 && targets[0] == "B", "Hooks should see the chosen target");
+            ctx.Check(sm.GetHistoryCount() == 2, "A choice should record a single step");
+            sm.TriggerEvent("back");
+
+            to_b = false;
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "C", "Default should be taken when guards fail");
+            sm.TriggerEvent("back");
+
+            to_a = true;
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "A", "Earlier candidates should win");
+            ctx.Check(sm.GetDispatchCacheHits() > 0, "Cached dispatch should still resolve choices");
+        });
+
+        add("No passing candidate rejects the event", [guarded](TestContext& ctx) {
+            bool pass = false;
+            StateMachine sm;
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", {}, {}});
+            sm.AddChoice(guarded("go", "Idle", "A", &pass));
+            sm.AddChoice(guarded("go", "Idle", "B", &pass));
+            sm.Start();
+            ctx.Check(!sm.TriggerEvent("go"), "Event should be rejected");
+            ctx.Check(sm.GetLastError() == StateMachineError::GuardRejected, "Error should be GuardRejected");
+            ctx.Check(sm.GetCurrent() == "Idle", "State should not change");
+        });
+
+        add("Candidates after a default and duplicates are rejected", [guarded](TestContext& ctx) {
+            bool pass = true;
+            StateMachine sm;
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"A", {}, {}});
+            sm.AddState({"B", {}, {}});
+            ctx.Check(sm.AddTransition(guarded("go", "Idle", "A", &pass)), "Guarded transition should be accepted");
+            ctx.Check(sm.AddChoice({"go", "Idle", "B"}), "A choice should extend a guarded transition");
+            ctx.Check(!sm.AddChoice(guarded("go", "Idle", "A", &pass)), "Nothing may follow the default");
+            ctx.Check(sm.GetLastError() == StateMachineError::DuplicateTransition, "Error should be DuplicateTransition");
+            ctx.Check(!sm.AddTransition({"go", "Idle", "B"}), "AddTransition should still reject the pair");
+            ctx.Check(!sm.AddChoice({"go", "Idle", "Missing"}), "Missing targets should be rejected");
+            ctx.Check(sm.GetLastError() == StateMachineError::MissingToState, "Error should be MissingToState");
+            ctx.Check(sm.GetChoiceCount("Idle", "stop") == 0, "Unknown pairs should have no candidates");
+
+            sm.Clear();
+            ctx.Check(sm.GetTransitionCount() == 0, "Clear() should drop candidates");
+        });
+
+        add("Choices inside a sub-machine definition", [guarded](TestContext& ctx) {
+            bool retry = false;
+            StateMachine def;
+            def.SetInitial("Try");
+            def.AddState({"Try", {}, {}});
+            def.AddState({"Wait", {}, {}});
+            def.AddState({"Failed", {}, {}});
+            def.AddChoice(guarded("fail", "Try", "Wait", &retry));
+            def.AddChoice({"fail", "Try", "Failed"});
+
+            StateMachine sm;
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddSubMachine("job", def);
+            sm.AddTransition({"run", "Idle", "job"});
+            sm.Start();
+            sm.TriggerEvent("run");
+            ctx.Check(sm.TriggerEvent("fail") && sm.GetCurrent() == "job.Failed", "Instance should take the definition's default");
+        });
+    });
+
+    RunGroup("Definition import", passed, failed, [&](auto add) {
+        add("JSON definition loads and binds by name", [](TestContext& ctx) {
+            const char* json = R"({
+                "initial": "Idle",
+                "states": [
+                    { "id": "Idle", "onEnter": "enterIdle" },
+                    "Running",
+                    { "id": "Done", "note": [1, {"x": true}] }
+                ],
+                "transitions": [
+                    { "event": "start", "from": "Idle", "to": "Running", "guard": "canStart", "after": "log" },
+                    { "event": "finish", "from": "Running", "to": "Done", "before": "log" }
+                ]
+            })";
+            StateMachine sm;
+            DefinitionImporter importer;
+            ctx.Check(importer.LoadJson(sm, json), "LoadJson() should return true");
+            ctx.Check(sm.GetStateCount() == 3 && sm.GetTransitionCount() == 2, "Machine should hold the definition");
+            ctx.Check(importer.GetBindingCount() == 3, "Three elements should reference callbacks");
+
+            int entered = 0;
+            Vector<String> log;
+            CallbackRegistry registry;
+            registry.AddStateCallback("enterIdle", [&](StateMachine&, Function<void(bool)> done) { ++entered; done(true); });
+            registry.AddGuard("canStart", [](const TransitionContext&) { return true; });
+            registry.AddAction("log", [&](const TransitionContext& tc) { log.Add(tc.event); });
+            ctx.Check(importer.Bind(sm, registry), "Bind() should return true");
+
+            ctx.Check(sm.Start() && sm.GetCurrent() == "Idle", "Machine should start in the initial state");
+            ctx.Check(entered == 1, "Bound OnEnter should run");
+            ctx.Check(sm.TriggerEvent("start") && sm.TriggerEvent("finish"), "Imported transitions should fire");
+            ctx.Check(sm.GetCurrent() == "Done", "Machine should end in Done");
+            ctx.Check(log.GetCount() == 2 && log[0] == "start" && log[1] == "finish", "Bound actions should run");
+        });
+
+        add("SCXML definition maps document order onto choices", [](TestContext& ctx) {
+            const char* scxml = R"(<?xml version="1.0"?>
+                <scxml xmlns="http://www.w3.org/2005/07/scxml" version="1.0" initial="Idle">
+                    <state id="Idle">
+                        <onentry><script>enterIdle</script></onentry>
+                        <transition event="go retry" cond="isFast" target="Fast"/>
+                        <transition event="go retry" target="Slow"><script>log</script></transition>
+                    </state>
+                    <state id="Fast"><transition event="back" target="Idle"/></state>
+                    <state id="Slow"><transition event="back" target="Idle"/></state>
+                    <final id="Done"/>
+                </scxml>)";
+            StateMachine sm;
+            DefinitionImporter importer;
+            ctx.Check(importer.LoadScxml(sm, scxml), "LoadScxml() should return true");
+            ctx.Check(sm.GetStateCount() == 4, "Final states should be imported");
+            ctx.Check(sm.GetChoiceCount("Idle", "go") == 2 && sm.GetChoiceCount("Idle", "retry") == 2,
+                      "Each listed event should get both candidates");
+
+            bool fast = true;
+            int logged = 0;
+            CallbackRegistry registry;
+            registry.AddStateCallback("enterIdle", [](StateMachine&, Function<void(bool)> done) { done(true); });
+            registry.AddGuard("isFast", [&](const TransitionContext&) { return fast; });
+            registry.AddAction("log", [&](const TransitionContext&) { ++logged; });
+            ctx.Check(importer.Bind(sm, registry), "Bind() should return true");
+            sm.Start();
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "Fast", "Passing cond should win");
+            sm.TriggerEvent("back");
+            fast = false;
+            ctx.Check(sm.TriggerEvent("retry") && sm.GetCurrent() == "Slow", "Unguarded default should follow");
+            ctx.Check(logged == 1, "Transition script should bind as OnBefore");
+        });
+
+        add("Invalid definitions fail and leave the machine empty", [](TestContext& ctx) {
+            StateMachine sm;
+            DefinitionImporter importer;
+            ctx.Check(!importer.LoadJson(sm, "{\n\"states\": [\"A\",\n\"B\" \"C\" : ]\n}"), "Syntax errors should fail");
+            ctx.Check(importer.GetLastError() == StateMachineError::InvalidDefinition, "Error should be InvalidDefinition");
+            ctx.Check(importer.GetErrorText().Find("3") >= 0, "Text should carry the line");
+            ctx.Check(sm.GetStateCount() == 0, "Machine should be cleared");
+
+            ctx.Check(!importer.LoadJson(sm, R"({"states": ["A", "A"]})"), "Duplicate states should fail");
+            ctx.Check(importer.GetLastError() == StateMachineError::DuplicateStateId, "Error should be DuplicateStateId");
+
+            ctx.Check(!importer.LoadJson(sm, R"({"states": ["A"], "transitions": [{"event": "go", "from": "A", "to": "B"}]})"),
+                      "Undeclared targets should fail");
+            ctx.Check(importer.GetLastError() == StateMachineError::MissingState, "Error should be MissingState");
+            ctx.Check(importer.GetErrorText().Find("'B'") >= 0, "Text should name the state");
+
+            ctx.Check(!importer.LoadJson(sm, R"({"states": ["A", "B"], "transitions": [
+                {"event": "go", "from": "A", "to": "B"}, {"event": "go", "from": "A", "to": "A"}]})"),
+                      "Transitions after an unguarded one should fail");
+            ctx.Check(importer.GetLastError() == StateMachineError::DuplicateTransition, "Error should be DuplicateTransition");
+
+            ctx.Check(!importer.LoadScxml(sm, R"(<scxml><state id="A"><state id="B"/></state></scxml>)"),
+                      "Nested states should fail");
+            ctx.Check(importer.GetLastError() == StateMachineError::InvalidDefinition, "Error should be InvalidDefinition");
+            ctx.Check(sm.GetStateCount() == 0, "Machine should still be empty");
+
+            sm.AddState({"Existing", {}, {}});
+            ctx.Check(!importer.LoadJson(sm, R"({"states": ["A"]})"), "Non-empty machines should be refused");
+            ctx.Check(sm.GetStateCount() == 1, "Existing definition should be kept");
+        });
+
+        add("Unbound callbacks are reported before anything binds", [](TestContext& ctx) {
+            StateMachine sm;
+            DefinitionImporter importer;
+            importer.LoadJson(sm, R"({"states": [{"id": "A", "onExit": "leave"}, "B"],
+                "transitions": [{"event": "go", "from": "A", "to": "B", "guard": "canGo"}]})");
+            int left = 0;
+            CallbackRegistry registry;
+            registry.AddStateCallback("leave", [&](StateMachine&, Function<void(bool)> done) { ++left; done(true); });
+            ctx.Check(!importer.Bind(sm, registry), "Bind() should fail");
+            ctx.Check(importer.GetLastError() == StateMachineError::UnboundCallback, "Error should be UnboundCallback");
+            ctx.Check(importer.GetErrorText() == "guard 'canGo'", "Text should name the callback");
+            sm.Start();
+            sm.TriggerEvent("go");
+            ctx.Check(left == 0, "Nothing should be bound after a failure");
+
+            StateMachine other;
+            ctx.Check(!importer.Bind(other, registry), "Other machines should be refused");
+        });
+
+        add("LoadFile detects the format", [](TestContext& ctx) {
+            String path = GetTempFileName("smdef");
+            StateMachine sm;
+            DefinitionImporter importer;
+            SaveFile(path, "\n  <scxml initial=\"B\"><state id=\"A\"/><state id=\"B\"/></scxml>");
+            ctx.Check(importer.LoadFile(sm, path) && sm.GetStateCount() == 2, "SCXML file should load");
+            ctx.Check(sm.Start() && sm.GetCurrent() == "B", "Declared initial should be used");
+
+            StateMachine json;
+            SaveFile(path, R"({"initial": "Missing", "states": ["A"]})");
+            ctx.Check(!importer.LoadFile(json, path), "Missing initial state should fail");
+            ctx.Check(importer.GetLastError() == StateMachineError::MissingState, "Error should be MissingState");
+            FileDelete(path);
+            ctx.Check(!importer.LoadFile(json, path), "Unreadable files should fail");
+        });
+    });
+
+    RunGroup("Fuzz regressions", passed, failed, [&](auto add) {
+        // Inputs kept from StateMachineFuzz, replayed at its two scales. CPU
+        // time cliffs are left to the fuzz driver; memory per call is
+        // deterministic, so it is checked here too.
+        auto replay = [](TestContext& ctx, const byte* data, int size) {
+            FuzzResult small = RunFuzzInput(data, size, 2);
+            FuzzResult large = RunFuzzInput(data, size, 16);
+            ctx.Check(small.ok, "Scale 2 invariant: " + small.failure);
+            ctx.Check(large.ok, "Scale 16 invariant: " + large.failure);
+            if (data[0] % FUZZ_TARGET_COUNT == FUZZ_MACHINE)
+                ctx.Check(large.operations > small.operations, "Larger scale should issue more calls");
+            double small_cost = double(small.memory) / max(small.operations, (int64)1);
+            double large_cost = double(large.memory) / max(large.operations, (int64)1);
+            ctx.Check(large_cost <= 3 * small_cost, Format("Memory per call should stay flat (%.0f vs %.0f)", large_cost, small_cost));
+        };
+
+        add("Held callbacks with a bounded queue", [replay](TestContext& ctx) {
+            static const byte seed[] = {
+                0x00, 0x04, 0x02,                   // machine, 6 states, 3 events
+                0x00, 0x00, 0x00, 0x01, 0x00,       // AddTransition e0 s0 -> s1
+                0x00, 0x01, 0x01, 0x00, 0x06,       // AddTransition e1 s1 -> s0
+                0x01, 0x02, 0x01, 0x02, 0x02,       // AddChoice e2 s1 -> s2
+                0x00, 0x02, 0x01, 0x03, 0x00,       // AddTransition e2 s1 -> s3, the default
+                0x02, 0x00, 0x00, 0x00, 0x00,       // Start
+                0x0a, 0x00, 0x00, 0x00, 0x02,       // QueueWhileTransitioning
+                0x09, 0x00, 0x00, 0x00, 0x03,       // SetMaxQueuedEvents
+                0x0b, 0x00, 0x00, 0x00, 0x03,       // Spill overflow
+                0x07, 0x00, 0x00, 0x00, 0x00,       // hold callbacks
+                0x03, 0x00, 0x00, 0x00, 0x00,       // TriggerEvent e0
+                0x03, 0x01, 0x00, 0x00, 0x00,       // TriggerEvent e1, queued
+                0x04, 0x00, 0x00, 0x00, 0x00,       // TriggerEvent e0, queued
+                0x08, 0x00, 0x00, 0x00, 0x01,       // complete held callbacks
+                0x07, 0x00, 0x00, 0x00, 0x00,       // release holds
+                0x08, 0x00, 0x00, 0x00, 0x01,
+                0x0c, 0x00, 0x00, 0x00, 0x00,       // guards fail
+                0x03, 0x00, 0x00, 0x00, 0x00,
+                0x03, 0x02, 0x00, 0x00, 0x00,       // e2 takes the default
+                0x06, 0x00, 0x00, 0x00, 0x00,       // GoBack
+                0x0e, 0x00, 0x00, 0x00, 0x01,       // Reset
+                0x0e, 0x00, 0x00, 0x00, 0x00,       // Clear
+            };
+            replay(ctx, seed, sizeof(seed));
+        });
+
+        add("Linear state lookup cliff", [replay](TestContext& ctx) {
+            // Reported at 22x per call when FindStateIndex() scanned the states
+            static const byte seed[] = {
+                0x8d, 0x84, 0x2b, 0x49, 0xa3, 0x7e, 0x46, 0x48, 0x98, 0x37, 0x2f, 0x71, 0xe3, 0x48,
+                0x12, 0x52, 0x50, 0x06, 0x5c, 0xc8, 0xf1, 0x7c, 0x46, 0xe2, 0x65, 0xe7, 0x8c, 0xf5,
+                0x6e, 0x90, 0xad, 0x26, 0x84, 0x45, 0x03, 0x85, 0x94, 0x7b, 0xcb, 0x0e, 0x20, 0x0c,
+                0xba, 0xd3, 0xd2, 0x57, 0xb5, 0x12, 0xd8, 0xf7, 0x86, 0xfb, 0xa6, 0x6b, 0xdd, 0x42,
+                0x88, 0xb9, 0xb2, 0xaf, 0x3c, 0xa6, 0xa9, 0x18, 0xd0, 0x01, 0x89, 0x0a, 0xa4, 0x5d,
+                0x1d, 0x9d, 0xdc, 0xed, 0x7c, 0x92, 0x45, 0xc5, 0xf8, 0x39, 0x7d, 0x51,
+            };
+            replay(ctx, seed, sizeof(seed));
+        });
+
+        add("Truncated and nested definitions", [replay](TestContext& ctx) {
+            static const char json[] = "\x01{\"states\": [\"A\", {\"id\": \"B\", \"onEnter\": \"\\u00e9\"}], \"transitions\": [{\"event\": ";
+            static const char scxml[] = "\x02<scxml><state id=\"A\"><transition event=\"go\" target=\"A\"/><parallel/></state></scxml>";
+            replay(ctx, (const byte*)json, sizeof(json) - 1);
+            replay(ctx, (const byte*)scxml, sizeof(scxml) - 1);
+        });
+    });
+
+    RunGroup("Batched entry", passed, failed, [&](auto add) {
+        auto define = [](StateMachine& sm, const String&) {
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Persisting", [](StateMachine&, Function<void(bool)>) {}, {}});
+            sm.AddState({"Saved", {}, {}});
+            sm.AddTransition({"save", "Idle", "Persisting"});
+            sm.AddTransition({"stored", "Persisting", "Saved"});
+        };
+
+        add("Entries are collected and flushed by count", [define](TestContext& ctx) {
+            EventRouter router;
+            router.WhenCreate = define;
+            Vector<int> sizes;
+            Vector<String> keys;
+            router.SetEnterBatch("Persisting", [&](const String&, const Vector<int>& instances, auto done) {
+                sizes.Add(instances.GetCount());
+                for (int i = 0; i < instances.GetCount(); ++i) {
+                    keys.Add(router.GetKey(instances[i]));
+                    done(i, true);
+                }
+            }, 3, 1000000);
+
+            for (int i = 0; i < 7; ++i)
+                router.Route(Format("k%d", i), "save");
+            ctx.Check(sizes.GetCount() == 2 && sizes[0] == 3 && sizes[1] == 3, "Two full batches should be handed out");
+            ctx.Check(keys.GetCount() == 6 && keys[0] == "k0" && keys[5] == "k5", "Batches should keep arrival order");
+            ctx.Check(router.GetMemberCount("Persisting") == 6, "Handled instances should commit");
+            ctx.Check(router.GetPendingEntryCount("Persisting") == 1, "The seventh entry should wait");
+            ctx.Check(router.Find("k6")->IsTransitioning(), "A waiting instance is still entering");
+            ctx.Check(!router.Route("k6", "stored"), "Events during a pending entry follow the policy");
+
+            ctx.Check(router.FlushEnterBatches() == 1 && sizes.Top() == 1, "Flush should hand out the rest");
+            ctx.Check(router.GetMemberCount("Persisting") == 7, "Every instance should be in");
+            ctx.Check(router.GetEnterBatchCount() == 3, "Three handler calls in total");
+            ctx.Check(router.Route("k6", "stored") && router.GetMemberCount("Saved") == 1, "Unbatched states enter as usual");
+        });
+
+        add("Age flush and fanned-out results", [define](TestContext& ctx) {
+            EventRouter router;
+            int64 now = 0;
+            router.SetClock([&] { return now; });
+            router.WhenCreate = define;
+            Function<void(int, bool)> finish;
+            Vector<int> batch;
+            router.SetEnterBatch("Persisting", [&](const String&, const Vector<int>& instances, auto done) {
+                batch = clone(instances);
+                finish = done;
+            }, 100, 500);
+
+            router.Route("a", "save");
+            now = 200;
+            router.Route("b", "save");
+            ctx.Check(router.RunEnterBatches() == 0, "Nothing should be due yet");
+            now = 500;
+            ctx.Check(router.RunEnterBatches() == 1 && batch.GetCount() == 2, "The oldest entry should trigger a flush");
+
+            router.Route("c", "save");
+            finish(1, false);
+            finish(0, true);
+            finish(0, false);
+            ctx.Check(router.GetMemberCount("Persisting") == 1, "Only the accepted entry should commit");
+            ctx.Check(router.Find("a")->GetCurrent() == "Persisting", "a should be in");
+            ctx.Check(router.Find("b")->GetCurrent() == "Idle" && router.Find("b")->GetLastError() == StateMachineError::EnterFailed,
+                      "b should stay with EnterFailed");
+            ctx.Check(router.GetPendingEntryCount("Persisting") == 1, "Later entries should be a new batch");
+        });
+
+        add("Initial entries and hook lifecycle", [define](TestContext& ctx) {
+            EventRouter router;
+            router.WhenCreate = [define](StateMachine& sm, const String& key) {
+                define(sm, key);
+                sm.SetInitial("Persisting");
+            };
+            // "save" has no transition out of Persisting; routing only creates
+            int calls = 0;
+            router.Route("a", "save");
+            router.SetEnterBatch("Persisting", [&](const String&, const Vector<int>& instances, auto done) {
+                ++calls;
+                for (int i = 0; i < instances.GetCount(); ++i)
+                    done(i, true);
+            }, 2, 1000000);
+            ctx.Check(router.GetMemberCount("Persisting") == 0, "a is still in its own OnEnter");
+
+            router.Route("b", "save");
+            router.Route("c", "save");
+            ctx.Check(calls == 1 && router.GetMemberCount("Persisting") == 2, "Start entries should be batched");
+
+            router.Route("d", "save");
+            router.RemoveEnterBatch("Persisting");
+            ctx.Check(calls == 2 && router.GetMemberCount("Persisting") == 3, "Removing should flush what was collected");
+            router.Route("e", "save");
+            ctx.Check(calls == 2 && router.GetMemberCount("Persisting") == 3, "Later entries use OnEnter again");
+
+            router.SetEnterBatch("Persisting", [&](const String&, const Vector<int>&, auto) { ++calls; }, 10, 1000000);
+            router.Route("f", "save");
+            Vector<EventRouter::Migrant> out;
+            router.Release(out);
+            ctx.Check(calls == 3, "Release should flush collected entries");
+            ctx.Check(out.GetCount() == 6, "Every instance should be released");
+        });
+
+        add("A sub-machine initial is batched under its qualified id", [define](TestContext& ctx) {
+            StateMachine flow;
+            define(flow, "");
+            flow.SetInitial("Persisting");
+            EventRouter router;
+            router.WhenCreate = [&flow](StateMachine& sm, const String&) {
+                sm.AddSubMachine("flow", flow);
+                sm.SetInitial("flow");
+            };
+            int calls = 0;
+            router.SetEnterBatch("flow.Persisting", [&](const String&, const Vector<int>& instances, auto done) {
+                ++calls;
+                for (int i = 0; i < instances.GetCount(); ++i)
+                    done(i, true);
+            }, 2, 1000000);
+            router.Route("a", "save");
+            router.Route("b", "save");
+            ctx.Check(calls == 1 && router.GetMemberCount("flow.Persisting") == 2, "The resolved initial should be batched");
+        });
+    });
+
+    RunGroup("Prepare hook", passed, failed, [&](auto add) {
+        add("Prepare overlaps the exit and gates the entry", [](TestContext& ctx) {
+            Vector<String> log;
+            Function<void(bool)> exit_done, prepare_done;
+            StateMachine sm;
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { log.Add("exit"); exit_done = done; }});
+            State b{"B", [&](StateMachine&, Function<void(bool)> done) { log.Add("enter"); done(true); }, {}};
+            b.Prepare = [&](StateMachine&, Function<void(bool)> done) { log.Add("prepare"); prepare_done = done; };
+            sm.AddState(pick(b));
+            sm.AddTransition({"go", "A", "B"});
+            sm.AddTransition({"back", "B", "A"});
+            sm.Start();
+
+            ctx.Check(sm.TriggerEvent("go"), "TriggerEvent() should start the transition");
+            ctx.Check(log.GetCount() == 2 && log[0] == "prepare" && log[1] == "exit", "Prepare should start before the exit");
+            exit_done(true);
+            ctx.Check(log.GetCount() == 2 && sm.IsTransitioning(), "Entry should wait for Prepare");
+            prepare_done(true);
+            ctx.Check(log.GetCount() == 3 && log[2] == "enter", "Entry should follow Prepare");
+            ctx.Check(sm.GetCurrent() == "B" && sm.GetHistoryCount() == 2, "Transition should commit once");
+
+            sm.TriggerEvent("back");
+            exit_done(true);
+            log.Clear();
+            sm.TriggerEvent("go");
+            prepare_done(true);
+            ctx.Check(log.GetCount() == 2, "A finished Prepare should not enter before the exit");
+            exit_done(true);
+            ctx.Check(log.GetCount() == 3 && sm.GetCurrent() == "B", "The exit should release the entry");
+        });
+
+        add("A failed exit discards the prepared work", [](TestContext& ctx) {
+            int entered = 0;
+            int discarded = 0;
+            Function<void(bool)> exit_done, prepare_done;
+            StateMachine sm;
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { exit_done = done; }});
+            State b{"B", [&](StateMachine&, Function<void(bool)> done) { ++entered; done(true); }, {}};
+            b.Prepare = [&](StateMachine&, Function<void(bool)> done) { prepare_done = done; };
+            b.Discard = [&](StateMachine&) { ++discarded; };
+            sm.AddState(pick(b));
+            sm.AddTransition({"go", "A", "B"});
+            sm.Start();
+
+            sm.TriggerEvent("go");
+            prepare_done(true);
+            exit_done(false);
+            ctx.Check(discarded == 1 && entered == 0, "Finished Prepare should be discarded");
+            ctx.Check(sm.GetCurrent() == "A" && sm.GetLastError() == StateMachineError::ExitFailed, "Exit failure should be reported");
+
+            sm.TriggerEvent("go");
+            exit_done(false);
+            ctx.Check(discarded == 1, "Nothing to discard while Prepare runs");
+            prepare_done(true);
+            ctx.Check(discarded == 2 && entered == 0, "A late Prepare should be discarded when it finishes");
+            ctx.Check(!sm.IsTransitioning(), "Machine should be idle");
+        });
+
+        add("A failed Prepare aborts the transition", [](TestContext& ctx) {
+            int entered = 0;
+            bool ready = false;
+            StateMachine sm;
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, {}});
+            State b{"B", [&](StateMachine&, Function<void(bool)> done) { ++entered; done(true); }, {}};
+            b.Prepare = [&](StateMachine&, Function<void(bool)> done) { done(ready); };
+            sm.AddState(pick(b));
+            sm.AddTransition({"go", "A", "B"});
+            sm.Start();
+
+            ctx.Check(sm.TriggerEvent("go"), "TriggerEvent() should accept the event");
+            ctx.Check(entered == 0 && sm.GetCurrent() == "A", "OnEnter should not run");
+            ctx.Check(sm.GetLastError() == StateMachineError::PrepareFailed, "Error should be PrepareFailed");
+            ready = true;
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "B" && entered == 1, "Prepared transition should succeed");
+        });
+
+        add("An immediate Prepare failure skips the exit", [](TestContext& ctx) {
+            int exited = 0;
+            bool ready = false;
+            StateMachine sm;
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, [&](StateMachine&, Function<void(bool)> done) { ++exited; done(true); }});
+            State b{"B", {}, {}};
+            b.Prepare = [&](StateMachine&, Function<void(bool)> done) { done(ready); };
+            sm.AddState(pick(b));
+            sm.AddTransition({"go", "A", "B"});
+            sm.Start();
+
+            ctx.Check(sm.TriggerEvent("go"), "TriggerEvent() should accept the event");
+            ctx.Check(exited == 0, "OnExit should not run");
+            ctx.Check(sm.GetCurrent() == "A" && !sm.IsTransitioning(), "Machine should stay idle in A");
+            ctx.Check(sm.GetLastError() == StateMachineError::PrepareFailed, "Error should be PrepareFailed");
+            ready = true;
+            ctx.Check(sm.TriggerEvent("go") && exited == 1 && sm.GetCurrent() == "B", "A prepared transition should exit once");
+        });
+
+        add("Start prepares the initial state first", [](TestContext& ctx) {
+            Vector<String> log;
+            bool ready = false;
+            StateMachine sm;
+            sm.SetInitial("A");
+            State a{"A", [&](StateMachine&, Function<void(bool)> done) { log.Add("enter"); done(true); }, {}};
+            a.Prepare = [&](StateMachine&, Function<void(bool)> done) { log.Add("prepare"); done(ready); };
+            sm.AddState(pick(a));
+            ctx.Check(sm.Start() && !sm.IsStarted(), "Failed Prepare should abort the start");
+            ctx.Check(sm.GetLastError() == StateMachineError::StartEnterFailed, "Error should be StartEnterFailed");
+            ready = true;
+            log.Clear();
+            ctx.Check(sm.Start() && sm.GetCurrent() == "A", "Start should succeed");
+            ctx.Check(log.GetCount() == 2 && log[0] == "prepare" && log[1] == "enter", "Prepare should run before OnEnter");
+        });
+    });
+
+    RunGroup("State resources", passed, failed, [&](auto add) {
+        add("Resources are kept across exits within the budget", [](TestContext& ctx) {
+            int loads = 0;
+            auto load = [&](StateMachine&, StateResource& out) {
+                ++loads;
+                out.data.Create<String>("table");
+                out.size = 100;
+                return true;
+            };
+            StateMachine sm;
+            sm.GetResourceCache().SetMaxSize(1000);
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            State work{"Work", [&](StateMachine& m, Function<void(bool)> done) {
+                String* table = m.GetResource<String>("Work");
+                done(table && *table == "table");
+            }, {}};
+            work.Load = load;
+            sm.AddState(pick(work));
+            sm.AddTransition({"go", "Idle", "Work"});
+            sm.AddTransition({"stop", "Work", "Idle"});
+            sm.Start();
+
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "Work", "OnEnter should see the loaded resource");
+            for (int i = 0; i < 5; ++i) {
+                sm.TriggerEvent("stop");
+                sm.TriggerEvent("go");
+            }
+            const StateResourceCache& cache = sm.GetResourceCache();
+            ctx.Check(loads == 1 && sm.GetCurrent() == "Work", "Revisits should reuse the held resource");
+            ctx.Check(cache.GetHits() == 5 && cache.GetMisses() == 1, "Hits and misses should be counted");
+            ctx.Check(cache.GetSize() == 100 && cache.GetPinnedCount() == 1, "The current state's resource should be pinned");
+            sm.TriggerEvent("stop");
+            ctx.Check(cache.GetPinnedCount() == 0 && cache.Has("Work"), "Leaving should unpin but keep the resource");
+        });
+
+        add("The least recently used resource is evicted over budget", [](TestContext& ctx) {
+            Vector<String> loaded, evicted;
+            StateMachine sm;
+            StateResourceCache& cache = sm.GetResourceCache();
+            cache.SetMaxSize(250);
+            cache.WhenEvict = [&](const String& key, StateResource&) { evicted.Add(key); };
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            for (const char* id : {"A", "B", "C"}) {
+                State s{id, {}, {}};
+                s.Load = [&loaded, id](StateMachine&, StateResource& out) {
+                    loaded.Add(id);
+                    out.data.Create<int>(0);
+                    out.size = 100;
+                    return true;
+                };
+                sm.AddState(pick(s));
+                sm.AddTransition({id, "Idle", id});
+                sm.AddTransition({"stop", id, "Idle"});
+            }
+            sm.Start();
+
+            for (const char* ev : {"A", "B", "A", "C"}) {
+                sm.TriggerEvent(ev);
+                sm.TriggerEvent("stop");
+            }
+            ctx.Check(loaded.GetCount() == 3, "Each resource should load once so far");
+            ctx.Check(evicted.GetCount() == 1 && evicted[0] == "B", "B should be the LRU victim");
+            ctx.Check(cache.GetSize() == 200 && cache.GetEvictions() == 1, "Held size should fit the budget");
+            sm.TriggerEvent("B");
+            ctx.Check(loaded.GetCount() == 4 && loaded[3] == "B", "An evicted resource should load again");
+            cache.SetMaxSize(0);
+            ctx.Check(cache.GetCount() == 1 && cache.Has("B"), "A pinned resource should survive a zero budget");
+        });
+
+        add("A failed load aborts the entry", [](TestContext& ctx) {
+            bool ready = false;
+            int entered = 0;
+            StateMachine sm;
+            sm.SetInitial("A");
+            sm.AddState({"A", {}, {}});
+            State b{"B", [&](StateMachine&, Function<void(bool)> done) { ++entered; done(true); }, {}};
+            b.Load = [&](StateMachine&, StateResource& out) { out.size = 10; return ready; };
+            sm.AddState(pick(b));
+            sm.AddTransition({"go", "A", "B"});
+            sm.Start();
+
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "A", "Machine should stay in the source");
+            ctx.Check(entered == 0 && sm.GetLastError() == StateMachineError::EnterFailed, "Load failure should fail the entry");
+            ctx.Check(sm.GetResourceCache().GetCount() == 0, "Nothing should be held");
+            ready = true;
+            ctx.Check(sm.TriggerEvent("go") && sm.GetCurrent() == "B" && entered == 1, "Loaded entry should succeed");
+
+            StateMachine bad;
+            bad.SetInitial("B");
+            State init{"B", {}, {}};
+            init.Load = [](StateMachine&, StateResource&) { return false; };
+            bad.AddState(pick(init));
+            ctx.Check(bad.Start() && !bad.IsStarted(), "Failed initial load should abort the start");
+            ctx.Check(bad.GetLastError() == StateMachineError::StartEnterFailed, "Error should be StartEnterFailed");
+        });
+
+        add("Machines can share one cache", [](TestContext& ctx) {
+            int loads = 0;
+            StateResourceCache shared;
+            shared.SetMaxSize(1 << 20);
+            {
+                Array<StateMachine> pool;
+                for (int i = 0; i < 3; ++i) {
+                    StateMachine& sm = pool.Add();
+                    ctx.Check(sm.SetResourceCache(&shared), "SetResourceCache() should succeed before Start()");
+                    sm.SetInitial("Idle");
+                    sm.AddState({"Idle", {}, {}});
+                    State model{"Model", {}, {}};
+                    model.Load = [&](StateMachine&, StateResource& out) {
+                        ++loads;
+                        out.data.Create<Vector<int>>().SetCount(1000);
+                        out.size = 1000 * sizeof(int);
+                        return true;
+                    };
+                    sm.AddState(pick(model));
+                    sm.AddTransition({"run", "Idle", "Model"});
+                    sm.Start();
+                    sm.TriggerEvent("run");
+                }
+                ctx.Check(!pool[0].SetResourceCache(nullptr), "A started machine should keep its cache");
+                ctx.Check(loads == 1 && shared.GetCount() == 1, "One load should serve the pool");
+                ctx.Check(shared.GetPinnedCount() == 1 && shared.GetHits() == 2, "Every member should pin the resource");
+                pool[0].Reset();
+                ctx.Check(shared.Evict("Model") == false, "A resource pinned by members should not be evicted");
+            }
+            ctx.Check(shared.GetPinnedCount() == 0, "Destroyed machines should drop their pins");
+            ctx.Check(shared.Evict("Model") && shared.GetCount() == 0 && shared.GetSize() == 0, "Evict() should drop it");
+        });
+    });
+
+    RunGroup("History compression", passed, failed, [&](auto add) {
+        add("Cycles collapse into runs", [](TestContext& ctx) {
+            StateMachine sm;
+            sm.EnableHistoryCompression();
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            sm.AddState({"Poll", {}, {}});
+            sm.AddTransition({"poll", "Idle", "Poll"});
+            sm.AddTransition({"idle", "Poll", "Idle"});
+            sm.Start();
+            for (int i = 0; i < 50000; ++i) {
+                sm.TriggerEvent("poll");
+                sm.TriggerEvent("idle");
+            }
+            const TransitionHistory& h = sm.GetHistory();
+            ctx.Check(sm.GetHistoryCount() == 100001, "Every hop should still count");
+            ctx.Check(h.GetRunCount() == 2 && h.GetStoredCount() == 3, "The cycle should be stored once");
+            ctx.Check(sm.GetMemoryUsage().history < 1024, "History memory should stay small");
+            ctx.Check(sm.GetHistoryEvent(0) == "__start" && sm.GetHistoryTo(0) == "Idle", "Start record should be intact");
+            ctx.Check(sm.GetHistoryFrom(77777) == "Idle" && sm.GetHistoryEvent(77778) == "idle", "Runs should expand on access");
+            ctx.Check(sm.GoBack() && sm.GetCurrent() == "Poll" && sm.GetHistoryCount() == 100000, "GoBack() should pop one hop");
+            ctx.Check(h.GetRunCount() == 2, "Popping inside a run should not split it");
+        });
+
+        add("Compressed history matches the plain history", [](TestContext& ctx) {
+            StateMachine plain, packed;
+            packed.EnableHistoryCompression();
+            for (StateMachine* sm : {&plain, &packed}) {
+                sm->SetInitial("s0");
+                for (int i = 0; i < 4; ++i)
+                    sm->AddState({Format("s%d", i), {}, {}});
+                for (int i = 0; i < 4; ++i)
+                    for (int j = 0; j < 4; ++j)
+                        sm->AddTransition({Format("to%d", j), Format("s%d", i), Format("s%d", j)});
+                sm->Start();
+            }
+            dword seed = 7;
+            bool same = true;
+            for (int n = 0; n < 5000 && same; ++n) {
+                seed = seed * 1103515245 + 12345;
+                // Favour short cycles so runs form and break often
+                const int r = (seed >> 16) % 16;
+                String ev = Format("to%d", r < 6 ? (n & 1) : r < 9 ? n % 3 : r % 4);
+                if (r == 15) {
+                    plain.GoBack();
+                    packed.GoBack();
+                }
+                else {
+                    plain.TriggerEvent(ev);
+                    packed.TriggerEvent(ev);
+                }
+                same = plain.GetCurrent() == packed.GetCurrent() && plain.GetHistoryCount() == packed.GetHistoryCount();
+                for (int64 i = max((int64)0, plain.GetHistoryCount() - 12); same && i < plain.GetHistoryCount(); ++i)
+                    same = plain.GetHistoryFrom(i) == packed.GetHistoryFrom(i) && plain.GetHistoryTo(i) == packed.GetHistoryTo(i) &&
+                           plain.GetHistoryEvent(i) == packed.GetHistoryEvent(i);
+            }
+            for (int i = 0; same && i < plain.GetHistoryCount(); ++i)
+                same = plain.GetHistoryTo(i) == packed.GetHistoryTo(i) && plain.GetHistoryEvent(i) == packed.GetHistoryEvent(i);
+            ctx.Check(same, "Accessors and GoBack() should agree record for record");
+            ctx.Check(packed.GetHistory().GetStoredCount() < plain.GetHistory().GetStoredCount(), "Packed history should store fewer records");
+            while (plain.CanGoBack() && same) {
+                same = plain.GoBack() && packed.GoBack() && plain.GetCurrent() == packed.GetCurrent();
+            }
+            ctx.Check(same && !packed.CanGoBack() && packed.GetHistoryCount() == 1, "Unwinding should agree to the start");
+        });
+
+        add("Runs shrink and regrow at the top", [](TestContext& ctx) {
+            TransitionHistory h;
+            h.EnableCompression();
+            h.Add("", "A", "__start");
+            for (int i = 0; i < 3; ++i) {
+                h.Add("A", "B", "go");
+                h.Add("B", "A", "back");
+            }
+            ctx.Check(h.GetCount() == 7 && h.GetRunCount() == 2, "A, B cycle should be one run");
+            h.Drop();
+            h.Drop();
+            h.Drop();
+            h.Drop();
+            h.Drop();
+            ctx.Check(h.GetCount() == 2 && h.GetStoredCount() == 2 && h.Top().to == "B", "Dropping into the pattern should trim it");
+            h.Add("B", "C", "next");
+            h.Add("C", "C", "stay");
+            h.Add("C", "C", "stay");
+            h.Add("C", "C", "stay");
+            ctx.Check(h.GetCount() == 6 && h.GetStoredCount() == 4, "A self-loop should be a run of one record");
+            ctx.Check(h[2].to == "C" && h[4].event == "stay" && h.Top().from == "C", "Indexing should follow the runs");
+        });
+    });
+
+    RunGroup("History archive", passed, failed, [&](auto add) {
+        // Removes an archive directory written by these tests
+        auto remove_archive = [](const String& dir, int segments) {
+            FileDelete(dir + "/names.dat");
+            for (int i = 0; i < segments + 1; ++i) {
+                FileDelete(Format("%s/seg-%06d.rec", dir, i));
+                FileDelete(Format("%s/seg-%06d.idx", dir, i));
+            }
+            DirectoryDelete(dir);
+        };
+
+        add("Every commit is archived and range queries match a scan", [&](TestContext& ctx) {
+            const String dir = GetTempFileName("smarchive");
+            int64 now = 0;
+            HistoryArchive archive;
+            archive.SetClock([&] { return now += 10; });
+            archive.SetMaxSegmentRecords(256);
+            ctx.Check(archive.Open(dir), "Open() should create the archive");
+
+            Array<StateMachine> machines;
+            Vector<ArchivedTransition> expected;
+            auto expect = [&](int m, const String& from, const String& to, const String& event) {
+                ArchivedTransition& e = expected.Add();
+                e.time = now;
+                e.machine = Format("m%d", m);
+                e.from = from;
+                e.to = to;
+                e.event = event;
+            };
+            for (int m = 0; m < 3; ++m) {
+                StateMachine& sm = machines.Add();
+                sm.SetHistoryArchive(&archive, Format("m%d", m));
+                sm.SetHistoryWindow(8);
+                sm.SetInitial("Idle");
+                sm.AddState({"Idle", {}, {}});
+                sm.AddState({"Poll", {}, {}});
+                sm.AddTransition({"poll", "Idle", "Poll"});
+                sm.AddTransition({"idle", "Poll", "Idle"});
+                sm.Start();
+                expect(m, "", "Idle", "__start");
+            }
+            for (int n = 0; n < 1500; ++n) {
+                StateMachine& sm = machines[n % 3];
+                const String from = sm.GetCurrent();
+                if (n % 7 == 6 && sm.CanGoBack()) {
+                    sm.GoBack();
+                    expect(n % 3, from, sm.GetCurrent(), "__back");
+                }
+                else {
+                    const String ev = from == "Idle" ? "poll" : "idle";
+                    sm.TriggerEvent(ev);
+                    expect(n % 3, from, sm.GetCurrent(), ev);
+                }
+            }
+            ctx.Check(archive.GetRecordCount() == expected.GetCount(), "Every commit should be archived");
+            ctx.Check(archive.GetSegmentCount() > 5, "Segments should rotate");
+            ctx.Check(machines[0].GetHistoryCount() < 16, "In-memory history should stay within the window");
+
+            bool same = true;
+            for (int64 begin : {0, 15, 2555, 7770, 10000}) {
+                for (int64 end : {begin, begin + 20, begin + 4000, int64(1) << 40}) {
+                    for (const char* machine : {"m1", (const char*)nullptr}) {
+                        Vector<ArchivedTransition> got;
+                        const int n = machine ? archive.Query(machine, begin, end, got) : archive.Query(begin, end, got);
+                        int k = 0;
+                        for (const ArchivedTransition& e : expected) {
+                            if (e.time < begin || e.time >= end || (machine && e.machine != machine))
+                                continue;
+                            same = same && k < got.GetCount() && got[k].time == e.time && got[k].machine == e.machine &&
+                                   got[k].from == e.from && got[k].to == e.to && got[k].event == e.event;
+                            ++k;
+                        }
+                        same = same && n == k && got.GetCount() == k;
+                    }
+                }
+            }
+            ctx.Check(same, "Queries should return exactly the matching records in order");
+            Vector<ArchivedTransition> none;
+            ctx.Check(archive.Query("nobody", 0, now, none) == 0, "Unknown machines should match nothing");
+            const int segments = archive.GetSegmentCount();
+            archive.Close();
+            remove_archive(dir, segments);
+        });
+
+        add("Reopening resumes the archive and drops a torn tail", [&](TestContext& ctx) {
+            const String dir = GetTempFileName("smarchive");
+            int64 now = 1000;
+            HistoryArchive archive;
+            archive.SetClock([&] { return now += 1; });
+            archive.SetMaxSegmentRecords(300);
+            archive.Open(dir);
+            for (int i = 0; i < 500; ++i)
+                archive.Add(i & 1 ? "a" : "b", "X", "Y", Format("e%d", i % 5));
+            archive.Close();
+            {
+                FileAppend torn(Format("%s/seg-%06d.rec", dir, 1));
+                torn.Put(String('\x7f', 13));
+            }
+
+            ctx.Check(archive.Open(dir) && archive.GetSegmentCount() == 2, "Open() should find both segments");
+            ctx.Check(archive.GetRecordCount() == 500, "The torn record should be dropped");
+            archive.Add("a", "Y", "Z", "late");
+            Vector<ArchivedTransition> got;
+            ctx.Check(archive.Query("a", 1491, 2000, got) == 6, "Queries should span old and resumed records");
+            ctx.Check(got.GetCount() == 6 && got.Top().event == "late" && got.Top().time == 1501, "Resumed records keep time order");
+            ctx.Check(got[0].event == "e1" && got[0].from == "X", "Names should reload from disk");
+            const int segments = archive.GetSegmentCount();
+            archive.Close();
+            remove_archive(dir, segments);
+
+            HistoryArchive closed;
+            ctx.Check(!closed.Add("a", "X", "Y", "e"), "A closed archive should refuse records");
+            ctx.Check(closed.GetLastError() == StateMachineError::ArchiveFailed, "Error should be ArchiveFailed");
+        });
+
+        add("A history window keeps GoBack() working", [](TestContext& ctx) {
+            StateMachine sm;
+            sm.SetHistoryWindow(4);
+            sm.SetInitial("s0");
+            for (int i = 0; i < 10; ++i)
+                sm.AddState({Format("s%d", i), {}, {}});
+            for (int i = 0; i < 10; ++i)
+                sm.AddTransition({"next", Format("s%d", i), Format("s%d", (i + 1) % 10)});
+            sm.Start();
+            for (int i = 0; i < 25; ++i)
+                sm.TriggerEvent("next");
+            ctx.Check(sm.GetHistoryCount() >= 4 && sm.GetHistoryCount() < 8, "History should stay within twice the window");
+            ctx.Check(sm.GetHistoryTo(sm.GetHistoryCount() - 1) == "s5", "The newest record should be kept");
+            ctx.Check(sm.GoBack() && sm.GetCurrent() == "s4", "GoBack() should use the kept records");
+            ctx.Check(sm.GoBack() && sm.GetCurrent() == "s3", "GoBack() should step again");
+        });
+    });
+
+    RunGroup("State data", passed, failed, [&](auto add) {
+        add("A state's data lives from its entry until the next state is entered", [](TestContext& ctx) {
+            TrackedData::live = 0;
+            StateMachine sm;
+            sm.SetInitial("Idle");
+            sm.AddState({"Idle", {}, {}});
+            bool seen_on_enter = false;
+            bool seen_on_exit = false;
+            State retry{"Retry", [&](StateMachine& m, Function<void(bool)> done) {
+                TrackedData* d = m.GetStateData<TrackedData>();
+                seen_on_enter = d && d->tries == 0 && TrackedData::live == 1;
+                done(true);
+            }, [&](StateMachine& m, Function<void(bool)> done) {
+                TrackedData* d = m.GetStateData<TrackedData>();
+                seen_on_exit = d && d->tries == 3;
+                done(true);
+            }};
+            retry.data = StateDataType::Of<TrackedData>();
+            sm.AddState(pick(retry));
+            sm.AddTransition({"go", "Idle", "Retry"});
+            Transition again{"again", "Retry", "Retry"};
+            again.OnBefore = [](const TransitionContext& c) { c.Data<TrackedData>().tries += 10; };
+            sm.AddTransition(pick(again));
+            Transition give_up{"give_up", "Retry", "Idle"};
+            give_up.Guard = [](const TransitionContext& c) { return ++c.Data<TrackedData>().tries >= 3; };
+            sm.AddTransition(pick(give_up));
+            sm.Start();
+
+            ctx.Check(!sm.GetStateData<TrackedData>() && TrackedData::live == 0, "Idle should have no data");
+            ctx.Check(sm.TriggerEvent("go") && seen_on_enter, "OnEnter should see a fresh block");
+            ctx.Check(!sm.GetStateData<int>(), "Another type should not match");
+            ctx.Check(sm.TriggerEvent("again") && sm.GetStateData<TrackedData>()->tries == 0, "Re-entering should start a new block");
+            ctx.Check(TrackedData::live == 1, "The old block should be destroyed after the entry");
+            ctx.Check(!sm.TriggerEvent("give_up") && !sm.TriggerEvent("give_up"), "Guards should count in the current block");
+            ctx.Check(sm.GetStateData<TrackedData>()->tries == 2, "The block should keep the count");
+            ctx.Check(sm.TriggerEvent("give_up") && seen_on_exit, "OnExit should see the block");
+            ctx.Check(TrackedData::live == 0 && !sm.GetStateData<TrackedData>(), "Leaving should destroy the block");
+        });
+
+        add("A failed entry keeps the source's data", [](TestContext& ctx) {
+            TrackedData::live = 0;
+            StateMachine sm;
+            sm.SetInitial("A");
+            State a{"A", {}, {}};
+            a.data = StateDataType::Of<TrackedData>();
+            sm.AddState(pick(a));
+            bool target_saw_block = false;
+            State b{"B", [&](StateMachine& m, Function<void(bool)> done) {
+                target_saw_block = m.GetStateData<TrackedData>() != nullptr;
+                done(false);
+            }, {}};
+            b.data = StateDataType::Of<TrackedData>();
+            sm.AddState(pick(b));
+            sm.AddTransition({"go", "A", "B"});
+            sm.Start();
+
+            sm.GetStateData<TrackedData>()->tries = 7;
+            ctx.Check(TrackedData::live == 1, "Start() should construct the initial block");
+            sm.TriggerEvent("go");
+            ctx.Check(sm.GetLastError() == StateMachineError::EnterFailed && target_saw_block, "B's OnEnter should run with its block");
+            ctx.Check(sm.GetCurrent() == "A" && sm.GetStateData<TrackedData>()->tries == 7, "A's block should survive");
+            ctx.Check(TrackedData::live == 1, "B's block should be destroyed");
+            ctx.Check(sm.Reset() && TrackedData::live == 0, "Reset() should destroy the block");
+        });
+
+        add("Large and over-aligned blocks are supported", [](TestContext& ctx) {
+            struct Large { char bytes[StateDataSlot::INLINE_SIZE * 4] = {}; int last = 5; };
+            struct alignas(64) Aligned { int value = 9; };
+            StateMachine sm;
+            sm.SetInitial("L");
+            State l{"L", {}, {}};
+            l.data = StateDataType::Of<Large>();
+            sm.AddState(pick(l));
+            State al{"Al", {}, {}};
+            al.data = StateDataType::Of<Aligned>();
+            sm.AddState(pick(al));
+            sm.AddTransition({"go", "L", "Al"});
+            sm.Start();
+
+            Large* large = sm.GetStateData<Large>();
+            ctx.Check(large && large->last == 5, "A large block should be constructed");
+            sm.TriggerEvent("go");
+            Aligned* aligned = sm.GetStateData<Aligned>();
+            ctx.Check(aligned && aligned->value == 9, "An over-aligned block should be constructed");
+            ctx.Check(aligned && uintptr_t(aligned) % 64 == 0, "Its alignment should be honoured");
+        });
+    });
+
     Cout() << "\n----------------------------------------\n";
     Cout() << "StateMachineCoreTest summary\n";
     Cout() << "Passed: " << passed << "\n";
@@ -0,0 +1,260 @@
+#ifndef _StateMachineFuzz_FuzzTargets_h_
+#define _StateMachineFuzz_FuzzTargets_h_
+
+/*
+    Apache License 2.0
+
+    FuzzTargets
+    ===========
+
+    Purpose
+    - Decode a fuzzer input into calls on the public StateMachine and
+      DefinitionImporter API, and check the invariants that must hold after
+      every call.
+
+    Intent
+    - Header-only, so StateMachineCoreTest can replay the same inputs as
+      regression seeds without linking the fuzz driver.
+    - Every input can be replayed at a scale factor. Scale s makes the
+      definition s times larger and repeats each dispatch call s times, so a
+      linear path does s times the work. The driver compares the cost per
+      operation across scales to find algorithmic cliffs.
+    - Total work is bounded: at most MAX_FUZZ_OPS decoded calls per input.
+
+    Input layout
+    - Byte 0 picks the target: machine program, JSON import, SCXML import.
+    - Machine program: state count, event count, then one byte per call plus
+      its operands. Exhausted input reads as zeros.
+    - Import targets: the remaining bytes are the document text.
+*/
+
+#include <Core/Core.h>
+#include <statemachine/statemachine.h>
+#include <statemachine/definitionimporter.h>
+
+namespace Upp {
+
+enum FuzzTarget { FUZZ_MACHINE, FUZZ_IMPORT_JSON, FUZZ_IMPORT_SCXML, FUZZ_TARGET_COUNT };
+
+static constexpr int MAX_FUZZ_OPS = 512;
+
+/// Reads an input as small integers; exhausted input reads as 0
+class FuzzReader {
+public:
+    FuzzReader(const byte* data, int size) : data(data), size(size) {}
+
+    bool IsEof() const                   { return pos >= size; }
+    int  Get(int range)                  { return range > 0 && pos < size ? data[pos++] % range : 0; }
+    String GetRest()                     { String s((const char*)data + pos, size - pos); pos = size; return s; }
+
+private:
+    const byte* data;
+    int         size;
+    int         pos = 0;
+};
+
+/// What one replay did, and whether every invariant held
+struct FuzzResult {
+    bool   ok = true;
+    String failure;        // first broken invariant
+    int64  operations = 0; // public API calls issued
+    int64  memory = 0;     // peak StateMachine::GetMemoryUsage().GetTotal()
+};
+
+class FuzzMachine {
+public:
+    FuzzMachine(FuzzReader& r, int scale, FuzzResult& result) : r(r), scale(scale), result(result) {}
+
+    void Run() {
+        state_count = 2 + r.Get(14);
+        event_count = 1 + r.Get(6);
+        for (int i = 0; i < state_count * scale; ++i)
+            ids.Add(Format("s%d", i));
+        for (int i = 0; i < event_count; ++i)
+            events.Add(Format("e%d", i));
+        AddStates();
+        sm.SetInitial(ids[0]);
+        for (int n = 0; n < MAX_FUZZ_OPS && !r.IsEof() && result.ok; ++n) {
+            Step(r.Get(15));
+            Check();
+        }
+        // Let held callbacks finish, as an owner shutting down would
+        hold = false;
+        while (!pending.IsEmpty() && result.ok) {
+            Function<void(bool)> done = pending.Pop();
+            done(true);
+            Check();
+        }
+    }
+
+private:
+    void Step(int op) {
+        const int event = r.Get(event_count);
+        const int from = r.Get(state_count);
+        const int to = r.Get(state_count);
+        const int arg = r.Get(8);
+        switch (op) {
+        case 0:
+        case 1:
+            // One edge per block of states, so the definition grows with scale
+            for (int b = 0; b < scale; ++b) {
+                Transition t;
+                t.event = events[event];
+                t.from = ids[b * state_count + from];
+                t.to = ids[b * state_count + (arg & 1 ? from : to)];
+                if (op == 1) {
+                    t.Guard = [this](const TransitionContext&) { return pass; };
+                    Call(sm.AddChoice(t));
+                }
+                else
+                    Call(sm.AddTransition(t));
+            }
+            // Bridge blocks so dispatch can reach every one of them
+            if (scale > 1 && arg == 7)
+                for (int b = 0; b < scale; ++b)
+                    Call(sm.AddTransition({"next", ids[b * state_count], ids[(b + 1) % scale * state_count], {}, {}, {}}));
+            break;
+        case 2:
+            Call(sm.Start());
+            break;
+        case 3:
+        case 4:
+            for (int i = 0; i < scale; ++i)
+                Call(sm.TriggerEvent(events[event]));
+            break;
+        case 5:
+            for (int i = 0; i < scale; ++i)
+                Call(sm.TriggerEvent("next"));
+            break;
+        case 6:
+            for (int i = 0; i < scale; ++i)
+                Call(sm.GoBack());
+            break;
+        case 7:
+            hold = !hold;
+            break;
+        case 8:
+            for (int i = 0; i < scale && !pending.IsEmpty(); ++i) {
+                Function<void(bool)> done = pending.Pop();
+                ++result.operations;
+                done(arg != 0);
+            }
+            break;
+        case 9:
+            sm.SetMaxQueuedEvents(arg * scale);
+            ++result.operations;
+            break;
+        case 10:
+            sm.SetEventPolicy((EventPolicy)(arg % 4));
+            ++result.operations;
+            break;
+        case 11:
+            sm.SetQueueOverflowPolicy((QueueOverflowPolicy)(arg % 4));
+            sm.SetMaxSpilledEvents(arg * scale);
+            result.operations += 2;
+            break;
+        case 12:
+            pass = !pass;
+            break;
+        case 13:
+            Call(sm.TryTransition({events[event], ids[from], ids[to], {}, {}, {}}));
+            break;
+        default:
+            if (arg & 1)
+                Call(sm.Reset());
+            else {
+                Call(sm.Clear());
+                AddStates();
+                sm.SetInitial(ids[0]);
+            }
+            break;
+        }
+    }
+
+    void AddStates() {
+        for (const String& id : ids) {
+            auto held = [this](StateMachine&, Function<void(bool)> done) {
+                if (hold)
+                    pending.Add(pick(done));
+                else
+                    done(true);
+            };
+            Call(sm.AddState({id, held, held}));
+        }
+    }
+
+    void Call(bool)                      { ++result.operations; }
+
+    void Check() {
+        if (sm.GetQueuedEventCount() > sm.GetMaxQueuedEvents())
+            Fail("queue exceeds its limit");
+        else if (sm.GetSpilledEventCount() > sm.GetMaxSpilledEvents())
+            Fail("spill buffer exceeds its limit");
+        else if (sm.IsStarted() && !sm.IsTransitioning() && !sm.HasState(sm.GetCurrent()))
+            Fail("current state '" + sm.GetCurrent() + "' is not a state");
+        else if (sm.GetStateCount() != ids.GetCount())
+            Fail("state count changed");
+        result.memory = max(result.memory, sm.GetMemoryUsage().GetTotal());
+    }
+
+    void Fail(const String& why) {
+        result.ok = false;
+        result.failure = why;
+    }
+
+    FuzzReader&                  r;
+    int                          scale;
+    FuzzResult&                  result;
+    StateMachine                 sm;
+    Vector<String>               ids;
+    Vector<String>               events;
+    Vector<Function<void(bool)>> pending;   // held OnEnter / OnExit completions
+    int                          state_count = 0;
+    int                          event_count = 0;
+    bool                         hold = false;
+    bool                         pass = true;
+};
+
+inline void FuzzImport(const String& text, bool scxml, FuzzResult& result) {
+    StateMachine sm;
+    DefinitionImporter importer;
+    const bool ok = scxml ? importer.LoadScxml(sm, text) : importer.LoadJson(sm, text);
+    result.operations += text.GetLength() + 1;
+    if (ok && (importer.GetLastError() != StateMachineError::None || !sm.HasState(sm.GetInitial()))) {
+        result.ok = false;
+        result.failure = "accepted definition is inconsistent";
+    }
+    if (!ok && (sm.GetStateCount() || sm.GetTransitionCount())) {
+        result.ok = false;
+        result.failure = "failed import left a definition behind";
+    }
+    if (ok && !sm.Start()) {
+        result.ok = false;
+        result.failure = "imported machine does not start";
+    }
+    result.memory = sm.GetMemoryUsage().GetTotal();
+}
+
+/// Replay one input at the given scale
+inline FuzzResult RunFuzzInput(const byte* data, int size, int scale = 1) {
+    FuzzResult result;
+    FuzzReader r(data, size);
+    switch (r.Get(FUZZ_TARGET_COUNT)) {
+    case FUZZ_MACHINE: {
+        FuzzMachine m(r, max(scale, 1), result);
+        m.Run();
+        break;
+    }
+    case FUZZ_IMPORT_JSON:
+        FuzzImport(r.GetRest(), false, result);
+        break;
+    default:
+        FuzzImport(r.GetRest(), true, result);
+        break;
+    }
+    return result;
+}
+
+}
+
+#endif
@@ -0,0 +1,176 @@
+/*
+    License
+    - Apache License 2.0, matching this repository's LICENSE file.
+
+    StateMachineFuzz
+    ================
+
+    Purpose
+    - Fuzz the public StateMachine and DefinitionImporter API for crashes,
+      broken invariants, and algorithmic performance cliffs.
+
+    Intent
+    - Each input is replayed at a small and a large scale (FuzzTargets.h).
+      The cost per API call, in thread CPU time and in peak machine memory,
+      should stay flat for linear paths. An input whose per-call cost grows
+      more than CLIFF_RATIO times between the two scales is reported as
+      superlinear, e.g. a Remove(0) drain or a linear lookup per event.
+    - Reported inputs become regression seeds in StateMachineCoreTest's
+      "Fuzz regressions" group.
+
+    Build
+    - Default: a standalone console driver, no fuzzing engine required.
+    - LIBFUZZER flag: exports LLVMFuzzerTestOneInput for clang's libFuzzer
+      (-fsanitize=fuzzer,address). Crashes, invariant failures and cliffs all
+      abort, so libFuzzer keeps them as crash-* artifacts.
+
+    Usage
+    - StateMachineFuzz [--runs N] [--seed S] [--save DIR] [FILE...]
+    - Files are replayed; without files, N random inputs are generated from
+      seed S. --save writes every reported input to DIR.
+    - libFuzzer build: StateMachineFuzz -max_len=512 -timeout=5 CORPUS_DIR
+*/
+
+#include <Core/Core.h>
+
+#include "FuzzTargets.h"
+
+#ifdef PLATFORM_POSIX
+#include <time.h>
+#endif
+
+using namespace Upp;
+
+static constexpr int    SMALL_SCALE = 2;
+static constexpr int    LARGE_SCALE = 16;
+static constexpr double CLIFF_RATIO = 3.0;
+// Below this much CPU time at the large scale, timing noise dominates
+static constexpr int64  CLIFF_MIN_NS = 2000000;
+
+static int64 ThreadNanos()
+{
+#ifdef PLATFORM_POSIX
+    timespec ts;
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return int64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+    return usecs() * 1000;
+}
+
+struct FuzzCost {
+    FuzzResult result;
+    int64      nanos = 0;    // best of two replays
+};
+
+static FuzzCost Measure(const byte* data, int size, int scale)
+{
+    FuzzCost cost;
+    for(int pass = 0; pass < 2; pass++) {
+        int64 t0 = ThreadNanos();
+        cost.result = RunFuzzInput(data, size, scale);
+        int64 t = ThreadNanos() - t0;
+        if(pass == 0 || t < cost.nanos)
+            cost.nanos = t;
+        if(!cost.result.ok)
+            break;
+    }
+    return cost;
+}
+
+// Empty when the input is fine, otherwise why it is reported
+static String CheckInput(const byte* data, int size)
+{
+    FuzzCost small = Measure(data, size, SMALL_SCALE);
+    if(!small.result.ok)
+        return "invariant: " + small.result.failure;
+    FuzzCost large = Measure(data, size, LARGE_SCALE);
+    if(!large.result.ok)
+        return "invariant: " + large.result.failure;
+
+    double ops_small = (double)max(small.result.operations, (int64)1);
+    double ops_large = (double)max(large.result.operations, (int64)1);
+    double time_ratio = (large.nanos / ops_large) / max(small.nanos / ops_small, 1.0);
+    if(large.nanos >= CLIFF_MIN_NS && time_ratio > CLIFF_RATIO)
+        return Format("superlinear time: %.1fx per call at scale %d vs %d", time_ratio, LARGE_SCALE, SMALL_SCALE);
+    double memory_ratio = (large.result.memory / ops_large) / max(small.result.memory / ops_small, 1.0);
+    if(memory_ratio > CLIFF_RATIO)
+        return Format("superlinear memory: %.1fx per call at scale %d vs %d", memory_ratio, LARGE_SCALE, SMALL_SCALE);
+    return String();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    String why = CheckInput(data, (int)min(size, (size_t)1 << 20));
+    if(!why.IsEmpty()) {
+        Cerr() << "StateMachineFuzz: " << why << "\n";
+        abort();
+    }
+    return 0;
+}
+
+#ifndef flagLIBFUZZER
+
+// C++ initializer for a CoreTest seed
+static String SeedLiteral(const String& input)
+{
+    String s = "{";
+    for(int i = 0; i < input.GetLength(); i++)
+        s << (i ? ", " : "") << Format("0x%02x", (byte)input[i]);
+    return s + "}";
+}
+
+CONSOLE_APP_MAIN
+{
+    int runs = 10000;
+    uint64 seed = 1;
+    String save;
+    Vector<String> files;
+    const Vector<String>& args = CommandLine();
+    for(int i = 0; i < args.GetCount(); i++) {
+        if(args[i] == "--runs" && i + 1 < args.GetCount())
+            runs = max(1, atoi(args[++i]));
+        else if(args[i] == "--seed" && i + 1 < args.GetCount())
+            seed = max(1, atoi(args[++i]));
+        else if(args[i] == "--save" && i + 1 < args.GetCount())
+            save = args[++i];
+        else
+            files.Add(args[i]);
+    }
+
+    int reported = 0;
+    auto check = [&](const String& name, const String& input) {
+        String why = CheckInput((const byte*)input.Begin(), input.GetLength());
+        if(why.IsEmpty())
+            return;
+        reported++;
+        Cout() << name << ": " << why << "\n  seed " << SeedLiteral(input) << "\n";
+        if(!save.IsEmpty())
+            SaveFile(Format("%s/slow-%d.bin", save, reported), input);
+    };
+
+    for(const String& file : files)
+        check(file, LoadFile(file));
+
+    if(files.IsEmpty()) {
+        // xorshift64, so a run is reproducible from its seed
+        auto next = [&] {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            return seed;
+        };
+        for(int n = 0; n < runs; n++) {
+            String input;
+            int len = 1 + int(next() % 256);
+            for(int i = 0; i < len; i++)
+                input.Cat(char(next()));
+            check(Format("run %d", n), input);
+        }
+    }
+
+    Cout() << "StateMachineFuzz inputs=" << (files.IsEmpty() ? runs : files.GetCount())
+           << " reported=" << reported << "\n";
+    SetExitCode(reported ? 1 : 0);
+}
+
+#endif